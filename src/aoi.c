@@ -0,0 +1,341 @@
+/* area-of-interest processing: a polygon layer or bbox is cut into
+ * windows on the esa pixel grid, sized to a per-window memory budget,
+ * that take the place of blocks; windows that miss every polygon are
+ * dropped and pixels outside the polygons are masked to nodata */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+#include "global.h"
+
+/* working bytes per pixel of a window: esa, soil, keys, cn, mask */
+#define AOI_PIXEL_BYTES 5
+
+/* aoi polygons in the esa crs; none for a bbox aoi */
+static OGRGeometryH *aoi_geoms = NULL;
+static int n_aoi_geoms = 0;
+
+/* window envelopes (4 per window) and whether a window lies wholly
+ * inside one polygon, so it needs no mask */
+static double *tile_bboxes = NULL;
+static bool *tile_inside = NULL;
+static int n_tiles = 0;
+
+/* parse "minx,miny,maxx,maxy"; false if spec is not a bbox */
+static bool parse_bbox(const char *spec, double *bbox)
+{
+    int n = 0;
+
+    if (sscanf(spec, "%lf,%lf,%lf,%lf%n", &bbox[0], &bbox[1], &bbox[2],
+               &bbox[3], &n) != 4 || spec[n])
+        return false;
+    return bbox[2] > bbox[0] && bbox[3] > bbox[1];
+}
+
+/* polygon of an envelope */
+static OGRGeometryH rect_geometry(const double *bbox)
+{
+    OGRGeometryH poly, ring;
+
+    ring = OGR_G_CreateGeometry(wkbLinearRing);
+    OGR_G_AddPoint_2D(ring, bbox[0], bbox[1]);
+    OGR_G_AddPoint_2D(ring, bbox[2], bbox[1]);
+    OGR_G_AddPoint_2D(ring, bbox[2], bbox[3]);
+    OGR_G_AddPoint_2D(ring, bbox[0], bbox[3]);
+    OGR_G_AddPoint_2D(ring, bbox[0], bbox[1]);
+    poly = OGR_G_CreateGeometry(wkbPolygon);
+    OGR_G_AddGeometryDirectly(poly, ring);
+    return poly;
+}
+
+/* load every polygon of the first layer of path, reprojected to the
+ * esa crs when the layer declares a different one; env receives
+ * their joint envelope */
+static bool load_geometries(const char *path, const char *esa_wkt,
+                            double *env)
+{
+    OGRDataSourceH ds;
+    OGRLayerH layer;
+    OGRFeatureH feat;
+    OGRSpatialReferenceH lsrs, esrs;
+    OGRCoordinateTransformationH ct = NULL;
+    OGRGeometryH g;
+    OGREnvelope e;
+    int cap = 0;
+    char msg[PATH_MAX + 64];
+
+    ds = OGROpen(path, FALSE, NULL);
+    if (!ds) {
+        snprintf(msg, sizeof(msg), "ogr open failed: %s", path);
+        log_message("ERROR", msg, true);
+        return false;
+    }
+    layer = OGR_DS_GetLayer(ds, 0);
+
+    lsrs = OGR_L_GetSpatialRef(layer);
+    esrs = OSRNewSpatialReference(esa_wkt);
+    if (lsrs && esrs && !OSRIsSame(lsrs, esrs)) {
+        OSRSetAxisMappingStrategy(esrs, OAMS_TRADITIONAL_GIS_ORDER);
+        ct = OCTNewCoordinateTransformation(lsrs, esrs);
+        if (!ct) {
+            snprintf(msg, sizeof(msg), "cannot reproject %s to the esa crs",
+                     path);
+            log_message("ERROR", msg, true);
+            OSRDestroySpatialReference(esrs);
+            OGR_DS_Destroy(ds);
+            return false;
+        }
+    }
+
+    env[0] = env[1] = HUGE_VAL;
+    env[2] = env[3] = -HUGE_VAL;
+    OGR_L_ResetReading(layer);
+    while ((feat = OGR_L_GetNextFeature(layer))) {
+        g = OGR_F_GetGeometryRef(feat);
+        if (g && !OGR_G_IsEmpty(g)) {
+            g = OGR_G_Clone(g);
+            if (ct && OGR_G_Transform(g, ct) != OGRERR_NONE) {
+                OGR_G_DestroyGeometry(g);
+                OGR_F_Destroy(feat);
+                continue;
+            }
+            if (n_aoi_geoms == cap) {
+                cap = cap ? cap * 2 : 16;
+                aoi_geoms = realloc(aoi_geoms, cap * sizeof(*aoi_geoms));
+                if (!aoi_geoms) {
+                    log_message("ERROR", "malloc failed for aoi polygons",
+                                true);
+                    MPI_Abort(MPI_COMM_WORLD, 1);
+                }
+            }
+            aoi_geoms[n_aoi_geoms++] = g;
+            OGR_G_GetEnvelope(g, &e);
+            env[0] = fmin(env[0], e.MinX);
+            env[1] = fmin(env[1], e.MinY);
+            env[2] = fmax(env[2], e.MaxX);
+            env[3] = fmax(env[3], e.MaxY);
+        }
+        OGR_F_Destroy(feat);
+    }
+
+    if (ct)
+        OCTDestroyCoordinateTransformation(ct);
+    if (esrs)
+        OSRDestroySpatialReference(esrs);
+    OGR_DS_Destroy(ds);
+
+    if (!n_aoi_geoms) {
+        snprintf(msg, sizeof(msg), "no polygons found in %s", path);
+        log_message("ERROR", msg, true);
+        return false;
+    }
+    return true;
+}
+
+/* test a window against the aoi polygons: 0 = outside all of them,
+ * 1 = partly covered, 2 = inside one polygon */
+static int tile_cover(const double *bbox)
+{
+    OGRGeometryH rect;
+    OGREnvelope e;
+    int i, cover = 0;
+
+    if (!n_aoi_geoms)
+        return 2;
+    rect = rect_geometry(bbox);
+    for (i = 0; i < n_aoi_geoms && cover < 2; i++) {
+        OGR_G_GetEnvelope(aoi_geoms[i], &e);
+        if (e.MaxX < bbox[0] || e.MinX > bbox[2] || e.MaxY < bbox[1] ||
+            e.MinY > bbox[3])
+            continue;
+        if (OGR_G_Contains(aoi_geoms[i], rect))
+            cover = 2;
+        else if (OGR_G_Intersects(aoi_geoms[i], rect))
+            cover = 1;
+    }
+    OGR_G_DestroyGeometry(rect);
+    return cover;
+}
+
+/* cut the aoi (vector path or "minx,miny,maxx,maxy" in the esa crs)
+ * into windows of at most aoi_tile_mb of working memory, snapped to
+ * the esa pixel grid; returns window ids 1..n. every rank computes
+ * the same windows independently */
+int *aoi_tiles(const char *spec, int *n)
+{
+    GDALDatasetH esa;
+    double t[6], env[4], px, step, *bb;
+    long long x0, y0, x1, y1, tx, ty, side, budget;
+    int *ids, cap = 0, cover;
+    bool *in;
+    char msg[PATH_MAX + 128];
+
+    *n = 0;
+    GDALAllRegister();
+    OGRRegisterAll();
+
+    /* the esa grid defines window edges */
+    esa = GDALOpen(esa_data_path, GA_ReadOnly);
+    if (!esa || GDALGetGeoTransform(esa, t) != CE_None) {
+        snprintf(msg, sizeof(msg), "cannot read esa grid from %s",
+                 esa_data_path);
+        log_message("ERROR", msg, true);
+        if (esa)
+            GDALClose(esa);
+        return NULL;
+    }
+
+    if (!parse_bbox(spec, env) &&
+        !load_geometries(spec, GDALGetProjectionRef(esa), env)) {
+        GDALClose(esa);
+        return NULL;
+    }
+    GDALClose(esa);
+
+    /* aoi envelope in native pixels */
+    x0 = (long long)floor((env[0] - t[0]) / t[1]);
+    x1 = (long long)ceil((env[2] - t[0]) / t[1]);
+    y0 = (long long)floor((env[3] - t[3]) / t[5]);
+    y1 = (long long)ceil((env[1] - t[3]) / t[5]);
+
+    /* square windows whose output pixel count fits the budget; with
+     * target_res the native side grows by the decimation factor */
+    px = t[1];
+    step = target_res > px ? target_res / px : 1.0;
+    budget = (long long)aoi_tile_mb * 1024 * 1024 / AOI_PIXEL_BYTES;
+    side = (long long)(sqrt((double)budget) * step);
+    if (side < 1)
+        side = 1;
+
+    ids = NULL;
+    for (ty = y0; ty < y1; ty += side) {
+        for (tx = x0; tx < x1; tx += side) {
+            double b[4];
+
+            /* edges move a quarter pixel inwards so the window read
+             * covers exactly these pixels despite rounding */
+            b[0] = t[0] + (tx + 0.25) * t[1];
+            b[2] = t[0] + ((tx + side < x1 ? tx + side : x1) - 0.25) * t[1];
+            b[3] = t[3] + (ty + 0.25) * t[5];
+            b[1] = t[3] + ((ty + side < y1 ? ty + side : y1) - 0.25) * t[5];
+            cover = tile_cover(b);
+            if (!cover)
+                continue;
+
+            if (n_tiles == cap) {
+                cap = cap ? cap * 2 : 64;
+                bb = realloc(tile_bboxes, (size_t)cap * 4 * sizeof(double));
+                in = realloc(tile_inside, (size_t)cap * sizeof(bool));
+                ids = realloc(ids, (size_t)cap * sizeof(int));
+                if (!bb || !in || !ids) {
+                    log_message("ERROR", "malloc failed for aoi windows",
+                                true);
+                    MPI_Abort(MPI_COMM_WORLD, 1);
+                }
+                tile_bboxes = bb;
+                tile_inside = in;
+            }
+            memcpy(tile_bboxes + 4 * n_tiles, b, sizeof(b));
+            tile_inside[n_tiles] = cover == 2;
+            ids[n_tiles] = n_tiles + 1;
+            n_tiles++;
+        }
+    }
+
+    if (!n_tiles) {
+        snprintf(msg, sizeof(msg), "aoi %s does not overlap the esa grid",
+                 spec);
+        log_message("ERROR", msg, true);
+    }
+    *n = n_tiles;
+    return ids;
+}
+
+/* envelope of window id */
+bool aoi_tile_bbox(int id, double *bbox)
+{
+    char msg[64];
+
+    if (id < 1 || id > n_tiles) {
+        snprintf(msg, sizeof(msg), "aoi window %d not found", id);
+        log_message("ERROR", msg, true);
+        return false;
+    }
+    memcpy(bbox, tile_bboxes + 4 * (id - 1), 4 * sizeof(double));
+    return true;
+}
+
+/* envelopes of windows ids, as get_block_bboxes */
+double *aoi_tile_bboxes(const int *ids, int n)
+{
+    double *bboxes;
+    int i;
+
+    bboxes = malloc((size_t)n * 4 * sizeof(double));
+    if (!bboxes) {
+        log_message("ERROR", "malloc failed for aoi envelopes", true);
+        MPI_Abort(MPI_COMM_WORLD, 1);
+    }
+    for (i = 0; i < n; i++) {
+        if (!aoi_tile_bbox(ids[i], bboxes + 4 * i))
+            bboxes[4 * i] = bboxes[4 * i + 1] = bboxes[4 * i + 2] =
+                bboxes[4 * i + 3] = NAN;
+    }
+    return bboxes;
+}
+
+/* set soil to 0 (no valid group, so nodata keys) on pixels of window
+ * id's grid (xsize x ysize, gt) whose centres fall outside the aoi */
+void aoi_mask(int id, const double *gt, int xsize, int ysize, uint8_t *soil)
+{
+    GDALDatasetH mem;
+    uint8_t *mask;
+    double mgt[6], *burn;
+    size_t i, npix;
+    int band = 1, g;
+    char msg[128];
+
+    if (id < 1 || id > n_tiles || tile_inside[id - 1])
+        return;
+
+    npix = (size_t)xsize * ysize;
+    mask = malloc(npix);
+    burn = malloc(n_aoi_geoms * sizeof(double));
+    if (!mask || !burn) {
+        snprintf(msg, sizeof(msg), "malloc failed for aoi mask, window %d",
+                 id);
+        log_message("ERROR", msg, true);
+        MPI_Abort(MPI_COMM_WORLD, 1);
+    }
+
+    mem = GDALCreate(GDALGetDriverByName("MEM"), "", xsize, ysize, 1,
+                     GDT_Byte, NULL);
+    if (!mem) {
+        log_message("ERROR", "cannot create aoi mask raster", true);
+        MPI_Abort(MPI_COMM_WORLD, 1);
+    }
+    for (g = 0; g < n_aoi_geoms; g++)
+        burn[g] = 1;
+    memcpy(mgt, gt, sizeof(mgt));
+    GDALSetGeoTransform(mem, mgt);
+    if (GDALRasterizeGeometries(mem, 1, &band, n_aoi_geoms, aoi_geoms,
+                                NULL, NULL, burn, NULL, NULL,
+                                NULL) != CE_None ||
+        GDALRasterIO(GDALGetRasterBand(mem, 1), GF_Read, 0, 0, xsize, ysize,
+                     mask, xsize, ysize, GDT_Byte, 0, 0) != CE_None) {
+        snprintf(msg, sizeof(msg), "aoi rasterization failed, window %d",
+                 id);
+        log_message("ERROR", msg, true);
+        GDALClose(mem);
+        MPI_Abort(MPI_COMM_WORLD, 1);
+    }
+    GDALClose(mem);
+
+    for (i = 0; i < npix; i++) {
+        if (!mask[i])
+            soil[i] = 0;
+    }
+    free(mask);
+    free(burn);
+}
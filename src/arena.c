@@ -0,0 +1,136 @@
+/* per-rank buffer arena: block-sized working buffers are kept in named
+ * slots and reused across scenarios and blocks, growing only when a
+ * larger block arrives. this avoids an mmap/munmap and a fresh round of
+ * zero-filled page faults for every scenario of every block */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include "global.h"
+#ifndef _WIN32
+#include <sys/mman.h>
+#include <sys/resource.h>
+#endif
+
+/* simd-friendly alignment for small buffers */
+#define ARENA_ALIGN 64
+
+/* buffers at least this large are aligned to it and offered to the
+ * kernel as transparent hugepage candidates */
+#define ARENA_HUGE ((size_t)2 << 20)
+
+static void *slot_buf[ARENA_SLOTS];
+static size_t slot_cap[ARENA_SLOTS];
+
+/* requests served, and requests that had to (re)allocate, per slot
+ * so that threads reading into different slots do not share them */
+static long long slot_requests[ARENA_SLOTS];
+static long long slot_grows[ARENA_SLOTS];
+
+static void *aligned_alloc_bytes(size_t size, size_t align)
+{
+#ifdef _WIN32
+    return _aligned_malloc(size, align);
+#else
+    void *p;
+
+    return posix_memalign(&p, align, size) ? NULL : p;
+#endif
+}
+
+static void aligned_free(void *p)
+{
+#ifdef _WIN32
+    _aligned_free(p);
+#else
+    free(p);
+#endif
+}
+
+/* buffer of at least size bytes for slot; contents are undefined and
+ * the buffer stays owned by the arena until the next call for slot */
+void *arena_get(int slot, size_t size)
+{
+    size_t cap, align;
+    char msg[128];
+
+    slot_requests[slot]++;
+    if (size <= slot_cap[slot])
+        return slot_buf[slot];
+
+    /* grow to whole hugepages, or cache lines for small buffers */
+    align = size >= ARENA_HUGE ? ARENA_HUGE : ARENA_ALIGN;
+    cap = (size + align - 1) / align * align;
+
+    aligned_free(slot_buf[slot]);
+    slot_buf[slot] = aligned_alloc_bytes(cap, align);
+    if (!slot_buf[slot]) {
+        snprintf(msg, sizeof(msg), "malloc failed for %zu byte buffer",
+                 cap);
+        log_message("ERROR", msg, true);
+        MPI_Abort(MPI_COMM_WORLD, 1);
+    }
+#if !defined(_WIN32) && defined(MADV_HUGEPAGE)
+    if (align == ARENA_HUGE)
+        madvise(slot_buf[slot], cap, MADV_HUGEPAGE);
+#endif
+    slot_cap[slot] = cap;
+    slot_grows[slot]++;
+    return slot_buf[slot];
+}
+
+/* free every slot */
+void arena_release(void)
+{
+    int s;
+
+    for (s = 0; s < ARENA_SLOTS; s++) {
+        aligned_free(slot_buf[s]);
+        slot_buf[s] = NULL;
+        slot_cap[s] = 0;
+    }
+}
+
+/* log arena size, reuse, page faults and peak rss for this rank and,
+ * on rank 0, their totals and maxima over all ranks */
+void arena_report(int rank)
+{
+    long long local[5], sum[5], max[5], requests = 0;
+    char msg[512];
+    int s;
+
+    local[0] = local[1] = 0;
+    for (s = 0; s < ARENA_SLOTS; s++) {
+        local[0] += (long long)slot_cap[s];
+        local[1] += slot_grows[s];
+        requests += slot_requests[s];
+    }
+    local[2] = local[3] = local[4] = 0;
+#ifndef _WIN32
+    {
+        struct rusage ru;
+
+        if (!getrusage(RUSAGE_SELF, &ru)) {
+            local[2] = ru.ru_minflt;
+            local[3] = ru.ru_majflt;
+            local[4] = ru.ru_maxrss;    /* kb on linux */
+        }
+    }
+#endif
+    snprintf(msg, sizeof(msg),
+             "memory: arena %.1f mb, %lld allocations for %lld requests, "
+             "page faults %lld minor / %lld major, max rss %.1f mb",
+             local[0] / 1048576.0, local[1], requests, local[2],
+             local[3], local[4] / 1024.0);
+    log_message("INFO", msg, false);
+
+    MPI_Reduce(local, sum, 5, MPI_LONG_LONG, MPI_SUM, 0, MPI_COMM_WORLD);
+    MPI_Reduce(local, max, 5, MPI_LONG_LONG, MPI_MAX, 0, MPI_COMM_WORLD);
+    if (rank == 0) {
+        snprintf(msg, sizeof(msg),
+                 "memory: arena max %.1f mb per rank, page faults %lld "
+                 "minor / %lld major in total, max rss %.1f mb per rank",
+                 max[0] / 1048576.0, sum[2], sum[3], max[4] / 1024.0);
+        log_message("INFO", msg, true);
+    }
+}
@@ -7,156 +7,874 @@
 #include <stdbool.h>
 #include <math.h>
 #include "global.h"
+#include "gcn10.h"
 #include <errno.h>
 
-/* load lookup table from csv file */
-static void
-load_lookup_table(const char *hc, const char *arc, int table[256][5])
+/* one computed scenario: drainage condition, output name within the
+ * condition's directories, lookup table index and compiled lut */
+struct scenario {
+    int cond;
+    char name[SCENARIO_NAME_MAX];
+    int table;
+};
+
+/* lookup tables, class keys and compiled luts of the active scenario
+ * set (the selected defaults followed by manifest entries, drained
+ * first); loaded once per rank on first use */
+static int (*tables)[256][5] = NULL;
+static char **table_paths = NULL;
+static int n_tables = 0;
+static struct gcn10_keys class_keys;
+static struct scenario *scens = NULL;
+static uint8_t (*luts)[256] = NULL;
+static float (*s_luts)[256] = NULL;
+static int n_scens = 0;
+static bool scenarios_ready = false;
+
+/* luts of all 18 default scenarios, for the daily arc selection */
+static uint8_t default_luts[GCN10_N_SCENARIOS][256];
+
+/* monte carlo statistics: per scenario the mean, sd and each
+ * configured percentile as key -> cn float luts */
+static float (*mc_stats)[256] = NULL;
+
+/* split blocks: whether the current band is the block's last, and the
+ * output paths the first band chose (requested, chosen pairs), which
+ * later bands reuse so all of them write the same files */
+static bool block_last_band = true;
+static char **band_paths = NULL;
+static int n_band_paths = 0;
+
+/* load lookup table from csv file; false if it cannot be opened or
+ * holds no valid rows */
+static bool load_lookup_table(const char *fname, int table[256][5])
 {
-    FILE *f;
-    char fname[PATH_MAX], line[128], msg[8192];
-    char *tok, *grid_code, *us;
-    int i, j, lc, sg, cnv;
+    char msg[8192];
+    int rc, skipped;
 
-    if (snprintf(fname, sizeof(fname), "%s/default_lookup_%s_%s.csv",
-                 lookup_table_path, hc, arc) >= PATH_MAX) {
-        snprintf(msg, sizeof(msg), "lookup table path too long: %s", fname);
+    skipped = 0;
+    rc = gcn10_load_lookup(fname, table, &skipped);
+    if (rc == GCN10_ERR_OPEN) {
+        snprintf(msg, sizeof(msg), "cannot open lookup table %s", fname);
+        log_message("ERROR", msg, true);
+        return false;
+    }
+    if (rc != GCN10_OK) {
+        snprintf(msg, sizeof(msg), "empty lookup table %s", fname);
+        log_message("ERROR", msg, true);
+        return false;
+    }
+    if (skipped) {
+        snprintf(msg, sizeof(msg), "skipped %d invalid rows in %s",
+                 skipped, fname);
         log_message("ERROR", msg, true);
+    }
+    return true;
+}
+
+/* index of the table loaded from fname, loading it on first use; -1
+ * if it cannot be loaded */
+static int table_index(const char *fname)
+{
+    int t;
+    void *p, *q;
+
+    for (t = 0; t < n_tables; t++) {
+        if (!strcmp(table_paths[t], fname))
+            return t;
+    }
+    p = realloc(tables, (n_tables + 1) * sizeof(*tables));
+    if (p)
+        tables = p;
+    q = realloc(table_paths, (n_tables + 1) * sizeof(char *));
+    if (q)
+        table_paths = q;
+    if (!p || !q || !(table_paths[n_tables] = strdup(fname))) {
+        log_message("ERROR", "malloc failed for lookup tables", true);
         MPI_Abort(MPI_COMM_WORLD, 1);
     }
+    if (!load_lookup_table(fname, tables[n_tables])) {
+        free(table_paths[n_tables]);
+        return -1;
+    }
+    return n_tables++;
+}
 
-    f = fopen(fname, "r");
-    if (!f) {
-        snprintf(msg, sizeof(msg), "cannot open lookup table %s", fname);
+/* index of the default table for hc/arc; -1 if it cannot be loaded */
+static int default_table(int hi, int ai)
+{
+    char fname[PATH_MAX], msg[PATH_MAX + 64];
+
+    if (gcn10_lookup_path(lookup_table_path, gcn10_hcs[hi], gcn10_arcs[ai],
+                          fname, sizeof(fname)) != GCN10_OK) {
+        snprintf(msg, sizeof(msg), "lookup table path too long in %s",
+                 lookup_table_path);
         log_message("ERROR", msg, true);
+        return -1;
+    }
+    return table_index(fname);
+}
+
+/* append a scenario to the active set */
+static void add_scenario(int cond, const char *name, int table)
+{
+    struct scenario *p;
+
+    p = realloc(scens, (n_scens + 1) * sizeof(*scens));
+    if (!p) {
+        log_message("ERROR", "malloc failed for scenarios", true);
+        MPI_Abort(MPI_COMM_WORLD, 1);
+    }
+    scens = p;
+    scens[n_scens].cond = cond;
+    snprintf(scens[n_scens].name, sizeof(scens[0].name), "%s", name);
+    scens[n_scens].table = table;
+    n_scens++;
+}
+
+/* splitmix64 finalizer, used as a counter-based generator */
+static unsigned long long mix64(unsigned long long x)
+{
+    x += 0x9e3779b97f4a7c15ULL;
+    x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    x = (x ^ (x >> 27)) * 0x94d049bb133111ebULL;
+    return x ^ (x >> 31);
+}
+
+/* standard normal draw for realization r of cell (lc, sg) of table t;
+ * a pure function of its arguments and mc_seed, so every rank draws
+ * the same realizations */
+static double mc_normal(int r, int t, int lc, int sg)
+{
+    unsigned long long h;
+    double u1, u2;
+
+    h = mix64((unsigned long long)mc_seed ^
+              mix64(((unsigned long long)r << 32) ^
+                    ((unsigned long long)t << 16) ^ (lc << 4) ^ sg));
+    u1 = ((h >> 11) + 0.5) / 9007199254740992.0;
+    u2 = (mix64(h) >> 11) / 9007199254740992.0;
+    return sqrt(-2.0 * log(u1)) * cos(6.283185307179586 * u2);
+}
+
+/* realizations of every scenario (n_scens x mc_runs x 256, negative
+ * where a key has no cn) reduced to per-key statistics; false if a
+ * realization table cannot be loaded */
+static bool load_mc_stats(void)
+{
+    static int rtab[256][5];
+    float (*sig)[256][5], *real, v, sd;
+    int (*tab)[5];
+    int t, r, sc, key, lc, sg, n_st, rc;
+    char fname[PATH_MAX], msg[PATH_MAX + 64];
+
+    n_st = 2 + n_mc_percentiles;
+    sig = malloc((n_tables ? n_tables : 1) * sizeof(*sig));
+    real = malloc((size_t)(n_scens ? n_scens : 1) * mc_runs * 256 *
+                  sizeof(float));
+    mc_stats = malloc((size_t)(n_scens ? n_scens : 1) * n_st *
+                      sizeof(*mc_stats));
+    if (!sig || !real || !mc_stats) {
+        log_message("ERROR", "malloc failed for monte carlo tables", true);
         MPI_Abort(MPI_COMM_WORLD, 1);
     }
 
-    /* initialize table with nodata value (255) */
-    for (i = 0; i < 256; i++) {
-        for (j = 0; j < 5; j++) {
-            table[i][j] = 255;
+    for (t = 0; t < n_tables; t++) {
+        /* sd per cell: its own from the csv, else mc_sigma; tables
+         * from mc_lookup_list are realizations already, used as is */
+        if (n_mc_lookup_dirs ||
+            gcn10_load_lookup_sigma(table_paths[t], sig[t]) != GCN10_OK) {
+            for (lc = 0; lc < 256; lc++) {
+                for (sg = 0; sg < 5; sg++)
+                    sig[t][lc][sg] = -1.0f;
+            }
+        }
+
+        for (r = 0; r < mc_runs; r++) {
+            /* realization table: perturbed copy from the r-th
+             * directory, or the base table */
+            tab = tables[t];
+            if (n_mc_lookup_dirs) {
+                snprintf(fname, sizeof(fname), "%s/%s", mc_lookup_dirs[r],
+                         CPLGetFilename(table_paths[t]));
+                if (!load_lookup_table(fname, rtab)) {
+                    free(real);
+                    free(sig);
+                    return false;
+                }
+                tab = rtab;
+            }
+
+            for (sc = 0; sc < n_scens; sc++) {
+                float *rl = real + ((size_t)sc * mc_runs + r) * 256;
+
+                if (scens[sc].table != t)
+                    continue;
+                for (key = 0; key < 256; key++) {
+                    rl[key] = -1.0f;
+                    if (!gcn10_key_cell(&class_keys, key, scens[sc].cond == 0,
+                                        &lc, &sg) ||
+                        tab[lc][sg] >= GCN10_NODATA)
+                        continue;
+                    v = (float)tab[lc][sg];
+                    sd = n_mc_lookup_dirs ? 0 : sig[t][lc][sg] >= 0 ?
+                        sig[t][lc][sg] : (float)mc_sigma;
+                    if (sd > 0)
+                        v += sd * (float)mc_normal(r, t, lc, sg);
+                    rl[key] = v < 0 ? 0 : (v > 100 ? 100 : v);
+                }
+            }
+        }
+    }
+
+    for (sc = 0; sc < n_scens; sc++) {
+        rc = gcn10_key_stats(real + (size_t)sc * mc_runs * 256, mc_runs,
+                             mc_percentiles, n_mc_percentiles,
+                             mc_stats[sc * n_st], mc_stats[sc * n_st + 1],
+                             mc_stats[sc * n_st + 2]);
+        if (rc != GCN10_OK) {
+            snprintf(msg, sizeof(msg), "monte carlo statistics failed: %s",
+                     gcn10_strerror(rc));
+            log_message("ERROR", msg, true);
+            free(real);
+            free(sig);
+            return false;
         }
     }
+    free(real);
+    free(sig);
+    return true;
+}
 
-    /* skip header line */
-    if (!fgets(line, sizeof(line), f)) {
-        snprintf(msg, sizeof(msg), "empty lookup table %s", fname);
+/* drop the active scenario set, so the next use loads it again from
+ * the current scenario settings and lookup_table_path */
+void reset_scenarios(void)
+{
+    while (n_tables > 0)
+        free(table_paths[--n_tables]);
+    free(tables);
+    free(table_paths);
+    free(scens);
+    free(luts);
+    free(s_luts);
+    free(mc_stats);
+    tables = NULL;
+    table_paths = NULL;
+    scens = NULL;
+    luts = NULL;
+    s_luts = NULL;
+    mc_stats = NULL;
+    n_scens = 0;
+    scenarios_ready = false;
+}
+
+/* build the active scenario set, derive class keys over all of its
+ * tables and compile every scenario into one batched lut array; false,
+ * with nothing left loaded, if a lookup table cannot be loaded */
+static bool build_scenarios(void)
+{
+    int hi, ai, c, i, t;
+    char name[SCENARIO_NAME_MAX], msg[512];
+
+    for (c = 0; c < GCN10_N_CONDS; c++) {
+        for (hi = 0; hi < GCN10_N_HCS; hi++) {
+            for (ai = 0; ai < GCN10_N_ARCS; ai++) {
+                if (!use_default_scenario[GCN10_SCENARIO(c, hi, ai)])
+                    continue;
+                snprintf(name, sizeof(name), "%s_%s", gcn10_hcs[hi],
+                         gcn10_arcs[ai]);
+                if ((t = default_table(hi, ai)) < 0) {
+                    reset_scenarios();
+                    return false;
+                }
+                add_scenario(c, name, t);
+            }
+        }
+        for (i = 0; i < n_scenario_specs; i++) {
+            if (scenario_specs[i].cond != c)
+                continue;
+            if ((t = table_index(scenario_specs[i].lookup)) < 0) {
+                reset_scenarios();
+                return false;
+            }
+            add_scenario(c, scenario_specs[i].name, t);
+        }
+    }
+
+    /* daily arc selection needs all nine default tables */
+    if (n_antecedent) {
+        for (hi = 0; hi < GCN10_N_HCS; hi++) {
+            for (ai = 0; ai < GCN10_N_ARCS; ai++) {
+                if (default_table(hi, ai) < 0) {
+                    reset_scenarios();
+                    return false;
+                }
+            }
+        }
+    }
+
+    if (gcn10_build_keys(tables, n_tables, &class_keys) != GCN10_OK) {
+        snprintf(msg, sizeof(msg),
+                 "more than %d land cover classes in lookup tables; "
+                 "class keys do not fit in a byte", GCN10_KEY_MAX_LC);
         log_message("ERROR", msg, true);
-        fclose(f);
+        reset_scenarios();
+        return false;
+    }
+
+    luts = malloc((n_scens ? n_scens : 1) * sizeof(*luts));
+    if (!luts) {
+        log_message("ERROR", "malloc failed for scenario luts", true);
         MPI_Abort(MPI_COMM_WORLD, 1);
     }
+    for (i = 0; i < n_scens; i++) {
+        gcn10_compile_lut(&class_keys, tables[scens[i].table],
+                          scens[i].cond == 0, luts[i]);
+    }
 
-    /* parse csv rows */
-    while (fgets(line, sizeof(line), f)) {
-        tok = strtok(line, ",");
-        if (!tok) {
-            continue;
+    /* retention s per key, for runoff output */
+    s_luts = malloc((n_scens ? n_scens : 1) * sizeof(*s_luts));
+    if (!s_luts) {
+        log_message("ERROR", "malloc failed for retention luts", true);
+        MPI_Abort(MPI_COMM_WORLD, 1);
+    }
+    for (i = 0; i < n_scens; i++)
+        gcn10_compile_retention(luts[i], s_luts[i]);
+    if (n_antecedent) {
+        for (c = 0; c < GCN10_N_CONDS; c++) {
+            for (hi = 0; hi < GCN10_N_HCS; hi++) {
+                for (ai = 0; ai < GCN10_N_ARCS; ai++) {
+                    gcn10_compile_lut(&class_keys,
+                                      tables[default_table(hi, ai)], c == 0,
+                                      default_luts[GCN10_SCENARIO(c, hi,
+                                                                  ai)]);
+                }
+            }
         }
-        grid_code = tok;
-        us = strchr(grid_code, '_');
-        if (!us) {
-            snprintf(msg, sizeof(msg),
-                     "invalid grid_code in %s: %s", fname, grid_code);
-            log_message("ERROR", msg, true);
-            continue;
+    }
+    if (mc_runs && !load_mc_stats()) {
+        reset_scenarios();
+        return false;
+    }
+    scenarios_ready = true;
+    return true;
+}
+
+/* load the active scenario set on first use */
+static void load_scenarios(void)
+{
+    if (!scenarios_ready && !build_scenarios())
+        MPI_Abort(MPI_COMM_WORLD, 1);
+}
+
+/* load the active scenario set ahead of its first use, e.g. for a
+ * daemon job; false on every rank if a lookup table failed to load on
+ * any, with nothing left loaded. collective over MPI_COMM_WORLD */
+bool prepare_scenarios(void)
+{
+    int ok, all;
+
+    ok = scenarios_ready || build_scenarios();
+    MPI_Allreduce(&ok, &all, 1, MPI_INT, MPI_MIN, MPI_COMM_WORLD);
+    if (!all)
+        reset_scenarios();
+    return all;
+}
+
+/* number of active scenarios */
+int scenario_count(void)
+{
+    load_scenarios();
+    return n_scens;
+}
+
+/* output name and drainage condition of scenario sc */
+const char *scenario_name(int sc, int *cond)
+{
+    load_scenarios();
+    *cond = scens[sc].cond;
+    return scens[sc].name;
+}
+
+/* copy the compiled lut of scenario sc */
+void get_scenario_lut(int sc, uint8_t *lut)
+{
+    load_scenarios();
+    memcpy(lut, luts[sc], 256);
+}
+
+/* copy the lookup table of scenario sc (if table is not NULL); returns
+ * its index, shared by the scenarios over the same table */
+int scenario_table(int sc, int table[256][5])
+{
+    load_scenarios();
+    if (table)
+        memcpy(table, tables[scens[sc].table], sizeof(tables[0]));
+    return scens[sc].table;
+}
+
+/* copy the class keys of the active scenario set */
+void get_class_keys(struct gcn10_keys *keys)
+{
+    load_scenarios();
+    *keys = class_keys;
+}
+
+/* path of rel under output_root, or rel itself when that is unset */
+static void output_path(char *buf, size_t n, const char *rel)
+{
+    if (output_root)
+        snprintf(buf, n, "%s/%s", output_root, rel);
+    else
+        snprintf(buf, n, "%s", rel);
+}
+
+/* build output path outdir/name.ext under output_root; unless
+ * overwriting, an existing file is kept and the new one gets a
+ * trailing underscore */
+static char *build_outpath(const char *rel_dir, const char *name,
+                           const char *ext, bool overwrite)
+{
+    char *outpath, outdir[PATH_MAX], msg[512];
+    size_t len;
+    int yoff, full, i;
+    FILE *f;
+
+    output_path(outdir, sizeof(outdir), rel_dir);
+    len = strlen(outdir) + strlen(name) + strlen(ext) + 3;
+    outpath = malloc(len);
+    if (!outpath) {
+        snprintf(msg, sizeof(msg), "malloc failed for output path %s", name);
+        log_message("ERROR", msg, true);
+        MPI_Abort(MPI_COMM_WORLD, 1);
+    }
+    snprintf(outpath, len, "%s/%s%s", outdir, name, ext);
+
+    /* later bands of a split block take the first band's choice */
+    yoff = output_band(&full);
+    if (yoff > 0) {
+        for (i = 0; i < n_band_paths; i++) {
+            if (!strcmp(band_paths[2 * i], outpath)) {
+                snprintf(outpath, len, "%s", band_paths[2 * i + 1]);
+                return outpath;
+            }
         }
-        *us = '\0';
-        lc = atoi(grid_code);
-        sg = (us[1] == 'A' ? 1 : us[1] == 'B' ? 2 : us[1] == 'C' ? 3 : 4);
-        tok = strtok(NULL, ",");
-        if (!tok) {
-            snprintf(msg, sizeof(msg),
-                     "invalid row in %s: missing cn", fname);
-            log_message("ERROR", msg, true);
-            continue;
+
+        /* a part of a block split across ranks: named after the
+         * requested path, which merge_band_parts() maps to the choice
+         * made by the rank holding the top rows */
+        return outpath;
+    }
+
+    if (!overwrite) {
+        f = fopen(outpath, "r");
+        if (f) {
+            fclose(f);
+            snprintf(outpath, len, "%s/%s_%s", outdir, name, ext);
+        }
+    }
+
+    if (full && yoff == 0) {
+        band_paths = realloc(band_paths,
+                             2 * (n_band_paths + 1) * sizeof(char *));
+        if (!band_paths) {
+            log_message("ERROR", "malloc failed for band paths", true);
+            MPI_Abort(MPI_COMM_WORLD, 1);
         }
-        cnv = atoi(tok);
-        if (lc >= 0 && lc < 256 && sg >= 0 && sg < 5) {
-            table[lc][sg] = cnv;
+        band_paths[2 * n_band_paths] = malloc(len);
+        band_paths[2 * n_band_paths + 1] = strdup(outpath);
+        if (!band_paths[2 * n_band_paths] ||
+            !band_paths[2 * n_band_paths + 1]) {
+            log_message("ERROR", "malloc failed for band paths", true);
+            MPI_Abort(MPI_COMM_WORLD, 1);
         }
-        else {
+        snprintf(band_paths[2 * n_band_paths], len, "%s/%s%s", outdir, name,
+                 ext);
+        note_output_path(band_paths[2 * n_band_paths], outpath);
+        n_band_paths++;
+    }
+    return outpath;
+}
+
+/* gdal vrt lut string mapping every class key to its cn;
+ * consecutive integer entries make the interpolating lut exact */
+static void build_lut_string(const uint8_t lut[256], char *buf, size_t n)
+{
+    int key;
+    size_t pos = 0;
+
+    for (key = 0; key < 256 && pos < n; key++) {
+        pos += snprintf(buf + pos, n - pos, "%s%d:%d", key ? "," : "",
+                        key, lut[key]);
+    }
+}
+
+/* create an output directory under output_root if it does not exist;
+ * runs without writes create none */
+static void make_outdir(const char *rel_dir)
+{
+    char dir[PATH_MAX], msg[PATH_MAX + 64];
+
+    if (run_phase != RUN_ALL)
+        return;
+    output_path(dir, sizeof(dir), rel_dir);
+#ifdef _WIN32
+    if (_mkdir(dir) != 0 && errno != EEXIST) {
+#else
+    if (mkdir(dir, 0755) != 0 && errno != EEXIST) {
+#endif
+        snprintf(msg, sizeof(msg), "failed to create output directory %s",
+                 dir);
+        log_message("ERROR", msg, true);
+        MPI_Abort(MPI_COMM_WORLD, 1);
+    }
+}
+
+/* write the class key legend (key, land cover, hysogs values) once,
+ * unless the run writes no outputs */
+void write_class_legend(void)
+{
+    FILE *f;
+    char path[PATH_MAX], msg[PATH_MAX + 64];
+    int li, state;
+
+    if (run_phase != RUN_ALL)
+        return;
+    load_scenarios();
+    make_outdir("cn_keys");
+    output_path(path, sizeof(path), "cn_keys/class_keys.csv");
+    f = fopen(path, "w");
+    if (!f) {
+        snprintf(msg, sizeof(msg), "cannot write class legend %s", path);
+        log_message("ERROR", msg, true);
+        return;
+    }
+    fprintf(f, "key,land_cover,hysogs\n");
+    for (li = 0; li < class_keys.n_lc; li++) {
+        for (state = 1; state <= 8; state++) {
+            fprintf(f, "%d,%d,%d\n", li * 8 + state - 1, class_keys.lc[li],
+                    state <= 4 ? state : state + 6);
+        }
+    }
+    fclose(f);
+}
+
+/* log scenario sc of block_id as completed and report it to rank 0;
+ * the bands of a split block report only with the last band */
+static void scenario_done(int block_id, int sc, int total_blocks)
+{
+    char msg[256];
+
+    if (!block_last_band)
+        return;
+    snprintf(msg, sizeof(msg), "completed condition for %d: %s/%s",
+             block_id, gcn10_conds[scens[sc].cond], scens[sc].name);
+    log_message("INFO", msg, false);
+    report_block_completion(block_id, total_blocks);
+}
+
+/* class output: one key raster per block plus 18 lut-backed vrts */
+static void
+write_class_products(int block_id, const uint8_t *keys, int esax, int esay,
+                     const double *gt, OGRSpatialReferenceH srs,
+                     bool overwrite, int total_blocks)
+{
+    int c, sc;
+    char *keypath, *vrtpath, outdir[64], name[128], key_rel[PATH_MAX];
+    char lut[256 * 9];
+    struct vrt_source src;
+
+    make_outdir("cn_keys");
+    snprintf(name, sizeof(name), "cn_key_%d", block_id);
+    keypath = build_outpath("cn_keys", name, ".tif", overwrite);
+    save_raster(keys, esax, esay, gt, srs, keypath);
+    snprintf(key_rel, sizeof(key_rel), "../cn_keys/%s",
+             CPLGetFilename(keypath));
+
+    for (sc = 0; sc < n_scens; sc++) {
+        c = scens[sc].cond;
+        snprintf(outdir, sizeof(outdir), "cn_rasters_%s", gcn10_conds[c]);
+        make_outdir(outdir);
+        build_lut_string(luts[sc], lut, sizeof(lut));
+
+        snprintf(name, sizeof(name), "cn_%s_%d", scens[sc].name, block_id);
+        vrtpath = build_outpath(outdir, name, ".vrt", overwrite);
+        src.path = key_rel;
+        src.nodata = -1;
+        src.lut = lut;
+        write_vrt(vrtpath, esax, esay, gt, srs, &src, 1);
+        free(vrtpath);
+        scenario_done(block_id, sc, total_blocks);
+    }
+    free(keypath);
+}
+
+/* runoff output: q per scenario for every precipitation raster (and
+ * optionally s and ia) straight from the class keys, without going
+ * through cn rasters */
+static void
+write_runoff_products(int block_id, const uint8_t *keys, const double *bbox,
+                      int esax, int esay, const double *gt,
+                      OGRSpatialReferenceH srs, bool overwrite)
+{
+    float *precip, *coarse, *out, lambda;
+    double p_gt[6];
+    size_t npix;
+    int c, sc, t, px, py;
+    char outdir[64], name[PATH_MAX], *outpath, msg[PATH_MAX + 64];
+
+    npix = (size_t)esax * esay;
+    lambda = (float)runoff_lambda;
+    out = arena_get(ARENA_FLOAT, npix * sizeof(float));
+    precip = arena_get(ARENA_RAIN, npix * sizeof(float));
+
+    for (c = 0; c < GCN10_N_CONDS; c++) {
+        snprintf(outdir, sizeof(outdir), "runoff_%s", gcn10_conds[c]);
+        make_outdir(outdir);
+    }
+
+    /* s and ia do not depend on precipitation */
+    for (sc = 0; sc < n_scens; sc++) {
+        snprintf(outdir, sizeof(outdir), "runoff_%s",
+                 gcn10_conds[scens[sc].cond]);
+        if (runoff_outputs & RUNOFF_S) {
+            gcn10_retention(s_luts[sc], keys, npix, lambda, out, NULL);
+            snprintf(name, sizeof(name), "s_%s_%d", scens[sc].name,
+                     block_id);
+            outpath = build_outpath(outdir, name, ".tif", overwrite);
+            save_raster_float(out, esax, esay, gt, srs, outpath);
+            free(outpath);
+        }
+        if (runoff_outputs & RUNOFF_IA) {
+            gcn10_retention(s_luts[sc], keys, npix, lambda, NULL, out);
+            snprintf(name, sizeof(name), "ia_%s_%d", scens[sc].name,
+                     block_id);
+            outpath = build_outpath(outdir, name, ".tif", overwrite);
+            save_raster_float(out, esax, esay, gt, srs, outpath);
+            free(outpath);
+        }
+    }
+
+    /* one q raster per scenario and time step; precipitation is
+     * resampled onto the esa grid like hysogs */
+    for (t = 0; t < n_precip; t++) {
+        coarse = load_raster_float(precip_paths[t], bbox, &px, &py, p_gt);
+        if (!coarse) {
             snprintf(msg, sizeof(msg),
-                     "invalid values in %s: lc=%d, sg=%d", fname, lc, sg);
+                     "precipitation load failed for block %d: %s",
+                     block_id, precip_paths[t]);
             log_message("ERROR", msg, true);
+            continue;
+        }
+        gcn10_resample_nearest_float(coarse, px, py, p_gt, precip, esax,
+                                     esay, gt);
+        free(coarse);
+
+        for (sc = 0; sc < n_scens; sc++) {
+            gcn10_runoff(s_luts[sc], keys, precip, npix, lambda, out);
+
+            /* time series steps are named after their rasters */
+            snprintf(outdir, sizeof(outdir), "runoff_%s",
+                     gcn10_conds[scens[sc].cond]);
+            snprintf(name, sizeof(name), "q_%s_%d%s%s", scens[sc].name,
+                     block_id, n_precip > 1 ? "_" : "",
+                     n_precip > 1 ? CPLGetBasename(precip_paths[t]) : "");
+            outpath = build_outpath(outdir, name, ".tif", overwrite);
+            save_raster_float(out, esax, esay, gt, srs, outpath);
+            free(outpath);
         }
     }
-    fclose(f);
 }
 
-/* adjust hysogs data based on drainage condition */
-static void modify_hysogs_data(uint8_t *h, int npix, const char *cond)
+/* daily cn output: for every antecedent day one cn raster per drainage
+ * condition and hc with the arc picked per pixel, all from a single
+ * read of the land cover and soil inputs */
+static void
+write_daily_products(int block_id, const uint8_t *keys, const double *bbox,
+                     int esax, int esay, const double *gt,
+                     OGRSpatialReferenceH srs, bool overwrite)
 {
-    int i;
+    float *p5, *coarse;
+    uint8_t *out;
+    const double *th;
+    double p_gt[6];
+    size_t npix;
+    int c, hi, t, px, py;
+    char outdir[64], name[PATH_MAX], *outpath, msg[PATH_MAX + 64];
+
+    /* the rain grid of the runoff products and the cn grid of the
+     * aggregates are free again by now */
+    npix = (size_t)esax * esay;
+    p5 = arena_get(ARENA_RAIN, npix * sizeof(float));
+    out = arena_get(ARENA_CN, npix);
+
+    for (c = 0; c < GCN10_N_CONDS; c++) {
+        snprintf(outdir, sizeof(outdir), "cn_daily_%s", gcn10_conds[c]);
+        make_outdir(outdir);
+    }
+
+    for (t = 0; t < n_antecedent; t++) {
+        coarse = load_raster_float(antecedent_days[t].path, bbox, &px, &py,
+                                   p_gt);
+        if (!coarse) {
+            snprintf(msg, sizeof(msg),
+                     "antecedent load failed for block %d: %s",
+                     block_id, antecedent_days[t].path);
+            log_message("ERROR", msg, true);
+            continue;
+        }
+        gcn10_resample_nearest_float(coarse, px, py, p_gt, p5, esax, esay,
+                                     gt);
+        free(coarse);
+        th = arc_thresholds[antecedent_days[t].season < 0 ? arc_season :
+                            antecedent_days[t].season];
 
-    if (strcmp(cond, "drained") == 0) {
-        for (i = 0; i < npix; i++) {
-            if (h[i] >= 11 && h[i] <= 14) {
-                h[i] = 4;
+        for (c = 0; c < GCN10_N_CONDS; c++) {
+            snprintf(outdir, sizeof(outdir), "cn_daily_%s", gcn10_conds[c]);
+            for (hi = 0; hi < GCN10_N_HCS; hi++) {
+                /* the arc i/ii/iii luts of a scenario are adjacent */
+                gcn10_select_arc(default_luts + GCN10_SCENARIO(c, hi, 0),
+                                 keys, p5, npix, (float)th[0], (float)th[1],
+                                 out);
+                snprintf(name, sizeof(name), "cn_%s_%d_%s", gcn10_hcs[hi],
+                         block_id, CPLGetBasename(antecedent_days[t].path));
+                outpath = build_outpath(outdir, name, ".tif", overwrite);
+                save_raster(out, esax, esay, gt, srs, outpath);
+                free(outpath);
             }
         }
     }
-    else {
-        for (i = 0; i < npix; i++) {
-            if (h[i] == 11)
-                h[i] = 1;
-            else if (h[i] == 12)
-                h[i] = 2;
-            else if (h[i] == 13)
-                h[i] = 3;
-            else if (h[i] == 14)
-                h[i] = 4;
+}
+
+/* monte carlo output: per scenario the mean, sd and percentile cn of
+ * all realizations as float rasters; realizations are evaluated per
+ * class key, so per-pixel cost is one lut pass per statistic */
+static void
+write_mc_products(int block_id, const uint8_t *keys, int esax, int esay,
+                  const double *gt, OGRSpatialReferenceH srs, bool overwrite)
+{
+    float *out;
+    int sc, k, n_st;
+    char outdir[64], name[128], stat[16], *outpath;
+
+    n_st = 2 + n_mc_percentiles;
+    out = arena_get(ARENA_FLOAT, (size_t)esax * esay * sizeof(float));
+
+    for (sc = 0; sc < n_scens; sc++) {
+        snprintf(outdir, sizeof(outdir), "cn_mc_%s",
+                 gcn10_conds[scens[sc].cond]);
+        make_outdir(outdir);
+        for (k = 0; k < n_st; k++) {
+            if (k < 2)
+                snprintf(stat, sizeof(stat), "%s", k ? "sd" : "mean");
+            else
+                snprintf(stat, sizeof(stat), "p%g",
+                         mc_percentiles[k - 2]);
+            gcn10_apply_lut_float(mc_stats[sc * n_st + k], keys,
+                                  (size_t)esax * esay, out);
+            snprintf(name, sizeof(name), "cn_%s_%d_%s", scens[sc].name,
+                     block_id, stat);
+            outpath = build_outpath(outdir, name, ".tif", overwrite);
+            save_raster_float(out, esax, esay, gt, srs, outpath);
+            free(outpath);
         }
     }
 }
 
-/* generate cn raster using lookup table */
+/* levels already reported as finer than two input pixels */
+static bool agg_too_fine[MAX_AGG_LEVELS];
+
+/* aggregated output: every configured level (metres, converted to a
+ * whole number of native pixels at the equator) of every scenario,
+ * on cells aligned to a global grid anchored at (-180, 90) so blocks
+ * mosaic without shifts; rows are weighted by geodesic pixel area */
 static void
-calculate_cn(const uint8_t *esa, const uint8_t *hsg, int npix,
-             int table[256][5], uint8_t *out)
-{
-    int i, land_cover, soil_group, cn_value;
-
-    for (i = 0; i < npix; i++) {
-        land_cover = esa[i];
-        soil_group = hsg[i];
-        if (land_cover >= 0 && land_cover < 256 && soil_group >= 0
-            && soil_group < 5) {
-            cn_value = table[land_cover][soil_group];
-            if (cn_value < 255) {
-                out[i] = (uint8_t) cn_value;
+write_aggregate_products(int block_id, const uint8_t *keys, int esax,
+                         int esay, const double *gt,
+                         OGRSpatialReferenceH srs, bool overwrite)
+{
+    uint8_t *cn, *agg;
+    double *row_w, agt[6];
+    int l, f, xphase, yphase, ox, oy, sc, y, rc, by, full, phase0, aoff;
+    int full_oy;
+    char outdir[64], name[128], *outpath, msg[256];
+
+    row_w = arena_get(ARENA_ROW_W, (size_t)esay * sizeof(double));
+    cn = arena_get(ARENA_CN, (size_t)esax * esay);
+    for (y = 0; y < esay; y++)
+        row_w[y] = geodesic_pixel_area(gt, y);
+
+    for (l = 0; l < n_agg_levels; l++) {
+        f = (int)lround(agg_levels[l] / (gt[1] * 111320.0));
+        if (f < 2) {
+            if (!agg_too_fine[l]) {
+                snprintf(msg, sizeof(msg), "aggregate level %dm is finer "
+                         "than two %.1fm input pixels, skipped",
+                         agg_levels[l], gt[1] * 111320.0);
+                log_message("WARNING", msg, true);
+                agg_too_fine[l] = true;
             }
+            continue;
+        }
+        xphase = (int)(lround((gt[0] + 180.0) / gt[1]) % f);
+        yphase = (int)(lround((90.0 - gt[3]) / fabs(gt[5])) % f);
+        ox = (esax + xphase + f - 1) / f;
+        oy = (esay + yphase + f - 1) / f;
+        agt[0] = gt[0] - xphase * gt[1];
+        agt[1] = gt[1] * f;
+        agt[2] = 0;
+        agt[3] = gt[3] - yphase * gt[5];
+        agt[4] = 0;
+        agt[5] = gt[5] * f;
+
+        /* a band of a split block fills its rows of the block's level
+         * raster; bands after the first start on whole cells */
+        by = output_band(&full);
+        phase0 = (int)((lround((90.0 - gt[3]) / fabs(gt[5])) - by) % f);
+        aoff = by ? (by + phase0) / f : 0;
+        full_oy = full ? (full + phase0 + f - 1) / f : 0;
+
+        agg = arena_get(ARENA_AGG, (size_t)ox * oy);
+
+        for (sc = 0; sc < n_scens; sc++) {
+            snprintf(outdir, sizeof(outdir), "cn_rasters_%s_%dm",
+                     gcn10_conds[scens[sc].cond], agg_levels[l]);
+            make_outdir(outdir);
+            gcn10_apply_lut(luts[sc], keys, (size_t)esax * esay, cn);
+            rc = gcn10_aggregate(cn, esax, esay, row_w, f, xphase, yphase,
+                                 agg_method, agg, ox, oy);
+            if (rc != GCN10_OK) {
+                snprintf(msg, sizeof(msg),
+                         "aggregation to %dm failed for block %d: %s",
+                         agg_levels[l], block_id, gcn10_strerror(rc));
+                log_message("ERROR", msg, true);
+                break;
+            }
+            snprintf(name, sizeof(name), "cn_%s_%d", scens[sc].name,
+                     block_id);
+            outpath = build_outpath(outdir, name, ".tif", overwrite);
+            save_raster_rows(agg, ox, oy, agt, srs, outpath, aoff, full_oy);
+            free(outpath);
         }
     }
 }
 
-/* process a single block and generate cn rasters */
-void process_block(int block_id, bool overwrite, int total_blocks)
+/* envelope of block_id in the blocks shapefile */
+static bool block_bbox(int block_id, double *bbox)
 {
-    int rank, xsize, ysize, hsx, hsy, esax, esay, npix, c, hi, ai;
     OGRDataSourceH ds;
     OGRLayerH layer;
     OGRFeatureH feat;
     OGREnvelope env;
-    OGRSpatialReferenceH srs, soil_srs;
-    uint8_t *esa, *hysogs_coarse, *hysogs_resampled, *hysogs_adjusted, *cn;
-    double bbox[4], gt[6], soil_gt[6];
-    char filter[64], outdir[PATH_MAX], *outpath, msg[8192];
-    const char *conds[2] = { "drained", "undrained" };
-    const char *hcs[3] = { "p", "f", "g" };
-    const char *arcs[3] = { "i", "ii", "iii" };
-    int table[256][5];
-    size_t len;
-    FILE *f;
+    char filter[64], msg[256];
 
-    MPI_Comm_rank(MPI_COMM_WORLD, &rank);
-
-    /* fetch block geometry */
+    if (kept_block_bbox(block_id, bbox))
+        return true;
     ds = OGROpen(blocks_shp_path, FALSE, NULL);
     if (!ds) {
         snprintf(msg, sizeof(msg), "ogr open failed: %s", blocks_shp_path);
         log_message("ERROR", msg, true);
-        return;
+        return false;
     }
     layer = OGR_DS_GetLayer(ds, 0);
     if (snprintf(filter, sizeof(filter), "\"ID\"=%d", block_id) >=
@@ -173,7 +891,7 @@ void process_block(int block_id, bool overwrite, int total_blocks)
         snprintf(msg, sizeof(msg), "block %d not found", block_id);
         log_message("ERROR", msg, true);
         OGR_DS_Destroy(ds);
-        return;
+        return false;
     }
     OGR_G_GetEnvelope(OGR_F_GetGeometryRef(feat), &env);
     bbox[0] = env.MinX;
@@ -182,205 +900,592 @@ void process_block(int block_id, bool overwrite, int total_blocks)
     bbox[3] = env.MaxY;
     OGR_F_Destroy(feat);
     OGR_DS_Destroy(ds);
+    return true;
+}
 
-    /* load esa land cover raster */
-    esa = load_raster(esa_data_path, bbox, &xsize, &ysize, gt, &srs);
-    if (!esa) {
-        snprintf(msg, sizeof(msg), "esa load failed for block %d", block_id);
-        log_message("ERROR", msg, true);
+/* estimated working bytes per block pixel for the configured
+ * products; grids read at a coarser resolution (hysogs, precipitation,
+ * antecedent rain) are counted as if native, and per-row buffers are
+ * left out. outputs are written before the next window is read, so
+ * only the current window and a prefetched one are ever held */
+static double block_bytes_per_pixel(void)
+{
+    double b = 5;               /* esa, soil read and resampled, keys, cn */
+
+    if (use_aoi_mode)
+        b += 1;                 /* polygon mask */
+    if (prefetch_inputs)
+        b += 2;                 /* next window's esa and soil */
+    if (output_crs)
+        b += 3;                 /* warped esa, soil, keys */
+    if (n_agg_levels)
+        b += 0.25;              /* cells of a level of two pixels or more */
+    if (mc_runs || n_precip)
+        b += sizeof(float);     /* float output */
+    if (n_precip || n_antecedent)
+        b += 2 * sizeof(float); /* rain read and resampled */
+    return b;
+}
+
+static int gcd(int a, int b)
+{
+    while (b) {
+        int t = a % b;
+
+        a = b;
+        b = t;
+    }
+    return a;
+}
+
+/* esa dataset the block windows are planned on, open for the run */
+static GDALDatasetH esa_grid = NULL;
+
+/* top left corner of the hysogs raster, that its tiles count from */
+static double soil_origin[2];
+static bool have_soil_origin = false;
+
+/* the block's native esa window (ysize rows, gt) and the rows per
+ * band that keep it within max_memory_per_rank (ysize when it fits);
+ * false when the block cannot be split */
+static bool block_rows(int block_id, const double *bbox, int *ysize,
+                       double *gt, int *rows)
+{
+    double bpp, budget;
+    int win[6], rc;
+    char msg[256];
+
+    if (!esa_grid) {
+        GDALAllRegister();
+        esa_grid = GDALOpen(esa_data_path, GA_ReadOnly);
+        if (!esa_grid)
+            return false;
+    }
+    rc = gcn10_window(esa_grid, bbox, 0, win, gt);
+    if (rc != GCN10_OK)
+        return false;
+
+    *ysize = *rows = win[5];
+    bpp = block_bytes_per_pixel();
+    budget = max_memory_per_rank * 1048576.0;
+    if (max_memory_per_rank && (double)win[4] * win[5] * bpp > budget) {
+        *rows = budget / (win[4] * bpp) < 1 ? 1 :
+            (int)(budget / (win[4] * bpp));
+        if (target_res > 0 || output_crs) {
+            snprintf(msg, sizeof(msg),
+                     "block %d exceeds max_memory_per_rank but is "
+                     "processed whole: target_resolution and output_crs "
+                     "grids are not split", block_id);
+            log_message("WARNING", msg, false);
+        }
+    }
+    return !(target_res > 0 || output_crs);
+}
+
+/* first row of part p of n of a block of ysize rows, on a band edge */
+static int part_row(int p, int n, int ysize, long long top, int unit)
+{
+    long long y;
+
+    if (p <= 0)
+        return 0;
+    if (p >= n)
+        return ysize;
+    y = (top + (long long)ysize * p / n + unit / 2) / unit * unit - top;
+    return y < 0 ? 0 : y > ysize ? ysize : (int)y;
+}
+
+/* windows a rank processes for one work item: the whole block, or
+ * the row bands of its part of the block */
+struct block_plan {
+    int block_id, part, n_parts;
+    int n;                      /* windows; 0 when there is nothing to do */
+    bool split;                 /* row bands written into shared outputs */
+    int esay, rows;
+    double (*bbox)[4];
+    int *y0, *y1;
+};
+
+/* plan of the current item and the window being processed, and of
+ * the item this rank takes next (block_id -1 when none is known) */
+static struct block_plan cur_plan, next_plan = { .block_id = -1 };
+static int cur_window;
+static int next_block = -1, next_part, next_n_parts;
+
+/* add window bbox, rows y0..y1 of the block, to plan */
+static void plan_window(struct block_plan *p, const double *bbox, int y0,
+                        int y1)
+{
+    p->bbox = realloc(p->bbox, (p->n + 1) * sizeof(*p->bbox));
+    p->y0 = realloc(p->y0, (p->n + 1) * sizeof(int));
+    p->y1 = realloc(p->y1, (p->n + 1) * sizeof(int));
+    if (!p->bbox || !p->y0 || !p->y1) {
+        log_message("ERROR", "malloc failed for block plan", true);
+        MPI_Abort(MPI_COMM_WORLD, 1);
+    }
+    memcpy(p->bbox[p->n], bbox, sizeof(p->bbox[0]));
+    p->y0[p->n] = y0;
+    p->y1[p->n] = y1;
+    p->n++;
+}
+
+/* work out the windows of part of n_parts of block_id */
+static void plan_block(struct block_plan *p, int block_id, int part,
+                       int n_parts)
+{
+    double bbox[4], band[4], gt[6];
+    long long top;
+    int rows, esay, unit, f, l, y0, y1, p0, p1;
+
+    p->block_id = block_id;
+    p->part = part;
+    p->n_parts = n_parts;
+    p->n = 0;
+    p->split = false;
+
+    /* fetch block geometry */
+    if (use_aoi_mode ? !aoi_tile_bbox(block_id, bbox) :
+        !block_bbox(block_id, bbox))
+        return;
+
+    /* a whole block without a memory cap needs no window lookup */
+    if (!max_memory_per_rank && n_parts == 1) {
+        plan_window(p, bbox, 0, 0);
+        return;
+    }
+
+    /* blocks that cannot be split are done whole by their first part */
+    if (!block_rows(block_id, bbox, &esay, gt, &rows) ||
+        (n_parts == 1 && rows >= esay)) {
+        if (part == 0)
+            plan_window(p, bbox, 0, 0);
+        return;
+    }
+
+    /* bands end on whole cells of every aggregate level, counted on
+     * the global grid, or else on whole 256-row geotiff tiles */
+    unit = 1;
+    for (l = 0; l < n_agg_levels; l++) {
+        f = (int)lround(agg_levels[l] / (gt[1] * 111320.0));
+        if (f >= 2 && unit < esay)
+            unit = unit / gcd(unit, f) * f;
+    }
+    top = unit > 1 ? lround((90.0 - gt[3]) / fabs(gt[5])) : 0;
+    if (unit == 1)
+        unit = 256;
+    rows = rows < unit ? unit : rows / unit * unit;
+    if (n_parts == 1 && rows >= esay) {
+        plan_window(p, bbox, 0, 0);
+        return;
+    }
+
+    p0 = part_row(part, n_parts, esay, top, unit);
+    p1 = part_row(part + 1, n_parts, esay, top, unit);
+    p->split = true;
+    p->esay = esay;
+    p->rows = rows < p1 - p0 ? rows : p1 - p0;
+    band[0] = bbox[0];
+    band[2] = bbox[2];
+    for (y0 = p0; y0 < p1; y0 = y1) {
+        y1 = (int)((top + y0 + rows) / unit * unit - top);
+        y1 = y1 > p1 ? p1 : y1;
+
+        /* edges a quarter pixel inside the band rows, as aoi windows */
+        band[3] = gt[3] + (y0 + 0.25) * gt[5];
+        band[1] = gt[3] + (y1 - 0.25) * gt[5];
+        plan_window(p, band, y0, y1);
+    }
+}
+
+/* note the work item this rank processes after the current one, so
+ * its first inputs can be read while the current one computes */
+void set_next_block(int block_id, int part, int n_parts)
+{
+    next_block = block_id;
+    next_part = part;
+    next_n_parts = n_parts;
+}
+
+/* free the block plans and the esa dataset they were made on, at the
+ * end of a run */
+void plans_release(void)
+{
+    struct block_plan *p[2] = { &cur_plan, &next_plan };
+    int i;
+
+    for (i = 0; i < 2; i++) {
+        free(p[i]->bbox);
+        free(p[i]->y0);
+        free(p[i]->y1);
+        memset(p[i], 0, sizeof(*p[i]));
+        p[i]->block_id = -1;
+    }
+    next_block = -1;
+    if (esa_grid)
+        GDALClose(esa_grid);
+    esa_grid = NULL;
+    have_soil_origin = false;
+}
+
+/* look up the hysogs origin once per run; the window origin stands in
+ * if the raster cannot be opened */
+static void find_soil_origin(const double *soil_gt)
+{
+    GDALDatasetH ds;
+    double t[6];
+
+    if (have_soil_origin)
         return;
+    soil_origin[0] = soil_gt[0];
+    soil_origin[1] = soil_gt[3];
+    ds = GDALOpen(hysogs_data_path, GA_ReadOnly);
+    if (ds) {
+        if (GDALGetGeoTransform(ds, t) == CE_None) {
+            soil_origin[0] = t[0];
+            soil_origin[1] = t[3];
+        }
+        GDALClose(ds);
     }
+    have_soil_origin = true;
+}
 
-    /* load hysogs soil raster */
-    hysogs_coarse =
-        load_raster(hysogs_data_path, bbox, &hsx, &hsy, soil_gt, &soil_srs);
-    if (!hysogs_coarse) {
+/* start reading the window after the current one: the next band of
+ * this item or the first window of the next item */
+static void prefetch_next(void)
+{
+    if (cur_window + 1 < cur_plan.n) {
+        inputs_prefetch(cur_plan.bbox[cur_window + 1]);
+        return;
+    }
+    if (next_block < 0)
+        return;
+    plan_block(&next_plan, next_block, next_part, next_n_parts);
+    if (next_plan.n)
+        inputs_prefetch(next_plan.bbox[0]);
+}
+
+/* read one window of a block (an aoi window in aoi mode), or the
+ * whole block, classify it and write the products that need the whole
+ * window (aggregates, runoff, daily and monte carlo rasters); g gets
+ * the class grids the cn rasters are made from. false if the window
+ * could not be read */
+static bool prepare_window(int block_id, const double *bbox, bool overwrite,
+                           struct block_grids *g)
+{
+    int xsize, ysize, hsx, hsy, esax, esay;
+    size_t npix;
+    OGRSpatialReferenceH srs;
+    struct block_inputs in;
+    uint8_t *esa, *hysogs_coarse, *hysogs_resampled, *keys;
+    double gt[6], soil_gt[6];
+    char msg[256];
+
+    /* load esa land cover (at target_res when set) and hysogs soil
+     * rasters, read together or already prefetched */
+    inputs_load(bbox, &in);
+    if (!in.esa) {
+        snprintf(msg, sizeof(msg), "esa load failed for block %d", block_id);
+        log_message("ERROR", msg, true);
+        return false;
+    }
+    if (!in.soil) {
         snprintf(msg, sizeof(msg), "hysogs load failed for block %d",
                  block_id);
         log_message("ERROR", msg, true);
-        free(esa);
-        return;
+        if (in.srs)
+            OSRDestroySpatialReference(in.srs);
+        return false;
+    }
+    esa = in.esa;
+    xsize = in.xsize;
+    ysize = in.ysize;
+    memcpy(gt, in.gt, sizeof(gt));
+    srs = in.srs;
+    hysogs_coarse = in.soil;
+    hsx = in.soil_xsize;
+    hsy = in.soil_ysize;
+    memcpy(soil_gt, in.soil_gt, sizeof(soil_gt));
+
+    /* the next window's inputs are read while this one computes */
+    prefetch_next();
+
+    /* read-only runs drop the window once it is in memory */
+    if (run_phase == RUN_READ) {
+        if (srs)
+            OSRDestroySpatialReference(srs);
+        return true;
     }
 
+    /* account input tile reuse; hysogs tiles are taken as
+     * 256-pixel internal geotiff tiles of the soil grid, counted from
+     * its origin */
+    find_soil_origin(soil_gt);
+    locality_note(LOC_ESA, bbox, ESA_TILE_DEG, -180.0, 90.0);
+    locality_note(LOC_HYSOGS, bbox, 256.0 * fabs(soil_gt[1]), soil_origin[0],
+                  soil_origin[1]);
+
     /* upsample hysogs to match esa grid */
     esax = xsize;
     esay = ysize;
-    npix = esax * esay;
-    hysogs_resampled = malloc((size_t)npix);
-    if (!hysogs_resampled) {
-        snprintf(msg, sizeof(msg),
-                 "malloc failed for hysogs resampling, block %d", block_id);
-        log_message("ERROR", msg, true);
-        free(esa);
-        free(hysogs_coarse);
-        MPI_Abort(MPI_COMM_WORLD, 1);
+    npix = (size_t)esax * esay;
+    hysogs_resampled = arena_get(ARENA_SOIL, npix);
+    gcn10_resample_nearest(hysogs_coarse, hsx, hsy, soil_gt,
+                           hysogs_resampled, esax, esay, gt);
+
+    /* pixels outside the aoi polygons lose their soil group and
+     * so become nodata in every product */
+    if (use_aoi_mode)
+        aoi_mask(block_id, gt, esax, esay, hysogs_resampled);
+
+    /* encode (land cover, soil) pairs once; every scenario
+     * is then a single lut pass over the keys */
+    keys = arena_get(ARENA_KEYS, npix);
+    gcn10_classify(&class_keys, esa, hysogs_resampled, npix, keys);
+
+    /* zone histograms come from the keys while they are in memory */
+    if (zones_path)
+        zones_accumulate(bbox, keys, esax, esay, gt, srs);
+
+    if (n_agg_levels)
+        write_aggregate_products(block_id, keys, esax, esay, gt, srs,
+                                 overwrite);
+
+    if (n_precip) {
+        write_runoff_products(block_id, keys, bbox, esax, esay, gt, srs,
+                              overwrite);
+    }
+    if (n_antecedent) {
+        write_daily_products(block_id, keys, bbox, esax, esay, gt, srs,
+                             overwrite);
+    }
+
+    /* the products below are pure functions of the class grids, so
+     * those are warped once to output_crs before any lookup */
+    if (output_crs && (write_cn || mc_runs)) {
+        uint8_t *grids[3];
+        const int slots[3] = { ARENA_WARP_ESA, ARENA_WARP_SOIL,
+            ARENA_WARP_KEYS };
+        const uint8_t nodata[3] = { 0, 0, GCN10_NODATA };
+
+        grids[0] = esa;
+        grids[1] = hysogs_resampled;
+        grids[2] = keys;
+        if (!warp_to_output(grids, slots, nodata, 3, &esax, &esay, gt,
+                            &srs)) {
+            snprintf(msg, sizeof(msg), "reprojection failed for block %d",
+                     block_id);
+            log_message("ERROR", msg, true);
+            return false;
+        }
+        esa = grids[0];
+        hysogs_resampled = grids[1];
+        keys = grids[2];
     }
-    for (int y = 0; y < esay; y++) {
-        double py = gt[3] + (y + 0.5) * gt[5];
 
-        for (int x = 0; x < esax; x++) {
-            double px = gt[0] + (x + 0.5) * gt[1];
-            double dc = (px - soil_gt[0]) / soil_gt[1];
-            double dr = (soil_gt[3] - py) / fabs(soil_gt[5]);
-            int ci = (int)round(dc);
-            int cj = (int)round(dr);
+    if (mc_runs)
+        write_mc_products(block_id, keys, esax, esay, gt, srs, overwrite);
+
+    g->esa = esa;
+    g->soil = hysogs_resampled;
+    g->keys = keys;
+    g->xsize = esax;
+    g->ysize = esay;
+    memcpy(g->gt, gt, sizeof(g->gt));
+    g->srs = srs;
+    return true;
+}
+
+/* process one window of a block (an aoi window in aoi mode), or the
+ * whole block, and generate cn rasters. under node_coop the node
+ * reader prepares the window and each rank of the node writes the
+ * scenarios of the tables it owns */
+static void process_window(int block_id, const double *bbox, bool overwrite,
+                           int total_blocks)
+{
+    int esax, esay, c, sc, d;
+    size_t npix;
+    struct block_grids g;
+    uint8_t *cn;
+    bool ok = false;
+    char outdir[PATH_MAX], *outpath, *vrtpath, msg[8192];
+    char name[128], base_rel[PATH_MAX], (*out_names)[128];
+    struct vrt_source srcs[2];
+    const char *const *conds = gcn10_conds;
+
+    memset(&g, 0, sizeof(g));
+    if (node_reader())
+        ok = prepare_window(block_id, bbox, overwrite, &g);
 
-            ci = ci < 0 ? 0 : (ci >= hsx ? hsx - 1 : ci);
-            cj = cj < 0 ? 0 : (cj >= hsy ? hsy - 1 : cj);
-            hysogs_resampled[y * esax + x] = hysogs_coarse[cj * hsx + ci];
+    if (run_phase == RUN_READ) {
+        if (ok) {
+            for (sc = 0; sc < n_scens; sc++)
+                scenario_done(block_id, sc, total_blocks);
         }
+        return;
     }
-    free(hysogs_coarse);
 
-    /* process all combinations of conditions, hcs, and arcs */
-    for (c = 0; c < 2; c++) {
+    if (node_reader()) {
+        /* without cn rasters the block completes here */
+        if (ok && !write_cn) {
+            for (sc = 0; sc < n_scens; sc++)
+                scenario_done(block_id, sc, total_blocks);
+        }
+
+        /* class mode writes one key raster instead of 18 cn rasters */
+        if (ok && write_cn && output_mode == OUTPUT_CLASS) {
+            write_class_products(block_id, g.keys, g.xsize, g.ysize, g.gt,
+                                 g.srs, overwrite, total_blocks);
+        }
+    }
+    if (!write_cn || output_mode == OUTPUT_CLASS)
+        return;
+
+    /* the rest of the node gets the grids of the reader */
+    if (!node_share(ok, &g))
+        return;
+    node_check_tables(n_tables);
+    esax = g.xsize;
+    esay = g.ysize;
+    npix = (size_t)esax * esay;
+
+    /* file names written per scenario, for delta vrts */
+    out_names = calloc(n_scens ? n_scens : 1, sizeof(*out_names));
+    if (!out_names) {
+        snprintf(msg, sizeof(msg), "malloc failed for output names, block %d",
+                 block_id);
+        log_message("ERROR", msg, true);
+        MPI_Abort(MPI_COMM_WORLD, 1);
+    }
+
+    /* process every active scenario; drained ones come first */
+    for (sc = 0; sc < n_scens; sc++) {
+        if (!node_owns(scens[sc].table))
+            continue;
+        c = scens[sc].cond;
         if (snprintf(outdir, PATH_MAX, "cn_rasters_%s", conds[c]) >= PATH_MAX) {
             snprintf(msg, sizeof(msg),
                      "output directory path too long for %s", conds[c]);
             log_message("ERROR", msg, true);
-            free(esa);
-            free(hysogs_resampled);
-            MPI_Abort(MPI_COMM_WORLD, 1);
-        }
-#ifdef _WIN32
-        if (_mkdir(outdir) != 0 && errno != EEXIST) {
-#else
-        if (mkdir(outdir, 0755) != 0 && errno != EEXIST) {
-#endif
-            snprintf(msg, sizeof(msg),
-                     "failed to create output directory %s", outdir);
-            log_message("ERROR", msg, true);
-            free(esa);
-            free(hysogs_resampled);
             MPI_Abort(MPI_COMM_WORLD, 1);
         }
+        make_outdir(outdir);
 
-        for (hi = 0; hi < 3; hi++) {
-            for (ai = 0; ai < 3; ai++) {
-                /* load lookup table */
-                load_lookup_table(hcs[hi], arcs[ai], table);
-
-                /* adjust hysogs data */
-                hysogs_adjusted = malloc((size_t)npix);
-                if (!hysogs_adjusted) {
-                    snprintf(msg, sizeof(msg),
-                             "malloc failed for hysogs adjusted, block %d",
-                             block_id);
-                    log_message("ERROR", msg, true);
-                    free(esa);
-                    free(hysogs_resampled);
-                    MPI_Abort(MPI_COMM_WORLD, 1);
-                }
-                memcpy(hysogs_adjusted, hysogs_resampled, npix);
-                modify_hysogs_data(hysogs_adjusted, npix, conds[c]);
-
-                /* generate cn raster */
-                cn = malloc((size_t)npix);
-                if (!cn) {
-                    snprintf(msg, sizeof(msg),
-                             "malloc failed for cn raster, block %d",
-                             block_id);
-                    log_message("ERROR", msg, true);
-                    free(esa);
-                    free(hysogs_resampled);
-                    free(hysogs_adjusted);
-                    MPI_Abort(MPI_COMM_WORLD, 1);
-                }
-                memset(cn, 255, npix);
-                calculate_cn(esa, hysogs_adjusted, npix, table, cn);
-
-                /* construct output path */
-                len =
-                    strlen(outdir) + strlen(hcs[hi]) + strlen(arcs[ai]) + 32;
-                outpath = malloc(len);
-                if (!outpath) {
-                    snprintf(msg, sizeof(msg),
-                             "malloc failed for output path, block %d",
-                             block_id);
-                    log_message("ERROR", msg, true);
-                    free(esa);
-                    free(hysogs_resampled);
-                    free(hysogs_adjusted);
-                    free(cn);
-                    MPI_Abort(MPI_COMM_WORLD, 1);
-                }
-                if (snprintf
-                    (outpath, len, "%s/cn_%s_%s_%d.tif", outdir,
-                     hcs[hi], arcs[ai], block_id) >= len) {
-                    snprintf(msg, sizeof(msg),
-                             "output path too long for block %d", block_id);
-                    log_message("ERROR", msg, true);
-                    free(esa);
-                    free(hysogs_resampled);
-                    free(hysogs_adjusted);
-                    free(cn);
-                    free(outpath);
-                    MPI_Abort(MPI_COMM_WORLD, 1);
-                }
-                if (!overwrite) {
-                    f = fopen(outpath, "r");
-                    if (f) {
-                        fclose(f);
-                        char *newpath = malloc(len + 1);
-
-                        if (!newpath) {
-                            snprintf(msg,
-                                     sizeof(msg),
-                                     "malloc failed for new output path, block %d",
-                                     block_id);
-                            log_message("ERROR", msg, true);
-                            free(esa);
-                            free(hysogs_resampled);
-                            free(hysogs_adjusted);
-                            free(cn);
-                            free(outpath);
-                            MPI_Abort(MPI_COMM_WORLD, 1);
-                        }
-                        if (snprintf
-                            (newpath, len + 1,
-                             "%s/cn_%s_%s_%d_.tif",
-                             outdir, hcs[hi], arcs[ai],
-                             block_id) >= len + 1) {
-                            snprintf(msg,
-                                     sizeof(msg),
-                                     "new output path too long for block %d",
-                                     block_id);
-                            log_message("ERROR", msg, true);
-                            free(esa);
-                            free(hysogs_resampled);
-                            free(hysogs_adjusted);
-                            free(cn);
-                            free(outpath);
-                            free(newpath);
-                            MPI_Abort(MPI_COMM_WORLD, 1);
-                        }
-                        free(outpath);
-                        outpath = newpath;
-                    }
-                }
+        /* drained scenario over the same table, for delta output */
+        for (d = 0; d < sc; d++) {
+            if (scens[d].cond == 0 && scens[d].table == scens[sc].table)
+                break;
+        }
 
-                /* save cn raster */
-                save_raster(cn, esax, esay, gt, srs, outpath);
+        /* generate cn raster into the reused scenario buffer */
+        cn = arena_get(ARENA_CN, npix);
 
-                /* log completion */
-                snprintf(msg, sizeof(msg),
-                         "completed condition for %d: %s/%s/%s",
-                         block_id, conds[c], hcs[hi], arcs[ai]);
-                log_message("INFO", msg, false);
+        if (c == 1 && output_mode == OUTPUT_DELTA && d < sc) {
+            /* undrained as a sparse delta over drained */
+            gcn10_calculate_delta(g.esa, g.soil, npix,
+                                  tables[scens[sc].table], cn);
+            snprintf(name, sizeof(name), "cn_%s_%d_delta", scens[sc].name,
+                     block_id);
+            outpath = build_outpath(outdir, name, ".tif", overwrite);
+            save_raster(cn, esax, esay, g.gt, g.srs, outpath);
 
-                /* report tha 1/18 condition for
-                 * this block has completed */
-                report_block_completion(block_id, total_blocks);
+            /* vrt overlays the delta on the drained raster */
+            snprintf(name, sizeof(name), "cn_%s_%d", scens[sc].name,
+                     block_id);
+            vrtpath = build_outpath(outdir, name, ".vrt", overwrite);
+            snprintf(base_rel, sizeof(base_rel), "../cn_rasters_%s/%s",
+                     conds[0], out_names[d]);
+            srcs[0].path = base_rel;
+            srcs[0].nodata = -1;
+            srcs[0].lut = NULL;
+            srcs[1].path = CPLGetFilename(outpath);
+            srcs[1].nodata = 0;
+            srcs[1].lut = NULL;
+            write_vrt(vrtpath, esax, esay, g.gt, g.srs, srcs, 2);
+            free(vrtpath);
+        }
+        else {
+            gcn10_apply_lut(luts[sc], g.keys, npix, cn);
 
-                free(outpath);
-                free(cn);
-                free(hysogs_adjusted);
-            }
+            /* save cn raster */
+            snprintf(name, sizeof(name), "cn_%s_%d", scens[sc].name,
+                     block_id);
+            outpath = build_outpath(outdir, name, ".tif", overwrite);
+            save_raster(cn, esax, esay, g.gt, g.srs, outpath);
         }
+        snprintf(out_names[sc], sizeof(out_names[0]), "%s",
+                 CPLGetFilename(outpath));
+
+        /* log and report that one scenario of this block has completed */
+        scenario_done(block_id, sc, total_blocks);
+
+        free(outpath);
+    }
+
+    free(out_names);
+}
+
+/* process part of n_parts of a single block (an aoi window in aoi
+ * mode) and generate cn rasters. parts are row ranges that different
+ * ranks write as part files, merged by merge_band_parts(); a block or
+ * part over max_memory_per_rank is processed in row bands written
+ * into the same outputs */
+void process_block(int block_id, int part, int n_parts, bool overwrite,
+                   int total_blocks)
+{
+    struct block_plan swap;
+    double t0;
+    char msg[256];
+
+    load_scenarios();
+
+    /* the plan made when this item was prefetched, or a new one */
+    if (next_plan.block_id == block_id && next_plan.part == part &&
+        next_plan.n_parts == n_parts) {
+        swap = cur_plan;
+        cur_plan = next_plan;
+        next_plan = swap;
+    }
+    else {
+        plan_block(&cur_plan, block_id, part, n_parts);
+    }
+    next_plan.block_id = -1;
+    if (!cur_plan.n)
+        return;
+
+    if (!cur_plan.split) {
+        cur_window = 0;
+        t0 = MPI_Wtime();
+        process_window(block_id, cur_plan.bbox[0], overwrite, total_blocks);
+        phase_add(PH_WINDOW, MPI_Wtime() - t0, 0);
+        return;
+    }
+
+    snprintf(msg, sizeof(msg),
+             "block %d: rows %d-%d of %d (part %d/%d) in bands of about %d",
+             block_id, cur_plan.y0[0], cur_plan.y1[cur_plan.n - 1],
+             cur_plan.esay, part + 1, n_parts, cur_plan.rows);
+    log_message("INFO", msg, false);
+
+    set_output_parts(n_parts > 1);
+    for (cur_window = 0; cur_window < cur_plan.n; cur_window++) {
+        set_output_band(cur_plan.y0[cur_window], cur_plan.esay);
+
+        /* the band that ends the block reports its completion */
+        block_last_band = cur_plan.y1[cur_window] == cur_plan.esay;
+        t0 = MPI_Wtime();
+        process_window(block_id, cur_plan.bbox[cur_window], overwrite,
+                       total_blocks);
+        phase_add(PH_WINDOW, MPI_Wtime() - t0, 0);
     }
 
-    free(esa);
-    free(hysogs_resampled);
+    set_output_band(0, 0);
+    set_output_parts(false);
+    block_last_band = true;
+    while (n_band_paths > 0) {
+        n_band_paths--;
+        free(band_paths[2 * n_band_paths]);
+        free(band_paths[2 * n_band_paths + 1]);
+    }
 }
 
 #if 0
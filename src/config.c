@@ -6,9 +6,11 @@
 #include <stdlib.h>
 #include <string.h>
 #include <ctype.h>
+#include <math.h>
 #include <sys/stat.h>
 #include <fcntl.h>
 #include "global.h"
+#include "gcn10.h"
 
 /* configured paths */
 char *hysogs_data_path = NULL;
@@ -20,6 +22,72 @@ char *log_dir = NULL;
 /* mode flags */
 bool use_list_mode = false;
 char *block_ids_file = NULL;
+bool use_hilbert_order = false;
+bool use_dynamic_schedule = false;
+bool use_aoi_mode = false;
+char *aoi_spec = NULL;
+int aoi_tile_mb = 512;
+int max_memory_per_rank = 0;
+bool vrt_direct = true;
+int read_threads = 0;
+bool prefetch_inputs = true;
+bool threaded_reads = true;
+bool node_coop = false;
+int run_phase = RUN_ALL;
+char *output_root = NULL;
+int output_mode = OUTPUT_FULL;
+
+/* tile server */
+int serve_cache_mb = 256;
+double serve_max_pixels = 16777216.0;
+
+/* scenario manifest; all 18 defaults unless default_scenarios is set */
+bool use_default_scenario[GCN10_N_SCENARIOS] = {
+    true, true, true, true, true, true, true, true, true,
+    true, true, true, true, true, true, true, true, true
+};
+struct scenario_spec *scenario_specs = NULL;
+int n_scenario_specs = 0;
+
+/* runoff stage */
+char **precip_paths = NULL;
+int n_precip = 0;
+double runoff_lambda = 0.2;
+int runoff_outputs = RUNOFF_Q;
+bool write_cn = true;
+
+/* daily cn with dynamic arc; thresholds (mm) for arc i below / arc iii
+ * above, per season */
+struct antecedent_day *antecedent_days = NULL;
+int n_antecedent = 0;
+int arc_season = SEASON_GROWING;
+double arc_thresholds[2][2] = { { 12.7, 27.9 }, { 35.6, 53.3 } };
+
+/* aggregated products */
+int agg_levels[MAX_AGG_LEVELS];
+int n_agg_levels = 0;
+int agg_method = GCN10_AGG_MEAN;
+
+/* reduced-resolution direct mode */
+double target_res = 0;
+
+/* output crs */
+char *output_crs = NULL;
+double output_res = 0;
+
+/* monte carlo */
+int mc_runs = 0;
+double mc_sigma = 0;
+char **mc_lookup_dirs = NULL;
+int n_mc_lookup_dirs = 0;
+double mc_percentiles[MAX_MC_PERCENTILES] = { 5, 50, 95 };
+int n_mc_percentiles = 3;
+unsigned long mc_seed = 1;
+
+/* zonal statistics */
+char *zones_path = NULL;
+char *zone_field = NULL;
+char *zones_csv_path = NULL;
 
 /* trim leading and trailing whitespace */
 static char *trim_ws(char *s)
@@ -40,12 +108,237 @@ static char *trim_ws(char *s)
     return s;
 }
 
+/* append a precipitation raster path */
+static void add_precip(const char *path)
+{
+    char **p;
+
+    p = realloc(precip_paths, (n_precip + 1) * sizeof(char *));
+    if (!p || !(p[n_precip] = strdup(path))) {
+        fprintf(stderr, "malloc failed for precipitation path\n");
+        MPI_Abort(MPI_COMM_WORLD, 1);
+    }
+    precip_paths = p;
+    n_precip++;
+}
+
+/* read a precipitation time series: one raster path per line,
+ * in time order */
+static void read_precip_list(const char *path)
+{
+    FILE *f;
+    char line[PATH_MAX], *p;
+
+    f = fopen(path, "r");
+    if (!f) {
+        fprintf(stderr, "cannot open precip_list '%s'\n", path);
+        MPI_Abort(MPI_COMM_WORLD, 1);
+    }
+    while (fgets(line, sizeof(line), f)) {
+        p = trim_ws(line);
+        if (*p && *p != '#')
+            add_precip(p);
+    }
+    fclose(f);
+}
+
+/* season name to SEASON_*, -1 if unknown */
+static int parse_season(const char *s)
+{
+    if (strcmp(s, "dormant") == 0)
+        return SEASON_DORMANT;
+    if (strcmp(s, "growing") == 0)
+        return SEASON_GROWING;
+    return -1;
+}
+
+/* append an antecedent precipitation day given as raster[,season] */
+static void add_antecedent(char *spec)
+{
+    struct antecedent_day *d;
+    char *comma;
+    int season = -1;
+
+    comma = strrchr(spec, ',');
+    if (comma) {
+        *comma = '\0';
+        season = parse_season(trim_ws(comma + 1));
+        if (season < 0) {
+            fprintf(stderr, "invalid season '%s' (dormant|growing)\n",
+                    trim_ws(comma + 1));
+            MPI_Abort(MPI_COMM_WORLD, 1);
+        }
+    }
+    d = realloc(antecedent_days, (n_antecedent + 1) * sizeof(*d));
+    if (!d || !(d[n_antecedent].path = strdup(trim_ws(spec)))) {
+        fprintf(stderr, "malloc failed for antecedent path\n");
+        MPI_Abort(MPI_COMM_WORLD, 1);
+    }
+    d[n_antecedent].season = season;
+    antecedent_days = d;
+    n_antecedent++;
+}
+
+/* read antecedent days: one raster[,season] per line, in day order */
+static void read_antecedent_list(const char *path)
+{
+    FILE *f;
+    char line[PATH_MAX], *p;
+
+    f = fopen(path, "r");
+    if (!f) {
+        fprintf(stderr, "cannot open antecedent_list '%s'\n", path);
+        MPI_Abort(MPI_COMM_WORLD, 1);
+    }
+    while (fgets(line, sizeof(line), f)) {
+        p = trim_ws(line);
+        if (*p && *p != '#')
+            add_antecedent(p);
+    }
+    fclose(f);
+}
+
+/* parse lo,hi arc thresholds */
+static void parse_thresholds(const char *key, const char *val, double *t)
+{
+    if (sscanf(val, "%lf , %lf", &t[0], &t[1]) != 2 || t[0] > t[1]) {
+        fprintf(stderr, "invalid %s '%s' (lo,hi mm)\n", key, val);
+        MPI_Abort(MPI_COMM_WORLD, 1);
+    }
+}
+
+/* read perturbed lookup directories, one per line */
+static void read_mc_lookup_list(const char *path)
+{
+    FILE *f;
+    char line[PATH_MAX], *p, **d;
+
+    f = fopen(path, "r");
+    if (!f) {
+        fprintf(stderr, "cannot open mc_lookup_list '%s'\n", path);
+        MPI_Abort(MPI_COMM_WORLD, 1);
+    }
+    while (fgets(line, sizeof(line), f)) {
+        p = trim_ws(line);
+        if (!*p || *p == '#')
+            continue;
+        d = realloc(mc_lookup_dirs, (n_mc_lookup_dirs + 1) * sizeof(char *));
+        if (!d || !(d[n_mc_lookup_dirs] = strdup(p))) {
+            fprintf(stderr, "malloc failed for mc_lookup_list\n");
+            MPI_Abort(MPI_COMM_WORLD, 1);
+        }
+        mc_lookup_dirs = d;
+        n_mc_lookup_dirs++;
+    }
+    fclose(f);
+}
+
+/* select default scenarios: all, none or a list of cond/hc/arc; false
+ * on an invalid entry */
+static bool parse_default_scenarios(char *val)
+{
+    char *tok, *hc, *arc;
+    int i;
+
+    for (i = 0; i < GCN10_N_SCENARIOS; i++)
+        use_default_scenario[i] = strcmp(val, "all") == 0;
+    if (strcmp(val, "all") == 0 || strcmp(val, "none") == 0)
+        return true;
+
+    for (tok = strtok(val, ","); tok; tok = strtok(NULL, ",")) {
+        tok = trim_ws(tok);
+        hc = strchr(tok, '/');
+        arc = hc ? strchr(hc + 1, '/') : NULL;
+        if (arc) {
+            *hc++ = '\0';
+            *arc++ = '\0';
+            i = gcn10_scenario_index(tok, hc, arc);
+        }
+        else {
+            i = -1;
+        }
+        if (i < 0) {
+            fprintf(stderr, "invalid default scenario '%s' "
+                    "(cond/hc/arc, e.g. drained/f/ii)\n", tok);
+            return false;
+        }
+        use_default_scenario[i] = true;
+    }
+    return true;
+}
+
+/* append a manifest scenario given as name,drained|undrained,lookup;
+ * false on an invalid entry */
+static bool add_scenario_spec(char *val)
+{
+    struct scenario_spec *p;
+    char *name, *cond, *lookup, dflt[SCENARIO_NAME_MAX];
+    size_t i;
+    int hi, ai, c;
+
+    name = strtok(val, ",");
+    cond = strtok(NULL, ",");
+    lookup = strtok(NULL, "");
+    if (!name || !cond || !lookup) {
+        fprintf(stderr, "invalid scenario '%s' "
+                "(name,drained|undrained,lookup.csv)\n", val);
+        return false;
+    }
+    name = trim_ws(name);
+    cond = trim_ws(cond);
+    lookup = trim_ws(lookup);
+    for (i = 0; name[i]; i++) {
+        if (!isalnum((unsigned char)name[i]) && !strchr("_-.", name[i]))
+            break;
+    }
+    if (!*name || name[i] || i >= SCENARIO_NAME_MAX ||
+        (strcmp(cond, "drained") && strcmp(cond, "undrained"))) {
+        fprintf(stderr, "invalid scenario '%s,%s' (name of letters, digits, "
+                "_-. and drained|undrained)\n", name, cond);
+        return false;
+    }
+
+    /* outputs are named after the scenario, so a name may not repeat
+     * for a condition or take that of a default scenario */
+    c = strcmp(cond, "drained") ? 1 : 0;
+    for (i = 0; i < (size_t)n_scenario_specs; i++) {
+        if (scenario_specs[i].cond == c &&
+            !strcmp(scenario_specs[i].name, name)) {
+            fprintf(stderr, "duplicate scenario '%s,%s'\n", name, cond);
+            return false;
+        }
+    }
+    for (hi = 0; hi < GCN10_N_HCS; hi++) {
+        for (ai = 0; ai < GCN10_N_ARCS; ai++) {
+            snprintf(dflt, sizeof(dflt), "%s_%s", gcn10_hcs[hi],
+                     gcn10_arcs[ai]);
+            if (!strcmp(dflt, name)) {
+                fprintf(stderr, "scenario '%s' has the name of a default "
+                        "scenario\n", name);
+                return false;
+            }
+        }
+    }
+
+    p = realloc(scenario_specs, (n_scenario_specs + 1) * sizeof(*p));
+    if (!p || !(p[n_scenario_specs].name = strdup(name)) ||
+        !(p[n_scenario_specs].lookup = strdup(lookup))) {
+        fprintf(stderr, "malloc failed for scenario\n");
+        MPI_Abort(MPI_COMM_WORLD, 1);
+    }
+    p[n_scenario_specs].cond = c;
+    scenario_specs = p;
+    n_scenario_specs++;
+    return true;
+}
+
 /* parse key=value config file */
 void parse_config(const char *conf_file)
 {
     FILE *f;
     char line[512];
     char *p, *eq, *key, *val;
+    int i;
 
     f = fopen(conf_file, "r");
     if (!f) {
@@ -101,6 +394,273 @@ void parse_config(const char *conf_file)
                 MPI_Abort(MPI_COMM_WORLD, 1);
             }
         }
+        else if (strcmp(key, "output_mode") == 0) {
+            if (strcmp(val, "full") == 0) {
+                output_mode = OUTPUT_FULL;
+            }
+            else if (strcmp(val, "delta") == 0) {
+                output_mode = OUTPUT_DELTA;
+            }
+            else if (strcmp(val, "class") == 0) {
+                output_mode = OUTPUT_CLASS;
+            }
+            else {
+                fprintf(stderr,
+                        "invalid output_mode '%s' (full|delta|class)\n",
+                        val);
+                MPI_Abort(MPI_COMM_WORLD, 1);
+            }
+        }
+        else if (strcmp(key, "serve_cache_mb") == 0) {
+            serve_cache_mb = atoi(val);
+            if (serve_cache_mb < 0) {
+                fprintf(stderr, "invalid serve_cache_mb '%s'\n", val);
+                MPI_Abort(MPI_COMM_WORLD, 1);
+            }
+        }
+        else if (strcmp(key, "serve_max_pixels") == 0) {
+            serve_max_pixels = atof(val);
+        }
+        else if (strcmp(key, "max_memory_per_rank") == 0) {
+            max_memory_per_rank = atoi(val);
+            if (max_memory_per_rank < 0) {
+                fprintf(stderr, "invalid max_memory_per_rank '%s'\n", val);
+                MPI_Abort(MPI_COMM_WORLD, 1);
+            }
+        }
+        else if (strcmp(key, "vrt_direct") == 0) {
+            vrt_direct = strcmp(val, "no") != 0;
+        }
+        else if (strcmp(key, "prefetch") == 0) {
+            prefetch_inputs = strcmp(val, "no") != 0;
+        }
+        else if (strcmp(key, "node_coop") == 0) {
+            node_coop = strcmp(val, "yes") == 0;
+        }
+        else if (strcmp(key, "read_threads") == 0) {
+            read_threads = atoi(val);
+            if (read_threads < 0) {
+                fprintf(stderr, "invalid read_threads '%s'\n", val);
+                MPI_Abort(MPI_COMM_WORLD, 1);
+            }
+        }
+        else if (strcmp(key, "aoi_tile_mb") == 0) {
+            aoi_tile_mb = atoi(val);
+            if (aoi_tile_mb <= 0) {
+                fprintf(stderr, "invalid aoi_tile_mb '%s'\n", val);
+                MPI_Abort(MPI_COMM_WORLD, 1);
+            }
+        }
+        else if (strcmp(key, "precip") == 0) {
+            add_precip(val);
+        }
+        else if (strcmp(key, "precip_list") == 0) {
+            read_precip_list(val);
+        }
+        else if (strcmp(key, "runoff_lambda") == 0) {
+            runoff_lambda = atof(val);
+            if (runoff_lambda < 0 || runoff_lambda > 1) {
+                fprintf(stderr, "invalid runoff_lambda '%s' (0-1)\n", val);
+                MPI_Abort(MPI_COMM_WORLD, 1);
+            }
+        }
+        else if (strcmp(key, "runoff_outputs") == 0) {
+            char *tok;
+
+            runoff_outputs = RUNOFF_Q;
+            for (tok = strtok(val, ","); tok; tok = strtok(NULL, ",")) {
+                tok = trim_ws(tok);
+                if (strcmp(tok, "s") == 0) {
+                    runoff_outputs |= RUNOFF_S;
+                }
+                else if (strcmp(tok, "ia") == 0) {
+                    runoff_outputs |= RUNOFF_IA;
+                }
+                else if (strcmp(tok, "q") != 0) {
+                    fprintf(stderr,
+                            "invalid runoff_outputs '%s' (q,s,ia)\n", tok);
+                    MPI_Abort(MPI_COMM_WORLD, 1);
+                }
+            }
+        }
+        else if (strcmp(key, "antecedent") == 0) {
+            add_antecedent(val);
+        }
+        else if (strcmp(key, "antecedent_list") == 0) {
+            read_antecedent_list(val);
+        }
+        else if (strcmp(key, "arc_season") == 0) {
+            arc_season = parse_season(val);
+            if (arc_season < 0) {
+                fprintf(stderr, "invalid arc_season '%s' (dormant|growing)\n",
+                        val);
+                MPI_Abort(MPI_COMM_WORLD, 1);
+            }
+        }
+        else if (strcmp(key, "arc_thresholds_dormant") == 0) {
+            parse_thresholds(key, val, arc_thresholds[SEASON_DORMANT]);
+        }
+        else if (strcmp(key, "arc_thresholds_growing") == 0) {
+            parse_thresholds(key, val, arc_thresholds[SEASON_GROWING]);
+        }
+        else if (strcmp(key, "default_scenarios") == 0) {
+            if (!parse_default_scenarios(val))
+                MPI_Abort(MPI_COMM_WORLD, 1);
+        }
+        else if (strcmp(key, "scenario") == 0) {
+            if (!add_scenario_spec(val))
+                MPI_Abort(MPI_COMM_WORLD, 1);
+        }
+        else if (strcmp(key, "aggregate_levels") == 0) {
+            char *tok;
+
+            n_agg_levels = 0;
+            for (tok = strtok(val, ","); tok; tok = strtok(NULL, ",")) {
+                if (n_agg_levels == MAX_AGG_LEVELS || atoi(tok) <= 0) {
+                    fprintf(stderr, "invalid aggregate_levels '%s' "
+                            "(up to %d sizes in metres)\n", tok,
+                            MAX_AGG_LEVELS);
+                    MPI_Abort(MPI_COMM_WORLD, 1);
+                }
+                agg_levels[n_agg_levels++] = atoi(tok);
+            }
+        }
+        else if (strcmp(key, "target_resolution") == 0) {
+            /* metres at the equator, as for aggregate_levels */
+            target_res = atof(val) / 111320.0;
+            if (target_res < 0) {
+                fprintf(stderr, "invalid target_resolution '%s'\n", val);
+                MPI_Abort(MPI_COMM_WORLD, 1);
+            }
+        }
+        else if (strcmp(key, "aggregate_method") == 0) {
+            if (strcmp(val, "majority") == 0) {
+                agg_method = GCN10_AGG_MAJORITY;
+            }
+            else if (strcmp(val, "mean") == 0) {
+                agg_method = GCN10_AGG_MEAN;
+            }
+            else if (strcmp(val, "runoff") == 0) {
+                agg_method = GCN10_AGG_RUNOFF;
+            }
+            else {
+                fprintf(stderr, "invalid aggregate_method '%s' "
+                        "(majority|mean|runoff)\n", val);
+                MPI_Abort(MPI_COMM_WORLD, 1);
+            }
+        }
+        else if (strcmp(key, "mc_runs") == 0) {
+            mc_runs = atoi(val);
+            if (mc_runs < 0) {
+                fprintf(stderr, "invalid mc_runs '%s'\n", val);
+                MPI_Abort(MPI_COMM_WORLD, 1);
+            }
+        }
+        else if (strcmp(key, "mc_sigma") == 0) {
+            char *end;
+
+            mc_sigma = strtod(val, &end);
+            if (end == val || *end || !(mc_sigma >= 0)) {
+                fprintf(stderr, "invalid mc_sigma '%s'\n", val);
+                MPI_Abort(MPI_COMM_WORLD, 1);
+            }
+        }
+        else if (strcmp(key, "mc_lookup_list") == 0) {
+            read_mc_lookup_list(val);
+        }
+        else if (strcmp(key, "mc_seed") == 0) {
+            mc_seed = strtoul(val, NULL, 10);
+        }
+        else if (strcmp(key, "mc_percentiles") == 0) {
+            char *tok;
+
+            n_mc_percentiles = 0;
+            for (tok = strtok(val, ","); tok; tok = strtok(NULL, ",")) {
+                if (n_mc_percentiles == MAX_MC_PERCENTILES ||
+                    atof(tok) < 0 || atof(tok) > 100) {
+                    fprintf(stderr, "invalid mc_percentiles '%s' "
+                            "(up to %d values in 0-100)\n", tok,
+                            MAX_MC_PERCENTILES);
+                    MPI_Abort(MPI_COMM_WORLD, 1);
+                }
+                mc_percentiles[n_mc_percentiles++] = atof(tok);
+            }
+        }
+        else if (strcmp(key, "output_crs") == 0) {
+            OGRSpatialReferenceH t = OSRNewSpatialReference(NULL);
+
+            if (OSRSetFromUserInput(t, val) != OGRERR_NONE) {
+                fprintf(stderr, "invalid output_crs '%s'\n", val);
+                MPI_Abort(MPI_COMM_WORLD, 1);
+            }
+            OSRDestroySpatialReference(t);
+            free(output_crs);
+            output_crs = strdup(val);
+            if (!output_crs) {
+                fprintf(stderr, "malloc failed for output_crs\n");
+                MPI_Abort(MPI_COMM_WORLD, 1);
+            }
+        }
+        else if (strcmp(key, "output_res") == 0) {
+            output_res = atof(val);
+            if (output_res < 0) {
+                fprintf(stderr, "invalid output_res '%s'\n", val);
+                MPI_Abort(MPI_COMM_WORLD, 1);
+            }
+        }
+        else if (strcmp(key, "zones") == 0) {
+            free(zones_path);
+            zones_path = strdup(val);
+            if (!zones_path) {
+                fprintf(stderr, "malloc failed for zones\n");
+                MPI_Abort(MPI_COMM_WORLD, 1);
+            }
+        }
+        else if (strcmp(key, "zone_field") == 0) {
+            free(zone_field);
+            zone_field = strdup(val);
+            if (!zone_field) {
+                fprintf(stderr, "malloc failed for zone_field\n");
+                MPI_Abort(MPI_COMM_WORLD, 1);
+            }
+        }
+        else if (strcmp(key, "zones_csv") == 0) {
+            free(zones_csv_path);
+            zones_csv_path = strdup(val);
+            if (!zones_csv_path) {
+                fprintf(stderr, "malloc failed for zones_csv\n");
+                MPI_Abort(MPI_COMM_WORLD, 1);
+            }
+        }
+        else if (strcmp(key, "write_cn") == 0) {
+            write_cn = strcmp(val, "no") != 0;
+        }
+        else if (strcmp(key, "block_order") == 0) {
+            if (strcmp(val, "hilbert") == 0) {
+                use_hilbert_order = true;
+            }
+            else if (strcmp(val, "list") == 0) {
+                use_hilbert_order = false;
+            }
+            else {
+                fprintf(stderr, "invalid block_order '%s' (list|hilbert)\n",
+                        val);
+                MPI_Abort(MPI_COMM_WORLD, 1);
+            }
+        }
+        else if (strcmp(key, "schedule") == 0) {
+            if (strcmp(val, "dynamic") == 0) {
+                use_dynamic_schedule = true;
+            }
+            else if (strcmp(val, "static") == 0) {
+                use_dynamic_schedule = false;
+            }
+            else {
+                fprintf(stderr, "invalid schedule '%s' (static|dynamic)\n",
+                        val);
+                MPI_Abort(MPI_COMM_WORLD, 1);
+            }
+        }
     }
     fclose(f);
 
@@ -111,6 +671,40 @@ void parse_config(const char *conf_file)
                 "blocks_shp_path, lookup_table_path, log_dir\n");
         MPI_Abort(MPI_COMM_WORLD, 1);
     }
+    for (i = 0; i < GCN10_N_SCENARIOS && !use_default_scenario[i]; i++)
+        ;
+    if (i == GCN10_N_SCENARIOS && !n_scenario_specs) {
+        fprintf(stderr, "no scenarios: default_scenarios=none and no "
+                "scenario entries\n");
+        MPI_Abort(MPI_COMM_WORLD, 1);
+    }
+    if (n_mc_lookup_dirs)
+        mc_runs = n_mc_lookup_dirs;
+    if (zones_path) {
+        if (!zone_field)
+            zone_field = strdup("ID");
+        if (!zones_csv_path)
+            zones_csv_path = strdup("zonal_stats.csv");
+        if (!zone_field || !zones_csv_path) {
+            fprintf(stderr, "malloc failed for zone settings\n");
+            MPI_Abort(MPI_COMM_WORLD, 1);
+        }
+    }
+    if (!write_cn && !n_precip && !n_antecedent) {
+        fprintf(stderr, "write_cn=no requires precip, precip_list, "
+                "antecedent or antecedent_list\n");
+        MPI_Abort(MPI_COMM_WORLD, 1);
+    }
+
+    /* a level needs at least two pixels of the grid it is made from;
+     * at native resolution that is only known per block */
+    for (i = 0; target_res > 0 && i < n_agg_levels; i++) {
+        if (lround(agg_levels[i] / (target_res * 111320.0)) < 2) {
+            fprintf(stderr, "aggregate level %dm is finer than two "
+                    "target_resolution pixels\n", agg_levels[i]);
+            MPI_Abort(MPI_COMM_WORLD, 1);
+        }
+    }
 }
 
 /* free allocated config strings */
@@ -127,4 +721,210 @@ void free_config(void)
     lookup_table_path = NULL;
     log_dir = NULL;
     block_ids_file = NULL;
+    aoi_spec = NULL;
+    while (n_precip > 0)
+        free(precip_paths[--n_precip]);
+    free(precip_paths);
+    precip_paths = NULL;
+    free(output_crs);
+    output_crs = NULL;
+    free(zones_path);
+    free(zone_field);
+    free(zones_csv_path);
+    zones_path = NULL;
+    zone_field = NULL;
+    zones_csv_path = NULL;
+    while (n_scenario_specs > 0) {
+        n_scenario_specs--;
+        free(scenario_specs[n_scenario_specs].name);
+        free(scenario_specs[n_scenario_specs].lookup);
+    }
+    free(scenario_specs);
+    scenario_specs = NULL;
+    while (n_mc_lookup_dirs > 0)
+        free(mc_lookup_dirs[--n_mc_lookup_dirs]);
+    free(mc_lookup_dirs);
+    mc_lookup_dirs = NULL;
+    while (n_antecedent > 0)
+        free(antecedent_days[--n_antecedent].path);
+    free(antecedent_days);
+    antecedent_days = NULL;
+}
+
+/* config settings a daemon job can change, as the config set them */
+static bool job_base_saved = false;
+static bool base_default_scenario[GCN10_N_SCENARIOS];
+static int base_n_scenario_specs;
+static char *base_lookup_table_path;
+
+/* true if path can be opened for reading */
+static bool readable(const char *path)
+{
+    FILE *f = fopen(path, "r");
+
+    if (!f)
+        return false;
+    fclose(f);
+    return true;
+}
+
+/* true if lookup table fname can be read, and with mc_lookup_list its
+ * realization in every listed directory */
+static bool job_table_readable(const char *fname)
+{
+    char path[PATH_MAX];
+    int r;
+
+    if (!readable(fname)) {
+        fprintf(stderr, "job lookup table %s missing\n", fname);
+        return false;
+    }
+    for (r = 0; r < n_mc_lookup_dirs; r++) {
+        if (snprintf(path, sizeof(path), "%s/%s", mc_lookup_dirs[r],
+                     CPLGetFilename(fname)) >= (int)sizeof(path) ||
+            !readable(path)) {
+            fprintf(stderr, "job realization table %s/%s missing\n",
+                    mc_lookup_dirs[r], CPLGetFilename(fname));
+            return false;
+        }
+    }
+    return true;
+}
+
+/* parse the key=value lines of a daemon job in text (modified) into
+ * job. default_scenarios, scenario and lookup_table_path apply over
+ * the config as if they followed it, until end_job(). false on an
+ * invalid job, which then has to be ended without processing it */
+bool parse_job(char *text, struct job *job)
+{
+    char *line, *next, *eq, *key, *val, fname[PATH_MAX];
+    int i, hi, ai, c;
+
+    if (!job_base_saved) {
+        memcpy(base_default_scenario, use_default_scenario,
+               sizeof(base_default_scenario));
+        base_n_scenario_specs = n_scenario_specs;
+        base_lookup_table_path = lookup_table_path;
+        job_base_saved = true;
+    }
+    job->blocks = NULL;
+    job->output = NULL;
+    job->overwrite = -1;
+
+    for (line = text; line; line = next) {
+        next = strchr(line, '\n');
+        if (next)
+            *next++ = '\0';
+        line = trim_ws(line);
+        if (!*line || *line == '#')
+            continue;
+        eq = strchr(line, '=');
+        if (!eq) {
+            fprintf(stderr, "invalid job line '%s'\n", line);
+            return false;
+        }
+        *eq = '\0';
+        key = trim_ws(line);
+        val = trim_ws(eq + 1);
+
+        if (strcmp(key, "blocks") == 0) {
+            free(job->blocks);
+            job->blocks = strdup(val);
+            if (!job->blocks) {
+                fprintf(stderr, "malloc failed for job blocks\n");
+                MPI_Abort(MPI_COMM_WORLD, 1);
+            }
+        }
+        else if (strcmp(key, "output") == 0) {
+            free(job->output);
+            job->output = strdup(val);
+            if (!job->output) {
+                fprintf(stderr, "malloc failed for job output\n");
+                MPI_Abort(MPI_COMM_WORLD, 1);
+            }
+        }
+        else if (strcmp(key, "overwrite") == 0) {
+            job->overwrite = strcmp(val, "no") != 0;
+        }
+        else if (strcmp(key, "lookup_table_path") == 0) {
+            if (lookup_table_path != base_lookup_table_path)
+                free(lookup_table_path);
+            lookup_table_path = strdup(val);
+            if (!lookup_table_path) {
+                fprintf(stderr, "malloc failed for lookup_table_path\n");
+                MPI_Abort(MPI_COMM_WORLD, 1);
+            }
+        }
+        else if (strcmp(key, "default_scenarios") == 0) {
+            if (!parse_default_scenarios(val))
+                return false;
+        }
+        else if (strcmp(key, "scenario") == 0) {
+            if (!add_scenario_spec(val))
+                return false;
+        }
+        else {
+            fprintf(stderr, "unknown job setting '%s'\n", key);
+            return false;
+        }
+    }
+
+    if (!job->blocks || !*job->blocks) {
+        fprintf(stderr, "job without blocks\n");
+        return false;
+    }
+
+    /* every table the job loads: the selected defaults, all nine
+     * for daily arc selection, and the custom ones */
+    for (c = 0, i = 0; c < GCN10_N_SCENARIOS; c++)
+        i += use_default_scenario[c];
+    if (!i && !n_scenario_specs) {
+        fprintf(stderr, "job without scenarios\n");
+        return false;
+    }
+    for (hi = 0; hi < GCN10_N_HCS; hi++) {
+        for (ai = 0; ai < GCN10_N_ARCS; ai++) {
+            for (c = 0, i = n_antecedent > 0; c < GCN10_N_CONDS; c++)
+                i += use_default_scenario[GCN10_SCENARIO(c, hi, ai)];
+            if (!i)
+                continue;
+            if (gcn10_lookup_path(lookup_table_path, gcn10_hcs[hi],
+                                  gcn10_arcs[ai], fname,
+                                  sizeof(fname)) != GCN10_OK) {
+                fprintf(stderr, "job lookup table path too long in %s\n",
+                        lookup_table_path);
+                return false;
+            }
+            if (!job_table_readable(fname))
+                return false;
+        }
+    }
+    for (i = 0; i < n_scenario_specs; i++) {
+        if (!job_table_readable(scenario_specs[i].lookup))
+            return false;
+    }
+    return true;
+}
+
+/* free job and put the settings it changed back to the config's */
+void end_job(struct job *job)
+{
+    free(job->blocks);
+    free(job->output);
+    job->blocks = NULL;
+    job->output = NULL;
+    if (!job_base_saved)
+        return;
+
+    memcpy(use_default_scenario, base_default_scenario,
+           sizeof(base_default_scenario));
+    while (n_scenario_specs > base_n_scenario_specs) {
+        n_scenario_specs--;
+        free(scenario_specs[n_scenario_specs].name);
+        free(scenario_specs[n_scenario_specs].lookup);
+    }
+    if (lookup_table_path != base_lookup_table_path)
+        free(lookup_table_path);
+    lookup_table_path = base_lookup_table_path;
+    reset_scenarios();
 }
@@ -0,0 +1,342 @@
+/* daemon mode: the ranks stay up between runs and take jobs from a
+ * spool directory, so mpi startup, driver registration and the block
+ * index are paid for once instead of per run. rank 0 polls the
+ * directory for *.job files, claims the first in name order by
+ * renaming it to .running and hands its text to all ranks, which run
+ * its blocks like a normal run. a .done or .failed record takes the
+ * place of the job; a file named stop ends the daemon */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include "global.h"
+
+/* seconds between looks at an idle spool directory */
+#define DAEMON_POLL_SECONDS 1.0
+
+/* room left in a path for a job name and its suffixes */
+#define DAEMON_NAME_MAX 300
+
+/* longest job file accepted */
+#define MAX_JOB_BYTES 65536
+
+static int cmp_names(const void *a, const void *b)
+{
+    return strcmp(*(char *const *)a, *(char *const *)b);
+}
+
+/* true if name ends in suffix */
+static bool has_suffix(const char *name, const char *suffix)
+{
+    size_t n = strlen(name), m = strlen(suffix);
+
+    return n > m && strcmp(name + n - m, suffix) == 0;
+}
+
+/* read a whole job file; NULL if it cannot be read or is too long */
+static char *read_job(const char *path)
+{
+    FILE *f;
+    char *text;
+    size_t len;
+
+    f = fopen(path, "rb");
+    if (!f)
+        return NULL;
+    text = malloc(MAX_JOB_BYTES + 1);
+    if (!text) {
+        log_message("ERROR", "malloc failed for job text", true);
+        MPI_Abort(MPI_COMM_WORLD, 1);
+    }
+    len = fread(text, 1, MAX_JOB_BYTES + 1, f);
+    fclose(f);
+    if (len > MAX_JOB_BYTES) {
+        free(text);
+        return NULL;
+    }
+    text[len] = '\0';
+    return text;
+}
+
+/* wait for the next job in spool and claim it; returns its text and
+ * sets name to the job without .job, or NULL once a stop file shows
+ * up. a job that cannot be read gets an empty text, which fails to
+ * parse. rank 0 only */
+static char *next_job(const char *spool, char *name, size_t n)
+{
+    char **entries, path[PATH_MAX], running[PATH_MAX], msg[PATH_MAX + 64];
+    char *text;
+    int i, count;
+    size_t len;
+
+    for (;;) {
+        entries = VSIReadDir(spool);
+        count = CSLCount(entries);
+        if (count)
+            qsort(entries, count, sizeof(char *), cmp_names);
+
+        for (i = 0; i < count; i++) {
+            if (strcmp(entries[i], "stop") == 0) {
+                snprintf(path, sizeof(path), "%s/stop", spool);
+                VSIUnlink(path);
+                CSLDestroy(entries);
+                return NULL;
+            }
+        }
+        for (i = 0; i < count; i++) {
+            if (!has_suffix(entries[i], ".job"))
+                continue;
+
+            /* a rename that fails means the job went elsewhere; names
+             * too long for a path cannot be claimed */
+            len = strlen(entries[i]) - 4;
+            if (snprintf(name, n, "%.*s", (int)len, entries[i]) >= (int)n ||
+                snprintf(path, sizeof(path), "%s/%s", spool,
+                         entries[i]) >= (int)sizeof(path) ||
+                snprintf(running, sizeof(running), "%s/%s.running", spool,
+                         name) >= (int)sizeof(running) ||
+                rename(path, running) != 0)
+                continue;
+            CSLDestroy(entries);
+
+            text = read_job(running);
+            if (!text) {
+                snprintf(msg, sizeof(msg), "cannot read job %s", running);
+                log_message("ERROR", msg, true);
+                text = calloc(1, 1);
+                if (!text)
+                    MPI_Abort(MPI_COMM_WORLD, 1);
+            }
+            return text;
+        }
+        CSLDestroy(entries);
+        CPLSleep(DAEMON_POLL_SECONDS);
+    }
+}
+
+/* block ids of a job: a list like 12,15,20 or the path of a block
+ * list file. ids not in the block index are dropped with a warning */
+static int *job_blocks(const char *spec, int *n_blocks)
+{
+    const char *p;
+    char *end, msg[256];
+    double bbox[4];
+    int *ids, cap, cnt, i, k;
+    long id;
+
+    for (p = spec; *p && (isdigit((unsigned char)*p) || *p == ',' ||
+                          isspace((unsigned char)*p)); p++)
+        ;
+    if (*p) {
+        ids = read_block_list(spec, &cnt);
+        if (!ids)
+            return NULL;
+    }
+    else {
+        cap = 16;
+        cnt = 0;
+        ids = malloc(cap * sizeof(int));
+        if (!ids) {
+            log_message("ERROR", "malloc failed for block ids", true);
+            MPI_Abort(MPI_COMM_WORLD, 1);
+        }
+        for (p = spec; *p; p = end) {
+            while (*p == ',' || isspace((unsigned char)*p))
+                p++;
+            if (!*p)
+                break;
+            id = strtol(p, &end, 10);
+            if (cnt == cap) {
+                int *new_ids;
+
+                cap *= 2;
+                new_ids = realloc(ids, cap * sizeof(int));
+                if (!new_ids) {
+                    log_message("ERROR", "realloc failed for block ids",
+                                true);
+                    free(ids);
+                    MPI_Abort(MPI_COMM_WORLD, 1);
+                }
+                ids = new_ids;
+            }
+            ids[cnt++] = (int)id;
+        }
+    }
+
+    for (i = 0, k = 0; i < cnt; i++) {
+        if (kept_block_bbox(ids[i], bbox)) {
+            ids[k++] = ids[i];
+        }
+        else {
+            snprintf(msg, sizeof(msg), "job block %d not in %s, skipped",
+                     ids[i], blocks_shp_path);
+            log_message("WARNING", msg, true);
+        }
+    }
+    *n_blocks = k;
+    return ids;
+}
+
+/* record the outcome of job name next to it and drop its .running */
+static void finish_job(const char *spool, const char *name, bool ok,
+                       int n_blocks, double seconds, const char *output)
+{
+    FILE *f;
+    char path[PATH_MAX], msg[PATH_MAX + 64];
+
+    f = NULL;
+    if (snprintf(path, sizeof(path), "%s/%s.%s", spool, name,
+                 ok ? "done" : "failed") < (int)sizeof(path))
+        f = fopen(path, "w");
+    if (f) {
+        fprintf(f, "status = %s\n", ok ? "done" : "failed");
+        fprintf(f, "blocks = %d\n", n_blocks);
+        fprintf(f, "seconds = %.1f\n", seconds);
+        fprintf(f, "output = %s\n", output ? output : ".");
+        fclose(f);
+    }
+    else {
+        snprintf(msg, sizeof(msg), "cannot write job record %s", path);
+        log_message("ERROR", msg, true);
+    }
+    if (snprintf(path, sizeof(path), "%s/%s.running", spool,
+                 name) < (int)sizeof(path))
+        VSIUnlink(path);
+}
+
+/* serve jobs from spool until a stop file appears; overwrite applies
+ * to jobs that do not set it. collective over MPI_COMM_WORLD */
+int run_daemon(const char *spool, bool overwrite)
+{
+    struct job job;
+    char name[PATH_MAX], msg[PATH_MAX + 128];
+    char *text = NULL;
+    int *all_ids, *ids = NULL;
+    int rank, len, n_all, n_blocks, ok, n_jobs = 0;
+    double *bboxes, t0;
+
+    MPI_Comm_rank(MPI_COMM_WORLD, &rank);
+    if (strlen(spool) + DAEMON_NAME_MAX >= PATH_MAX) {
+        if (rank == 0)
+            log_message("ERROR", "--daemon spool directory path too long",
+                        true);
+        return 1;
+    }
+    if (zones_path || use_aoi_mode) {
+        if (rank == 0)
+            log_message("ERROR", "--daemon does not support zones or --aoi",
+                        true);
+        return 1;
+    }
+
+    /* the block index is read once; jobs look their blocks up in it */
+    all_ids = get_all_blocks(&n_all);
+    bboxes = all_ids && n_all ? get_block_bboxes(all_ids, n_all) : NULL;
+    if (!bboxes) {
+        if (rank == 0) {
+            snprintf(msg, sizeof(msg), "no blocks found in %s",
+                     blocks_shp_path);
+            log_message("ERROR", msg, true);
+        }
+        free(all_ids);
+        return 1;
+    }
+    keep_block_bboxes(all_ids, bboxes, n_all);
+    free(all_ids);
+    free(bboxes);
+
+    if (rank == 0) {
+        snprintf(msg, sizeof(msg), "daemon waiting for jobs in %s", spool);
+        log_message("INFO", msg, true);
+    }
+
+    for (;;) {
+        /* rank 0 claims a job and hands its text to all ranks */
+        if (rank == 0) {
+            text = next_job(spool, name, sizeof(name));
+            len = text ? (int)strlen(text) : -1;
+        }
+        MPI_Bcast(&len, 1, MPI_INT, 0, MPI_COMM_WORLD);
+        if (len < 0)
+            break;
+        if (rank != 0) {
+            text = malloc(len + 1);
+            if (!text) {
+                log_message("ERROR", "malloc failed for job text", true);
+                MPI_Abort(MPI_COMM_WORLD, 1);
+            }
+        }
+        MPI_Bcast(text, len + 1, MPI_CHAR, 0, MPI_COMM_WORLD);
+        t0 = MPI_Wtime();
+
+        /* every rank applies the job's settings and loads its tables,
+         * so a bad one fails the job rather than the daemon; rank 0
+         * resolves its blocks and output root, so all ranks agree on
+         * them */
+        ok = parse_job(text, &job);
+        MPI_Allreduce(MPI_IN_PLACE, &ok, 1, MPI_INT, MPI_MIN, MPI_COMM_WORLD);
+        if (ok)
+            ok = prepare_scenarios();
+        n_blocks = 0;
+        if (rank == 0 && ok) {
+            ids = job_blocks(job.blocks, &n_blocks);
+            ok = ids && n_blocks;
+            if (ok && job.output && run_phase == RUN_ALL &&
+                VSIMkdirRecursive(job.output, 0755) != 0) {
+                VSIStatBufL st;
+
+                ok = VSIStatL(job.output, &st) == 0;
+            }
+            if (!ok) {
+                snprintf(msg, sizeof(msg), "job %s has no blocks to run or "
+                         "no output directory", name);
+                log_message("ERROR", msg, true);
+            }
+        }
+        MPI_Bcast(&ok, 1, MPI_INT, 0, MPI_COMM_WORLD);
+        if (ok) {
+            MPI_Bcast(&n_blocks, 1, MPI_INT, 0, MPI_COMM_WORLD);
+            if (rank != 0) {
+                ids = malloc((size_t)n_blocks * sizeof(int));
+                if (!ids) {
+                    log_message("ERROR", "malloc failed for block ids", true);
+                    MPI_Abort(MPI_COMM_WORLD, 1);
+                }
+            }
+            MPI_Bcast(ids, n_blocks, MPI_INT, 0, MPI_COMM_WORLD);
+
+            if (rank == 0) {
+                snprintf(msg, sizeof(msg), "job %s: %d blocks to %s", name,
+                         n_blocks, job.output ? job.output : ".");
+                log_message("INFO", msg, true);
+            }
+            output_root = job.output;
+            run_blocks(ids, n_blocks,
+                       job.overwrite >= 0 ? job.overwrite != 0 : overwrite);
+            MPI_Barrier(MPI_COMM_WORLD);
+            output_root = NULL;
+        }
+
+        if (rank == 0) {
+            finish_job(spool, name, ok, n_blocks, MPI_Wtime() - t0,
+                       job.output);
+            snprintf(msg, sizeof(msg), "job %s %s in %.1f s", name,
+                     ok ? "done" : "failed", MPI_Wtime() - t0);
+            log_message("INFO", msg, true);
+        }
+        end_job(&job);
+        free(ids);
+        free(text);
+        ids = NULL;
+        text = NULL;
+        n_jobs++;
+    }
+
+    if (rank == 0) {
+        snprintf(msg, sizeof(msg), "daemon stopped after %d jobs", n_jobs);
+        log_message("INFO", msg, true);
+    }
+    keep_block_bboxes(NULL, NULL, 0);
+    return 0;
+}
@@ -0,0 +1,249 @@
+/* libgcn10 context api: open inputs once, then compute any subset
+ * of the 18 cn scenarios for arbitrary windows into caller buffers */
+
+#include <stdlib.h>
+#include <string.h>
+#include "compat.h"
+#include "gcn10.h"
+
+#ifndef PATH_MAX
+#define PATH_MAX 4096
+#endif
+
+struct gcn10_ctx {
+    GDALDatasetH esa;
+    GDALDatasetH hysogs;
+    int tables[GCN10_N_HCS * GCN10_N_ARCS][256][5];
+    struct gcn10_keys keys;
+    uint8_t luts[GCN10_N_SCENARIOS][256];
+};
+
+/* open esa and hysogs rasters and compile the default lookup tables
+ * found in lookup_dir into per-scenario luts */
+int gcn10_open(const char *esa_path, const char *hysogs_path,
+               const char *lookup_dir, gcn10_ctx **ctx)
+{
+    gcn10_ctx *c;
+    char path[PATH_MAX];
+    int hi, ai, ci, t, rc;
+
+    if (!esa_path || !hysogs_path || !lookup_dir || !ctx)
+        return GCN10_ERR_ARG;
+    *ctx = NULL;
+
+    c = calloc(1, sizeof(*c));
+    if (!c)
+        return GCN10_ERR_NOMEM;
+
+    for (hi = 0; hi < GCN10_N_HCS; hi++) {
+        for (ai = 0; ai < GCN10_N_ARCS; ai++) {
+            t = hi * GCN10_N_ARCS + ai;
+            rc = gcn10_lookup_path(lookup_dir, gcn10_hcs[hi], gcn10_arcs[ai],
+                                   path, sizeof(path));
+            if (rc == GCN10_OK)
+                rc = gcn10_load_lookup(path, c->tables[t], NULL);
+            if (rc != GCN10_OK) {
+                free(c);
+                return rc;
+            }
+        }
+    }
+    rc = gcn10_build_keys(c->tables, GCN10_N_HCS * GCN10_N_ARCS, &c->keys);
+    if (rc != GCN10_OK) {
+        free(c);
+        return rc;
+    }
+    for (ci = 0; ci < GCN10_N_CONDS; ci++) {
+        for (t = 0; t < GCN10_N_HCS * GCN10_N_ARCS; t++) {
+            gcn10_compile_lut(&c->keys, c->tables[t], ci == 0,
+                              c->luts[ci * GCN10_N_HCS * GCN10_N_ARCS + t]);
+        }
+    }
+
+    GDALAllRegister();
+    c->esa = GDALOpen(esa_path, GA_ReadOnly);
+    c->hysogs = GDALOpen(hysogs_path, GA_ReadOnly);
+    if (!c->esa || !c->hysogs) {
+        gcn10_close(c);
+        return GCN10_ERR_OPEN;
+    }
+
+    *ctx = c;
+    return GCN10_OK;
+}
+
+/* close datasets and free the context */
+void gcn10_close(gcn10_ctx *ctx)
+{
+    if (!ctx)
+        return;
+    if (ctx->esa)
+        GDALClose(ctx->esa);
+    if (ctx->hysogs)
+        GDALClose(ctx->hysogs);
+    free(ctx);
+}
+
+/* size and geotransform of the output grid for bbox at res
+ * (res <= 0 for the native esa grid) */
+int gcn10_window_size(gcn10_ctx *ctx, const double *bbox, double res,
+                      int *xsize, int *ysize, double *gt)
+{
+    int win[6], rc;
+
+    if (!ctx || !bbox || !xsize || !ysize || !gt)
+        return GCN10_ERR_ARG;
+    rc = gcn10_window(ctx->esa, bbox, res, win, gt);
+    if (rc != GCN10_OK)
+        return rc;
+    *xsize = win[4];
+    *ysize = win[5];
+    return GCN10_OK;
+}
+
+/* compute cn for bbox at res into bufs; bufs holds GCN10_N_SCENARIOS
+ * pointers indexed by GCN10_SCENARIO(), each either null (skipped)
+ * or xsize * ysize bytes as reported by gcn10_window_size() */
+int gcn10_compute(gcn10_ctx *ctx, const double *bbox, double res,
+                  uint8_t *const *bufs, int xsize, int ysize)
+{
+    uint8_t *esa, *soil, *keys;
+    int ex, ey, sx, sy, s, rc;
+    double gt[6], soil_gt[6];
+    size_t npix;
+
+    if (!ctx || !bbox || !bufs)
+        return GCN10_ERR_ARG;
+
+    /* coarser grids take the majority land cover of each cell */
+    rc = gcn10_read_window_alg(ctx->esa, bbox, res, GRIORA_Mode, &esa, &ex,
+                               &ey, gt);
+    if (rc != GCN10_OK)
+        return rc;
+    if (ex != xsize || ey != ysize) {
+        free(esa);
+        return GCN10_ERR_ARG;
+    }
+
+    npix = (size_t)ex * ey;
+    keys = malloc(npix);
+    if (!keys) {
+        free(esa);
+        return GCN10_ERR_NOMEM;
+    }
+
+    /* resample soil onto the esa grid, reusing the keys buffer,
+     * then classify in place: keys[i] depends only on pixel i. soil
+     * outside the hysogs extent stays nodata, as in
+     * gcn10_compute_grid() */
+    rc = gcn10_read_window(ctx->hysogs, bbox, 0, &soil, &sx, &sy, soil_gt);
+    if (rc == GCN10_OK) {
+        gcn10_resample_nearest(soil, sx, sy, soil_gt, keys, ex, ey, gt);
+        free(soil);
+    }
+    else if (rc == GCN10_ERR_BOUNDS) {
+        memset(keys, GCN10_NODATA, npix);
+    }
+    else {
+        free(esa);
+        free(keys);
+        return rc;
+    }
+    gcn10_classify(&ctx->keys, esa, keys, npix, keys);
+    free(esa);
+
+    for (s = 0; s < GCN10_N_SCENARIOS; s++) {
+        if (bufs[s])
+            gcn10_apply_lut(ctx->luts[s], keys, npix, bufs[s]);
+    }
+    free(keys);
+    return GCN10_OK;
+}
+
+/* compute cn on an explicit north-up output grid (gt, xsize x ysize),
+ * e.g. a fixed-size map tile; esa is sampled onto the grid, hysogs is
+ * read at native resolution and resampled as in gcn10_compute() */
+int gcn10_compute_grid(gcn10_ctx *ctx, const double *gt, int xsize,
+                       int ysize, uint8_t *const *bufs)
+{
+    uint8_t *esa, *soil, *keys;
+    double bbox[4], soil_gt[6];
+    int sx, sy, s, rc;
+    size_t npix;
+
+    if (!ctx || !gt || !bufs || xsize <= 0 || ysize <= 0)
+        return GCN10_ERR_ARG;
+
+    npix = (size_t)xsize * ysize;
+    esa = malloc(npix);
+    keys = malloc(npix);
+    if (!esa || !keys) {
+        free(esa);
+        free(keys);
+        return GCN10_ERR_NOMEM;
+    }
+    rc = gcn10_read_grid(ctx->esa, gt, xsize, ysize, GRIORA_Mode, esa);
+    if (rc != GCN10_OK) {
+        free(esa);
+        free(keys);
+        return rc;
+    }
+
+    /* soil outside the hysogs extent stays nodata */
+    bbox[0] = gt[0];
+    bbox[1] = gt[3] + ysize * gt[5];
+    bbox[2] = gt[0] + xsize * gt[1];
+    bbox[3] = gt[3];
+    rc = gcn10_read_window(ctx->hysogs, bbox, 0, &soil, &sx, &sy, soil_gt);
+    if (rc == GCN10_OK) {
+        gcn10_resample_nearest(soil, sx, sy, soil_gt, keys, xsize, ysize,
+                               gt);
+        free(soil);
+    }
+    else if (rc == GCN10_ERR_BOUNDS) {
+        memset(keys, GCN10_NODATA, npix);
+    }
+    else {
+        free(esa);
+        free(keys);
+        return rc;
+    }
+
+    gcn10_classify(&ctx->keys, esa, keys, npix, keys);
+    free(esa);
+    for (s = 0; s < GCN10_N_SCENARIOS; s++) {
+        if (bufs[s])
+            gcn10_apply_lut(ctx->luts[s], keys, npix, bufs[s]);
+    }
+    free(keys);
+    return GCN10_OK;
+}
+
+/* spatial reference wkt of the esa grid (owned by the context) */
+const char *gcn10_srs_wkt(gcn10_ctx *ctx)
+{
+    return ctx ? GDALGetProjectionRef(ctx->esa) : NULL;
+}
+
+/* human-readable message for a return code */
+const char *gcn10_strerror(int code)
+{
+    switch (code) {
+    case GCN10_OK:
+        return "success";
+    case GCN10_ERR_ARG:
+        return "invalid argument";
+    case GCN10_ERR_OPEN:
+        return "cannot open input";
+    case GCN10_ERR_BOUNDS:
+        return "window outside raster";
+    case GCN10_ERR_READ:
+        return "raster read failed";
+    case GCN10_ERR_LOOKUP:
+        return "invalid lookup table";
+    case GCN10_ERR_NOMEM:
+        return "out of memory";
+    default:
+        return "unknown error";
+    }
+}
@@ -0,0 +1,148 @@
+#ifndef GCN10_H
+#define GCN10_H
+
+/* libgcn10: curve number computation on arbitrary windows in memory.
+ *
+ * the library holds no global state and never aborts; every call
+ * reports failure through a GCN10_ERR_* return code. a context owns
+ * its open esa/hysogs datasets and compiled lookup tables, so separate
+ * contexts may be used concurrently from separate threads. */
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <gdal.h>
+
+/* return codes */
+#define GCN10_OK 0
+#define GCN10_ERR_ARG -1        /* invalid argument */
+#define GCN10_ERR_OPEN -2       /* cannot open dataset or file */
+#define GCN10_ERR_BOUNDS -3     /* window outside the raster */
+#define GCN10_ERR_READ -4       /* raster read failed */
+#define GCN10_ERR_LOOKUP -5     /* lookup table missing or invalid */
+#define GCN10_ERR_NOMEM -6      /* allocation failed */
+
+/* cn nodata value */
+#define GCN10_NODATA 255
+
+/* runoff (q, s, ia) nodata value, in mm */
+#define GCN10_RUNOFF_NODATA -9999.0f
+
+/* scenarios: drainage condition x hydrologic condition x arc;
+ * index = cond * 9 + hc * 3 + arc, e.g. undrained/f/iii = 14 */
+#define GCN10_N_CONDS 2
+#define GCN10_N_HCS 3
+#define GCN10_N_ARCS 3
+#define GCN10_N_SCENARIOS 18
+#define GCN10_SCENARIO(cond, hc, arc) ((cond) * 9 + (hc) * 3 + (arc))
+
+extern const char *const gcn10_conds[GCN10_N_CONDS];
+extern const char *const gcn10_hcs[GCN10_N_HCS];
+extern const char *const gcn10_arcs[GCN10_N_ARCS];
+
+/* land cover classes addressable by byte class keys (8 soil states each) */
+#define GCN10_KEY_MAX_LC 31
+
+/* class keys: key = lc_index * 8 + state - 1 with soil states 1-4 for
+ * hysogs groups a-d and 5-8 for dual classes 11-14; 255 is nodata */
+struct gcn10_keys {
+    int n_lc;
+    int lc[GCN10_KEY_MAX_LC];
+    int index[256];             /* land cover -> lc index, -1 if absent */
+};
+
+/* lookup tables and class keys */
+int gcn10_scenario_index(const char *cond, const char *hc, const char *arc);
+int gcn10_load_lookup(const char *path, int table[256][5], int *n_skipped);
+int gcn10_lookup_path(const char *dir, const char *hc, const char *arc,
+                      char *buf, size_t n);
+int gcn10_build_keys(int tables[][256][5], int n_tables,
+                     struct gcn10_keys *keys);
+int gcn10_load_lookup_sigma(const char *path, float sigma[256][5]);
+int gcn10_key_cell(const struct gcn10_keys *keys, int key, bool drained,
+                   int *lc, int *sg);
+void gcn10_compile_lut(const struct gcn10_keys *keys, int table[256][5],
+                       bool drained, uint8_t lut[256]);
+
+/* kernels; the adjust/calculate pair is the scalar reference path */
+void gcn10_adjust_hysogs(uint8_t *h, size_t npix, bool drained);
+void gcn10_calculate_cn(const uint8_t *esa, const uint8_t *hsg, size_t npix,
+                        int table[256][5], uint8_t *out);
+void gcn10_calculate_delta(const uint8_t *esa, const uint8_t *hsg,
+                           size_t npix, int table[256][5], uint8_t *out);
+void gcn10_classify(const struct gcn10_keys *keys, const uint8_t *esa,
+                    const uint8_t *hsg, size_t npix, uint8_t *out);
+void gcn10_apply_lut(const uint8_t lut[256], const uint8_t *keys,
+                     size_t npix, uint8_t *out);
+void gcn10_resample_nearest(const uint8_t *src, int sx, int sy,
+                            const double *src_gt, uint8_t *dst, int dx,
+                            int dy, const double *dst_gt);
+void gcn10_resample_nearest_float(const float *src, int sx, int sy,
+                                  const double *src_gt, float *dst, int dx,
+                                  int dy, const double *dst_gt);
+
+/* scs runoff from a compiled cn lut: s = 25400 / cn - 254 (mm),
+ * ia = lambda * s, q = (p - ia)^2 / (p - ia + s) for p > ia */
+void gcn10_compile_retention(const uint8_t lut[256], float s[256]);
+void gcn10_retention(const float s_lut[256], const uint8_t *keys,
+                     size_t npix, float lambda, float *s, float *ia);
+void gcn10_runoff(const float s_lut[256], const uint8_t *keys,
+                  const float *precip, size_t npix, float lambda, float *q);
+
+/* per-pixel arc from 5-day antecedent precipitation p5 (mm): arc i
+ * below lo, iii above hi, ii otherwise; luts holds the arc i, ii and
+ * iii luts of one drainage condition and hc */
+void gcn10_select_arc(const uint8_t luts[GCN10_N_ARCS][256],
+                      const uint8_t *keys, const float *p5, size_t npix,
+                      float lo, float hi, uint8_t *out);
+
+/* monte carlo statistics: real holds n realizations of a key -> cn
+ * table (n x 256, negative = no cn); per key mean, standard deviation
+ * and percentiles pct (0-100, n_pct x 256 in pcts) are computed, with
+ * GCN10_RUNOFF_NODATA where any realization has no cn */
+int gcn10_key_stats(const float *real, int n, const double *pct, int n_pct,
+                    float *mean, float *sd, float *pcts);
+void gcn10_apply_lut_float(const float lut[256], const uint8_t *keys,
+                           size_t npix, float *out);
+
+/* block aggregation of a cn grid to coarser cells of factor x factor
+ * pixels; phases offset the cell grid so that cells align with a
+ * global grid, i.e. cell i covers pixels i * factor - xphase onwards */
+#define GCN10_AGG_MAJORITY 0    /* most common cn by weight */
+#define GCN10_AGG_MEAN 1        /* weighted mean cn */
+#define GCN10_AGG_RUNOFF 2      /* cn of the weighted mean retention s */
+int gcn10_aggregate(const uint8_t *cn, int xsize, int ysize,
+                    const double *row_w, int factor, int xphase, int yphase,
+                    int method, uint8_t *out, int oxsize, int oysize);
+
+/* raster windows */
+int gcn10_window(GDALDatasetH ds, const double *bbox, double res, int *win,
+                 double *gt);
+int gcn10_read_window(GDALDatasetH ds, const double *bbox, double res,
+                      uint8_t **buf, int *xsize, int *ysize, double *gt);
+int gcn10_read_window_alg(GDALDatasetH ds, const double *bbox, double res,
+                          GDALRIOResampleAlg alg, uint8_t **buf, int *xsize,
+                          int *ysize, double *gt);
+int gcn10_read_window_into(GDALDatasetH ds, const int *win,
+                           GDALRIOResampleAlg alg, uint8_t *buf);
+int gcn10_read_window_float(GDALDatasetH ds, const double *bbox, double res,
+                            float **buf, int *xsize, int *ysize, double *gt);
+int gcn10_read_grid(GDALDatasetH ds, const double *gt, int xsize, int ysize,
+                    GDALRIOResampleAlg alg, uint8_t *buf);
+
+/* context api */
+typedef struct gcn10_ctx gcn10_ctx;
+
+int gcn10_open(const char *esa_path, const char *hysogs_path,
+               const char *lookup_dir, gcn10_ctx **ctx);
+void gcn10_close(gcn10_ctx *ctx);
+int gcn10_window_size(gcn10_ctx *ctx, const double *bbox, double res,
+                      int *xsize, int *ysize, double *gt);
+int gcn10_compute(gcn10_ctx *ctx, const double *bbox, double res,
+                  uint8_t *const *bufs, int xsize, int ysize);
+int gcn10_compute_grid(gcn10_ctx *ctx, const double *gt, int xsize,
+                       int ysize, uint8_t *const *bufs);
+const char *gcn10_srs_wkt(gcn10_ctx *ctx);
+const char *gcn10_strerror(int code);
+
+#endif /* GCN10_H */
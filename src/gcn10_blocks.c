@@ -0,0 +1,468 @@
+/* gcn10-blocks: writes a block layout for gcn10 whose block edges lie
+ * on the esa pixel grid, on esa source tile boundaries and, inside a
+ * tile, on the internal geotiff tiles, so block windows read whole
+ * tiles once and neighbouring blocks share no pixels. with --weighted,
+ * tiles are split by their share of valid (land and inland water)
+ * pixels so blocks carry about equal work, and empty ones are left out */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include "compat.h"
+#include "gcn10.h"
+#include <cpl_string.h>
+#include <ogr_api.h>
+#include <ogr_srs_api.h>
+
+/* a block as pixel rectangle x0..x1, y0..y1 of the esa grid */
+struct cell {
+    int x0, y0, x1, y1;
+    double land;                /* valid pixel fraction, -1 unmeasured */
+};
+
+/* options */
+static double block_deg = 3.0, tile_deg = 3.0, sample_deg = 0.05;
+static double aoi[4];
+static bool use_bbox = false, weighted = false;
+static int unit_x = 0, unit_y = 0;
+
+/* grid of the esa raster */
+static GDALDatasetH esa;
+static double gt[6];
+static int width, height;
+
+/* output blocks */
+static struct cell *cells = NULL;
+static int n_cells = 0, cap_cells = 0;
+
+/* sampled valid-pixel counts of the current start cell, as a summed
+ * area table over sxs x sys samples that each cover step pixels */
+static int *sat = NULL;
+static int sxs, sys, sx0, sy0;
+static double stepx, stepy;
+
+static void usage(FILE *fp)
+{
+    fprintf(fp,
+            "gcn10-blocks - grid-aligned block layout for gcn10\n"
+            "usage:\n"
+            "  gcn10-blocks [options] <esa.vrt> <blocks.shp|blocks.gpkg>\n"
+            "\n"
+            "options:\n"
+            "  --size <deg>		block edge (default 3)\n"
+            "  --tile <deg>		esa source tile edge (default 3)\n"
+            "  --bbox <minx,miny,maxx,maxy>	only blocks meeting this box\n"
+            "  --weighted		split tiles by valid pixel share, drop empty blocks\n"
+            "  --sample <deg>		sample spacing for --weighted (default 0.05)\n"
+            "  --unit <px>		snap unit inside tiles (default: source block size)\n"
+            "  --help, -h		show this help and exit\n");
+}
+
+static void add_cell(int x0, int y0, int x1, int y1, double land)
+{
+    struct cell *c;
+
+    if (x1 <= x0 || y1 <= y0)
+        return;
+    if (use_bbox &&
+        (gt[0] + x1 * gt[1] <= aoi[0] || gt[0] + x0 * gt[1] >= aoi[2] ||
+         gt[3] + y0 * gt[5] <= aoi[1] || gt[3] + y1 * gt[5] >= aoi[3]))
+        return;
+    if (n_cells == cap_cells) {
+        cap_cells = cap_cells ? 2 * cap_cells : 1024;
+        c = realloc(cells, cap_cells * sizeof(*c));
+        if (!c) {
+            fprintf(stderr, "malloc failed for blocks\n");
+            exit(EXIT_FAILURE);
+        }
+        cells = c;
+    }
+    c = &cells[n_cells++];
+    c->x0 = x0;
+    c->y0 = y0;
+    c->x1 = x1;
+    c->y1 = y1;
+    c->land = land;
+}
+
+/* edge j of k between pixel edges a and b, on a multiple of unit
+ * counted from origin */
+static int split_edge(int a, int b, int j, int k, int origin, int unit)
+{
+    long long e;
+
+    if (j <= 0)
+        return a;
+    if (j >= k)
+        return b;
+    e = origin + llround((a + (double)(b - a) * j / k - origin) / unit) *
+        unit;
+    return e < a ? a : e > b ? b : (int)e;
+}
+
+/* sample the valid pixels of pixel rectangle x0..x1, y0..y1 into sat */
+static bool sample_cell(int x0, int y0, int x1, int y1)
+{
+    double bbox[4], sgt[6], nd;
+    uint8_t *buf;
+    int i, j, has_nd, valid;
+
+    bbox[0] = gt[0] + x0 * gt[1];
+    bbox[2] = gt[0] + x1 * gt[1];
+    bbox[3] = gt[3] + y0 * gt[5];
+    bbox[1] = gt[3] + y1 * gt[5];
+    if (gcn10_read_window(esa, bbox, sample_deg, &buf, &sxs, &sys, sgt) !=
+        GCN10_OK)
+        return false;
+    nd = GDALGetRasterNoDataValue(GDALGetRasterBand(esa, 1), &has_nd);
+    valid = has_nd ? (int)nd : 0;
+
+    free(sat);
+    sat = calloc((size_t)(sxs + 1) * (sys + 1), sizeof(int));
+    if (!sat) {
+        fprintf(stderr, "malloc failed for samples\n");
+        exit(EXIT_FAILURE);
+    }
+    for (j = 0; j < sys; j++) {
+        for (i = 0; i < sxs; i++) {
+            sat[(j + 1) * (sxs + 1) + i + 1] =
+                (buf[(size_t)j * sxs + i] != valid) +
+                sat[j * (sxs + 1) + i + 1] + sat[(j + 1) * (sxs + 1) + i] -
+                sat[j * (sxs + 1) + i];
+        }
+    }
+    free(buf);
+    sx0 = x0;
+    sy0 = y0;
+    stepx = (double)(x1 - x0) / sxs;
+    stepy = (double)(y1 - y0) / sys;
+    return true;
+}
+
+/* valid fraction of the samples centred in x0..x1, y0..y1, or
+ * fallback when none are */
+static double cell_land(int x0, int y0, int x1, int y1, double fallback)
+{
+    int i0, i1, j0, j1, n;
+
+    i0 = (int)ceil((x0 - sx0) / stepx - 0.5);
+    i1 = (int)ceil((x1 - sx0) / stepx - 0.5);
+    j0 = (int)ceil((y0 - sy0) / stepy - 0.5);
+    j1 = (int)ceil((y1 - sy0) / stepy - 0.5);
+    i0 = i0 < 0 ? 0 : i0;
+    j0 = j0 < 0 ? 0 : j0;
+    i1 = i1 > sxs ? sxs : i1;
+    j1 = j1 > sys ? sys : j1;
+    if (i1 <= i0 || j1 <= j0)
+        return fallback;
+    n = sat[j1 * (sxs + 1) + i1] - sat[j0 * (sxs + 1) + i1] -
+        sat[j1 * (sxs + 1) + i0] + sat[j0 * (sxs + 1) + i0];
+    return (double)n / ((i1 - i0) * (j1 - j0));
+}
+
+/* split cell into k x k parts until each holds at most target valid
+ * pixels; ox, oy are the tile origin the unit snapping counts from */
+static void subdivide(int x0, int y0, int x1, int y1, double land,
+                      int ox, int oy, double target)
+{
+    int k, kx, ky, i, j, a0, a1, b0, b1;
+
+    if (land <= 0)
+        return;
+    k = (int)ceil(sqrt(land * (x1 - x0) * (double)(y1 - y0) / target));
+    kx = (x1 - x0) / unit_x < k ? (x1 - x0) / unit_x : k;
+    ky = (y1 - y0) / unit_y < k ? (y1 - y0) / unit_y : k;
+    if (kx < 2 && ky < 2) {
+        add_cell(x0, y0, x1, y1, land);
+        return;
+    }
+    kx = kx < 1 ? 1 : kx;
+    ky = ky < 1 ? 1 : ky;
+    for (j = 0; j < ky; j++) {
+        b0 = split_edge(y0, y1, j, ky, oy, unit_y);
+        b1 = split_edge(y0, y1, j + 1, ky, oy, unit_y);
+        for (i = 0; i < kx; i++) {
+            a0 = split_edge(x0, x1, i, kx, ox, unit_x);
+            a1 = split_edge(x0, x1, i + 1, kx, ox, unit_x);
+            if (a1 > a0 && b1 > b0)
+                subdivide(a0, b0, a1, b1, cell_land(a0, b0, a1, b1, land),
+                          ox, oy, target);
+        }
+    }
+}
+
+/* pixel edges of the start cells along one axis: groups of m tiles of
+ * tile_px pixels, the first tile edge inside the raster at o, global
+ * tile index g0 at o, the raster n pixels long; returns their count */
+static int start_edges(int o, int tile_px, int m, long long g0, int n,
+                       int **edges)
+{
+    int k0, k, count = 1, *e;
+
+    k0 = o > 0 ? -1 : 0;
+    while ((((g0 + k0) % m) + m) % m)
+        k0--;
+    for (k = k0; o + (long long)k * tile_px < n; k += m)
+        count++;
+    e = malloc(count * sizeof(int));
+    if (!e) {
+        fprintf(stderr, "malloc failed for tile edges\n");
+        exit(EXIT_FAILURE);
+    }
+    for (k = 0; k < count; k++)
+        e[k] = o + (k0 + k * m) * tile_px;
+    *edges = e;
+    return count;
+}
+
+static int cmp_cell(const void *a, const void *b)
+{
+    const struct cell *ca = a, *cb = b;
+
+    if (ca->y0 != cb->y0)
+        return (ca->y0 > cb->y0) - (ca->y0 < cb->y0);
+    return (ca->x0 > cb->x0) - (ca->x0 < cb->x0);
+}
+
+/* first source's internal block size as the snap unit, or 1 */
+static void source_units(void)
+{
+    GDALDatasetH src;
+    char **files;
+    int bx = 1, by = 1;
+
+    files = GDALGetFileList(esa);
+    if (files && CSLCount(files) > 1) {
+        src = GDALOpen(files[1], GA_ReadOnly);
+        if (src) {
+            GDALGetBlockSize(GDALGetRasterBand(src, 1), &bx, &by);
+            GDALClose(src);
+        }
+    }
+    CSLDestroy(files);
+    if (!unit_x)
+        unit_x = bx;
+    if (!unit_y)
+        unit_y = by;
+}
+
+static bool write_layer(const char *path)
+{
+    OGRSFDriverH drv;
+    OGRDataSourceH ds;
+    OGRLayerH layer;
+    OGRFieldDefnH fld;
+    OGRFeatureH feat;
+    OGRGeometryH poly, ring;
+    OGRSpatialReferenceH srs;
+    size_t len = strlen(path);
+    double x0, y0, x1, y1;
+    int i;
+
+    drv = OGRGetDriverByName(len > 5 && !strcmp(path + len - 5, ".gpkg") ?
+                             "GPKG" : "ESRI Shapefile");
+    if (!drv)
+        return false;
+    OGR_Dr_DeleteDataSource(drv, path);
+    ds = OGR_Dr_CreateDataSource(drv, path, NULL);
+    if (!ds)
+        return false;
+    srs = OSRNewSpatialReference(GDALGetProjectionRef(esa));
+    layer = OGR_DS_CreateLayer(ds, "blocks", srs, wkbPolygon, NULL);
+    OSRDestroySpatialReference(srs);
+    if (!layer) {
+        OGR_DS_Destroy(ds);
+        return false;
+    }
+    fld = OGR_Fld_Create("ID", OFTInteger);
+    OGR_L_CreateField(layer, fld, TRUE);
+    OGR_Fld_Destroy(fld);
+    if (weighted) {
+        fld = OGR_Fld_Create("LAND", OFTReal);
+        OGR_L_CreateField(layer, fld, TRUE);
+        OGR_Fld_Destroy(fld);
+    }
+
+    for (i = 0; i < n_cells; i++) {
+        x0 = gt[0] + cells[i].x0 * gt[1];
+        x1 = gt[0] + cells[i].x1 * gt[1];
+        y0 = gt[3] + cells[i].y0 * gt[5];
+        y1 = gt[3] + cells[i].y1 * gt[5];
+        ring = OGR_G_CreateGeometry(wkbLinearRing);
+        OGR_G_AddPoint_2D(ring, x0, y0);
+        OGR_G_AddPoint_2D(ring, x1, y0);
+        OGR_G_AddPoint_2D(ring, x1, y1);
+        OGR_G_AddPoint_2D(ring, x0, y1);
+        OGR_G_AddPoint_2D(ring, x0, y0);
+        poly = OGR_G_CreateGeometry(wkbPolygon);
+        OGR_G_AddGeometryDirectly(poly, ring);
+
+        feat = OGR_F_Create(OGR_L_GetLayerDefn(layer));
+        OGR_F_SetFieldInteger(feat, 0, i + 1);
+        if (weighted)
+            OGR_F_SetFieldDouble(feat, 1, cells[i].land);
+        OGR_F_SetGeometryDirectly(feat, poly);
+        if (OGR_L_CreateFeature(layer, feat) != OGRERR_NONE) {
+            OGR_F_Destroy(feat);
+            OGR_DS_Destroy(ds);
+            return false;
+        }
+        OGR_F_Destroy(feat);
+    }
+    OGR_DS_Destroy(ds);
+    return true;
+}
+
+int main(int argc, char **argv)
+{
+    const char *esa_path = NULL, *out_path = NULL;
+    int tile_px, tile_py, m, ox, oy, nx, ny, i, j, k, *xe, *ye;
+    int x0, y0, x1, y1, a0, a1, b0, b1, bi, bj;
+    double edge, target;
+    long long gx, gy;
+    int a;
+
+    for (a = 1; a < argc; a++) {
+        if (!strcmp(argv[a], "--help") || !strcmp(argv[a], "-h")) {
+            usage(stdout);
+            return EXIT_SUCCESS;
+        }
+        else if (!strcmp(argv[a], "--size") && a + 1 < argc) {
+            block_deg = atof(argv[++a]);
+        }
+        else if (!strcmp(argv[a], "--tile") && a + 1 < argc) {
+            tile_deg = atof(argv[++a]);
+        }
+        else if (!strcmp(argv[a], "--sample") && a + 1 < argc) {
+            sample_deg = atof(argv[++a]);
+        }
+        else if (!strcmp(argv[a], "--unit") && a + 1 < argc) {
+            unit_x = unit_y = atoi(argv[++a]);
+        }
+        else if (!strcmp(argv[a], "--weighted")) {
+            weighted = true;
+        }
+        else if (!strcmp(argv[a], "--bbox") && a + 1 < argc) {
+            if (sscanf(argv[++a], "%lf,%lf,%lf,%lf", &aoi[0], &aoi[1],
+                       &aoi[2], &aoi[3]) != 4 || aoi[2] <= aoi[0] ||
+                aoi[3] <= aoi[1]) {
+                fprintf(stderr, "invalid bbox '%s'\n", argv[a]);
+                return EXIT_FAILURE;
+            }
+            use_bbox = true;
+        }
+        else if (argv[a][0] == '-') {
+            fprintf(stderr, "unknown option '%s'\n", argv[a]);
+            usage(stderr);
+            return EXIT_FAILURE;
+        }
+        else if (!esa_path) {
+            esa_path = argv[a];
+        }
+        else if (!out_path) {
+            out_path = argv[a];
+        }
+    }
+    if (!esa_path || !out_path || block_deg <= 0 || tile_deg <= 0 ||
+        sample_deg <= 0 || unit_x < 0) {
+        usage(stderr);
+        return EXIT_FAILURE;
+    }
+
+    GDALAllRegister();
+    OGRRegisterAll();
+    esa = GDALOpen(esa_path, GA_ReadOnly);
+    if (!esa || GDALGetGeoTransform(esa, gt) != CE_None) {
+        fprintf(stderr, "cannot open %s\n", esa_path);
+        return EXIT_FAILURE;
+    }
+    width = GDALGetRasterXSize(esa);
+    height = GDALGetRasterYSize(esa);
+
+    /* source tiles must be whole pixels; blocks are whole tiles or
+     * whole fractions of one */
+    tile_px = (int)lround(tile_deg / gt[1]);
+    tile_py = (int)lround(tile_deg / -gt[5]);
+    if (fabs(tile_px * gt[1] - tile_deg) > 1e-6 * gt[1] ||
+        fabs(tile_py * -gt[5] - tile_deg) > 1e-6 * -gt[5]) {
+        fprintf(stderr, "tile size %g is not a whole number of pixels\n",
+                tile_deg);
+        return EXIT_FAILURE;
+    }
+    source_units();
+    m = block_deg > tile_deg ? (int)lround(block_deg / tile_deg) : 1;
+    k = block_deg < tile_deg ? (int)lround(tile_deg / block_deg) : 1;
+    target = (block_deg / gt[1]) * (block_deg / -gt[5]);
+
+    /* first tile edges inside the raster and their global indexes */
+    edge = ceil(gt[0] / tile_deg - 1e-9) * tile_deg;
+    ox = (int)lround((edge - gt[0]) / gt[1]);
+    gx = llround(edge / tile_deg);
+    edge = floor(gt[3] / tile_deg + 1e-9) * tile_deg;
+    oy = (int)lround((gt[3] - edge) / -gt[5]);
+    gy = -llround(edge / tile_deg);
+    nx = start_edges(ox, tile_px, m, gx, width, &xe);
+    ny = start_edges(oy, tile_py, m, gy, height, &ye);
+
+    for (j = 0; j + 1 < ny; j++) {
+        for (i = 0; i + 1 < nx; i++) {
+            /* start cell: the tile (group) clipped to the raster */
+            x0 = xe[i] < 0 ? 0 : xe[i];
+            x1 = xe[i + 1] > width ? width : xe[i + 1];
+            y0 = ye[j] < 0 ? 0 : ye[j];
+            y1 = ye[j + 1] > height ? height : ye[j + 1];
+            if (x1 <= x0 || y1 <= y0)
+                continue;
+            if (use_bbox &&
+                (gt[0] + x1 * gt[1] <= aoi[0] ||
+                 gt[0] + x0 * gt[1] >= aoi[2] ||
+                 gt[3] + y0 * gt[5] <= aoi[1] ||
+                 gt[3] + y1 * gt[5] >= aoi[3]))
+                continue;
+
+            if (weighted) {
+                if (!sample_cell(x0, y0, x1, y1)) {
+                    fprintf(stderr, "cannot sample %s\n", esa_path);
+                    return EXIT_FAILURE;
+                }
+                subdivide(x0, y0, x1, y1, cell_land(x0, y0, x1, y1, 0),
+                          xe[i], ye[j], target);
+                continue;
+            }
+
+            /* k x k blocks per tile, laid out on the whole tile so
+             * partial tiles at the raster edge keep the same edges */
+            for (bj = 0; bj < k; bj++) {
+                b0 = split_edge(ye[j], ye[j + 1], bj, k, ye[j], unit_y);
+                b1 = split_edge(ye[j], ye[j + 1], bj + 1, k, ye[j], unit_y);
+                b0 = b0 < y0 ? y0 : b0;
+                b1 = b1 > y1 ? y1 : b1;
+                for (bi = 0; bi < k; bi++) {
+                    a0 = split_edge(xe[i], xe[i + 1], bi, k, xe[i], unit_x);
+                    a1 = split_edge(xe[i], xe[i + 1], bi + 1, k, xe[i],
+                                    unit_x);
+                    a0 = a0 < x0 ? x0 : a0;
+                    a1 = a1 > x1 ? x1 : a1;
+                    add_cell(a0, b0, a1, b1, -1);
+                }
+            }
+        }
+    }
+    free(xe);
+    free(ye);
+    free(sat);
+
+    /* number blocks north to south, west to east */
+    qsort(cells, n_cells, sizeof(*cells), cmp_cell);
+
+    if (!write_layer(out_path)) {
+        fprintf(stderr, "cannot write %s\n", out_path);
+        return EXIT_FAILURE;
+    }
+    printf("wrote %d blocks to %s (tile %g deg, snap %d x %d px)\n",
+           n_cells, out_path, tile_deg, unit_x, unit_y);
+    free(cells);
+    GDALClose(esa);
+    return EXIT_SUCCESS;
+}
@@ -42,26 +42,302 @@ extern char *log_dir;
 /* mode flags */
 extern bool use_list_mode;
 extern char *block_ids_file;
+extern bool use_hilbert_order;
+extern bool use_dynamic_schedule;
+
+/* area of interest in place of blocks: vector path or bbox, cut into
+ * windows of at most aoi_tile_mb working memory each */
+extern bool use_aoi_mode;
+extern char *aoi_spec;
+extern int aoi_tile_mb;
+
+/* working memory budget per rank in mb (0 = none); larger blocks are
+ * processed in row bands */
+extern int max_memory_per_rank;
+
+/* read mosaic vrt windows from their sources directly, decoding on
+ * read_threads threads per source (0 = GDAL_NUM_THREADS) */
+extern bool vrt_direct;
+extern int read_threads;
+
+/* read the next window's inputs while the current one computes */
+extern bool prefetch_inputs;
+
+/* input reads may log or abort, so they run on threads of their own
+ * only when mpi provides MPI_THREAD_MULTIPLE */
+extern bool threaded_reads;
+
+/* ranks of a node work on one block together over shared memory */
+extern bool node_coop;
+
+/* root that output directories are made under (NULL = working
+ * directory); set per daemon job */
+extern char *output_root;
+
+/* parts of the pipeline a run exercises (--phase) */
+#define RUN_ALL 0               /* read, compute and write */
+#define RUN_READ 1              /* read inputs and discard them */
+#define RUN_COMPUTE 2           /* first inputs reused, no writes */
+#define RUN_NOWRITE 3           /* outputs encoded to /vsimem/ only */
+extern int run_phase;
+
+/* output modes */
+#define OUTPUT_FULL 0           /* 18 full cn rasters per block */
+#define OUTPUT_DELTA 1          /* undrained as delta over drained + vrt */
+#define OUTPUT_CLASS 2          /* class key raster + lut-backed vrts */
+extern int output_mode;
+
+/* tile server settings */
+extern int serve_cache_mb;
+extern double serve_max_pixels;
+
+/* scenario manifest: which of the 18 default scenarios to compute
+ * and extra (name, drainage condition, lookup csv) entries */
+#define SCENARIO_NAME_MAX 64
+struct scenario_spec {
+    char *name;
+    int cond;                   /* 0 drained, 1 undrained */
+    char *lookup;
+};
+extern bool use_default_scenario[];
+extern struct scenario_spec *scenario_specs;
+extern int n_scenario_specs;
+
+/* runoff stage: precipitation rasters (mm) in time order, ia ratio
+ * and which of q, s, ia to write; write_cn=false skips cn rasters */
+#define RUNOFF_Q 1
+#define RUNOFF_S 2
+#define RUNOFF_IA 4
+extern char **precip_paths;
+extern int n_precip;
+extern double runoff_lambda;
+extern int runoff_outputs;
+extern bool write_cn;
+
+/* daily cn: per-pixel arc from 5-day antecedent precipitation rasters
+ * (mm), each with a season whose thresholds split arc i/ii/iii */
+#define SEASON_DORMANT 0
+#define SEASON_GROWING 1
+struct antecedent_day {
+    char *path;
+    int season;                 /* -1 for the configured default */
+};
+extern struct antecedent_day *antecedent_days;
+extern int n_antecedent;
+extern int arc_season;
+extern double arc_thresholds[2][2];
+
+/* monte carlo cn uncertainty: mc_runs realizations, either perturbed
+ * lookup directories or normal draws of mc_sigma (or a per-cell sd
+ * column) around the tables, reduced to per-pixel statistics */
+#define MAX_MC_PERCENTILES 8
+extern int mc_runs;
+extern double mc_sigma;
+extern char **mc_lookup_dirs;
+extern int n_mc_lookup_dirs;
+extern double mc_percentiles[MAX_MC_PERCENTILES];
+extern int n_mc_percentiles;
+extern unsigned long mc_seed;
+
+/* zonal statistics: polygon layer, integer zone id field and the
+ * csv written by rank 0 */
+extern char *zones_path;
+extern char *zone_field;
+extern char *zones_csv_path;
+
+/* aggregated products: coarser levels in metres computed from the
+ * native cn per block, and the gcn10_aggregate method */
+#define MAX_AGG_LEVELS 8
+extern int agg_levels[MAX_AGG_LEVELS];
+extern int n_agg_levels;
+extern int agg_method;
+
+/* reduced-resolution direct mode; cell size in degrees, 0 = native */
+extern double target_res;
+
+/* output crs for cn rasters (null = input grid) and its cell size in
+ * crs units, 0 = the native pixel height */
+extern char *output_crs;
+extern double output_res;
+
+/* one source of a virtual raster: path relative to the vrt,
+ * source nodata (-1 for none) and optional gdal lut string */
+struct vrt_source {
+    const char *path;
+    int nodata;
+    const char *lut;
+};
+
+/* input sources tracked for tile locality */
+#define LOC_ESA 0
+#define LOC_HYSOGS 1
+#define LOC_SOURCES 2
+
+/* esa worldcover source tiles are 3x3 degree cogs from (-180, 90) */
+#define ESA_TILE_DEG 3.0
 
 /* function prototypes */
 void parse_config(const char *);
 void free_config(void);
+
+/* daemon jobs: blocks, scenario set and output root of one request */
+struct job {
+    char *blocks;               /* block list file, or ids with commas */
+    char *output;               /* output root, NULL = working directory */
+    int overwrite;              /* -1 = as on the command line */
+};
+bool parse_job(char *, struct job *);
+void end_job(struct job *);
+int run_daemon(const char *, bool);
+void run_blocks(int *, int, bool);
 void init_logging(int);
 void log_message(const char *, const char *, bool);
 void finalize_logging(void);
 int *read_block_list(const char *, int *);
 int *get_all_blocks(int *);
-uint8_t *load_raster(const char *, const double *, int *, int *, double *,
-                     OGRSpatialReferenceH *);
+double *get_block_bboxes(const int *, int);
+void keep_block_bboxes(const int *, const double *, int);
+bool kept_block_bbox(int, double *);
+uint8_t *load_raster(const char *, const double *, double, int, int *,
+                     int *, double *, OGRSpatialReferenceH *);
+float *load_raster_float(const char *, const double *, int *, int *,
+                         double *);
 void save_raster(const uint8_t *, int, int, const double *,
                  OGRSpatialReferenceH, const char *);
-void process_block(int, bool, int);
+void save_raster_float(const float *, int, int, const double *,
+                       OGRSpatialReferenceH, const char *);
+void save_raster_rows(const uint8_t *, int, int, const double *,
+                      OGRSpatialReferenceH, const char *, int, int);
+void register_drivers(void);
+void set_output_band(int, int);
+int output_band(int *);
+void set_output_parts(bool);
+void note_output_path(const char *, const char *);
+void merge_band_parts(int, int);
+void write_vrt(const char *, int, int, const double *, OGRSpatialReferenceH,
+               const struct vrt_source *, int);
+GByte *encode_geotiff(const uint8_t *, int, int, const double *,
+                      OGRSpatialReferenceH, size_t *);
+double geodesic_pixel_area(const double *, int);
+bool warp_to_output(uint8_t **, const int *, const uint8_t *, int, int *,
+                    int *, double *, OGRSpatialReferenceH *);
+int serve(const char *);
+void process_block(int, int, int, bool, int);
+void write_class_legend(void);
+void reset_scenarios(void);
+bool prepare_scenarios(void);
+int scenario_count(void);
+const char *scenario_name(int, int *);
+void get_scenario_lut(int, uint8_t *);
+int scenario_table(int, int[256][5]);
+struct gcn10_keys;
+void get_class_keys(struct gcn10_keys *);
+void zones_accumulate(const double *, const uint8_t *, int, int,
+                      const double *, OGRSpatialReferenceH);
+void zones_finalize(int, int);
 void report_block_completion(int, int);
 
+/* area-of-interest windows */
+int *aoi_tiles(const char *, int *);
+bool aoi_tile_bbox(int, double *);
+double *aoi_tile_bboxes(const int *, int);
+void aoi_mask(int, const double *, int, int, uint8_t *);
+
+/* per-rank buffer arena: one reusable buffer per slot */
+enum arena_slot {
+    ARENA_ESA,
+    ARENA_SOIL_COARSE,
+    ARENA_ESA_NEXT,
+    ARENA_SOIL_COARSE_NEXT,
+    ARENA_SOIL,
+    ARENA_KEYS,
+    ARENA_CN,
+    ARENA_WARP_ESA,
+    ARENA_WARP_SOIL,
+    ARENA_WARP_KEYS,
+    ARENA_FLOAT,
+    ARENA_RAIN,
+    ARENA_ROW_W,
+    ARENA_AGG,
+    ARENA_SLOTS
+};
+void *arena_get(int, size_t);
+void arena_release(void);
+void arena_report(int);
+
+/* block inputs, read in parallel and ahead of use */
+struct block_inputs {
+    uint8_t *esa, *soil;
+    int xsize, ysize, soil_xsize, soil_ysize;
+    double gt[6], soil_gt[6];
+    OGRSpatialReferenceH srs;
+};
+void inputs_prefetch(const double *);
+void inputs_load(const double *, struct block_inputs *);
+void inputs_release(void);
+void set_next_block(int, int, int);
+void plans_release(void);
+
+/* node-cooperative processing; grids of one window on the esa grid,
+ * soil resampled onto it */
+struct block_grids {
+    uint8_t *esa, *soil, *keys;
+    int xsize, ysize;
+    double gt[6];
+    OGRSpatialReferenceH srs;
+};
+void node_init(int *, int *);
+bool node_reader(void);
+bool node_owns(int);
+void node_check_tables(int);
+bool node_next_item(int *);
+bool node_share(bool, struct block_grids *);
+void node_release(void);
+
+/* per-phase metrics */
+enum phase_metric {
+    PH_READ,                    /* input reads, on their threads */
+    PH_READ_WAIT,               /* windows waiting for their inputs */
+    PH_WRITE,                   /* output encoding and writes */
+    PH_COMPUTE,                 /* derived: window - read wait - write */
+    PH_WINDOW,                  /* windows as a whole */
+    PH_COUNT
+};
+void phase_add(int, double, double);
+void phase_report(int);
+
+/* golden-output checks of the cn kernels */
+int selftest(const int *, int);
+int verify_outputs(const char *, const int *, int);
+
+/* direct reads of mosaic vrt sources */
+bool vrt_read_direct(const char *, const int *, uint8_t *);
+void vrt_direct_release(void);
+
+/* block scheduling */
+void order_blocks_hilbert(int *, double *, int);
+int sched_count_for_rank(int, int, int);
+int sched_block_index(int, int, int, int);
+
+/* dynamic schedule: a block, or one row part of a split tail block */
+struct work_item {
+    int block;
+    int part;
+    int n_parts;
+};
+struct work_item *sched_build_items(const double *, int, int, int *, int *);
+void sched_dynamic_init(int, int, int);
+bool sched_next(int *);
+bool sched_next_body(int *);
+void sched_dynamic_finalize(void);
+void locality_note(int, const double *, double, double, double);
+void locality_report(int);
+
 /* additional for async logging */
 /* async progress api: rank 0 works + polls; workers fire-and-forget sends */
 void progress_init(int rank, int size, int n_blocks);
 void progress_poll(int rank, int n_blocks);
+void progress_expect(int n_blocks);
 void progress_finalize(int rank);
 
 /* workers call this from cn.c; rank 0 logs locally (no self-send) */
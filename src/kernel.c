@@ -0,0 +1,425 @@
+/* per-pixel kernels: soil adjustment, cn lookup, class keys, scs
+ * runoff and nearest-neighbour resampling of the soil and rain grids */
+
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include "compat.h"
+#include "gcn10.h"
+
+/* adjust hysogs data based on drainage condition */
+void gcn10_adjust_hysogs(uint8_t *h, size_t npix, bool drained)
+{
+    size_t i;
+
+    if (drained) {
+        for (i = 0; i < npix; i++) {
+            if (h[i] >= 11 && h[i] <= 14) {
+                h[i] = 4;
+            }
+        }
+    }
+    else {
+        for (i = 0; i < npix; i++) {
+            if (h[i] == 11)
+                h[i] = 1;
+            else if (h[i] == 12)
+                h[i] = 2;
+            else if (h[i] == 13)
+                h[i] = 3;
+            else if (h[i] == 14)
+                h[i] = 4;
+        }
+    }
+}
+
+/* generate cn raster using lookup table; pixels without a cn keep
+ * the value already in out */
+void
+gcn10_calculate_cn(const uint8_t *esa, const uint8_t *hsg, size_t npix,
+                   int table[256][5], uint8_t *out)
+{
+    size_t i;
+    int land_cover, soil_group, cn_value;
+
+    for (i = 0; i < npix; i++) {
+        land_cover = esa[i];
+        soil_group = hsg[i];
+        if (soil_group < 5) {
+            cn_value = table[land_cover][soil_group];
+            if (cn_value < GCN10_NODATA) {
+                out[i] = (uint8_t) cn_value;
+            }
+        }
+    }
+}
+
+/* generate undrained cn as a delta over drained: the undrained value
+ * where a dual hysogs class (11-14) changes the cn, 0 (no override)
+ * elsewhere; drained maps dual classes to group d, undrained to a-d */
+void
+gcn10_calculate_delta(const uint8_t *esa, const uint8_t *hsg, size_t npix,
+                      int table[256][5], uint8_t *out)
+{
+    size_t i;
+    int land_cover, drained, undrained;
+
+    for (i = 0; i < npix; i++) {
+        out[i] = 0;
+        if (hsg[i] < 11 || hsg[i] > 14)
+            continue;
+        land_cover = esa[i];
+        drained = table[land_cover][4];
+        undrained = table[land_cover][hsg[i] - 10];
+        if (drained > GCN10_NODATA)
+            drained = GCN10_NODATA;
+        if (undrained > GCN10_NODATA)
+            undrained = GCN10_NODATA;
+        if (undrained != drained)
+            out[i] = (uint8_t) undrained;
+    }
+}
+
+/* encode land cover and raw hysogs into class keys */
+void
+gcn10_classify(const struct gcn10_keys *keys, const uint8_t *esa,
+               const uint8_t *hsg, size_t npix, uint8_t *out)
+{
+    uint8_t state[256], lcbase[256];
+    size_t i;
+    int v;
+
+    /* hysogs value -> soil state (0 = no valid group) */
+    for (v = 0; v < 256; v++) {
+        state[v] = (uint8_t) (v >= 1 && v <= 4 ? v :
+                              v >= 11 && v <= 14 ? v - 6 : 0);
+        lcbase[v] = (uint8_t) (keys->index[v] < 0 ? 255 :
+                               keys->index[v] * 8);
+    }
+
+    for (i = 0; i < npix; i++) {
+        uint8_t s = state[hsg[i]], b = lcbase[esa[i]];
+
+        out[i] = (b == 255 || !s) ? 255 : (uint8_t) (b + s - 1);
+    }
+}
+
+/* map class keys to cn through a compiled scenario lut */
+void gcn10_apply_lut(const uint8_t lut[256], const uint8_t *keys,
+                     size_t npix, uint8_t *out)
+{
+    size_t i;
+
+    for (i = 0; i < npix; i++)
+        out[i] = lut[keys[i]];
+}
+
+/* map class keys through a float lut */
+void gcn10_apply_lut_float(const float lut[256], const uint8_t *keys,
+                           size_t npix, float *out)
+{
+    size_t i;
+
+    for (i = 0; i < npix; i++)
+        out[i] = lut[keys[i]];
+}
+
+static int cmp_float(const void *a, const void *b)
+{
+    float fa = *(const float *)a, fb = *(const float *)b;
+
+    return (fa > fb) - (fa < fb);
+}
+
+/* per-key realization statistics; percentiles interpolate linearly
+ * between order statistics */
+int
+gcn10_key_stats(const float *real, int n, const double *pct, int n_pct,
+                float *mean, float *sd, float *pcts)
+{
+    float *v;
+    double sum, sq, m, h;
+    int key, r, p, lo, valid;
+
+    if (n < 1)
+        return GCN10_ERR_ARG;
+    v = malloc((size_t)n * sizeof(float));
+    if (!v)
+        return GCN10_ERR_NOMEM;
+
+    for (key = 0; key < 256; key++) {
+        valid = 1;
+        sum = 0;
+        for (r = 0; r < n; r++) {
+            v[r] = real[(size_t)r * 256 + key];
+            valid &= v[r] >= 0;
+            sum += v[r];
+        }
+        if (!valid) {
+            mean[key] = sd[key] = GCN10_RUNOFF_NODATA;
+            for (p = 0; p < n_pct; p++)
+                pcts[p * 256 + key] = GCN10_RUNOFF_NODATA;
+            continue;
+        }
+
+        m = sum / n;
+        sq = 0;
+        for (r = 0; r < n; r++)
+            sq += (v[r] - m) * (v[r] - m);
+        mean[key] = (float)m;
+        sd[key] = (float)(n > 1 ? sqrt(sq / (n - 1)) : 0.0);
+
+        qsort(v, n, sizeof(float), cmp_float);
+        for (p = 0; p < n_pct; p++) {
+            h = pct[p] / 100.0 * (n - 1);
+            lo = (int)floor(h);
+            lo = lo < 0 ? 0 : (lo > n - 1 ? n - 1 : lo);
+            pcts[p * 256 + key] = lo + 1 < n ?
+                (float)(v[lo] + (h - lo) * (v[lo + 1] - v[lo])) : v[lo];
+        }
+    }
+    free(v);
+    return GCN10_OK;
+}
+
+/* nearest source column of a destination pixel centre x,
+ * clamped to [0, n) */
+static int nearest_index(double c, double origin, double res, int n)
+{
+    int i = (int)round((c - origin) / res);
+
+    return i < 0 ? 0 : (i >= n ? n - 1 : i);
+}
+
+/* nearest-neighbour resample of src (sx x sy, src_gt) onto the
+ * dst grid (dx x dy, dst_gt) by pixel centres, clamped at edges */
+void
+gcn10_resample_nearest(const uint8_t *src, int sx, int sy,
+                       const double *src_gt, uint8_t *dst, int dx, int dy,
+                       const double *dst_gt)
+{
+    int x, y, cj, *cols;
+
+    /* column indices are the same for every row; without scratch
+     * memory they are recomputed per pixel */
+    cols = malloc((size_t)dx * sizeof(int));
+    for (x = 0; cols && x < dx; x++) {
+        cols[x] = nearest_index(dst_gt[0] + (x + 0.5) * dst_gt[1],
+                                src_gt[0], src_gt[1], sx);
+    }
+
+    for (y = 0; y < dy; y++) {
+        double py = dst_gt[3] + (y + 0.5) * dst_gt[5];
+        const uint8_t *srow;
+        uint8_t *drow = dst + (size_t)y * dx;
+
+        cj = (int)round((src_gt[3] - py) / fabs(src_gt[5]));
+        cj = cj < 0 ? 0 : (cj >= sy ? sy - 1 : cj);
+        srow = src + (size_t)cj * sx;
+        if (cols) {
+            for (x = 0; x < dx; x++)
+                drow[x] = srow[cols[x]];
+            continue;
+        }
+        for (x = 0; x < dx; x++) {
+            drow[x] = srow[nearest_index(dst_gt[0] + (x + 0.5) * dst_gt[1],
+                                         src_gt[0], src_gt[1], sx)];
+        }
+    }
+    free(cols);
+}
+
+/* float32 variant of gcn10_resample_nearest */
+void
+gcn10_resample_nearest_float(const float *src, int sx, int sy,
+                             const double *src_gt, float *dst, int dx,
+                             int dy, const double *dst_gt)
+{
+    int x, y, cj, *cols;
+
+    cols = malloc((size_t)dx * sizeof(int));
+    for (x = 0; cols && x < dx; x++) {
+        cols[x] = nearest_index(dst_gt[0] + (x + 0.5) * dst_gt[1],
+                                src_gt[0], src_gt[1], sx);
+    }
+
+    for (y = 0; y < dy; y++) {
+        double py = dst_gt[3] + (y + 0.5) * dst_gt[5];
+        const float *srow;
+        float *drow = dst + (size_t)y * dx;
+
+        cj = (int)round((src_gt[3] - py) / fabs(src_gt[5]));
+        cj = cj < 0 ? 0 : (cj >= sy ? sy - 1 : cj);
+        srow = src + (size_t)cj * sx;
+        if (cols) {
+            for (x = 0; x < dx; x++)
+                drow[x] = srow[cols[x]];
+            continue;
+        }
+        for (x = 0; x < dx; x++) {
+            drow[x] = srow[nearest_index(dst_gt[0] + (x + 0.5) * dst_gt[1],
+                                         src_gt[0], src_gt[1], sx)];
+        }
+    }
+    free(cols);
+}
+
+/* potential maximum retention s (mm) per class key; keys without a
+ * valid cn (1-100) get -1 */
+void gcn10_compile_retention(const uint8_t lut[256], float s[256])
+{
+    int key;
+
+    for (key = 0; key < 256; key++) {
+        s[key] = lut[key] >= 1 && lut[key] <= 100 ?
+            (float)(25400.0 / lut[key] - 254.0) : -1.0f;
+    }
+}
+
+/* retention s and initial abstraction ia = lambda * s per pixel;
+ * either output may be null */
+void
+gcn10_retention(const float s_lut[256], const uint8_t *keys, size_t npix,
+                float lambda, float *s, float *ia)
+{
+    size_t i;
+
+    for (i = 0; i < npix; i++) {
+        float sv = s_lut[keys[i]];
+
+        if (s)
+            s[i] = sv < 0 ? GCN10_RUNOFF_NODATA : sv;
+        if (ia)
+            ia[i] = sv < 0 ? GCN10_RUNOFF_NODATA : lambda * sv;
+    }
+}
+
+/* direct runoff depth q (mm) for precipitation p (mm); branch-free
+ * selects so the loop vectorizes. pixels without a cn or with
+ * missing (nan) or negative precipitation are nodata */
+void
+gcn10_runoff(const float s_lut[256], const uint8_t *keys,
+             const float *precip, size_t npix, float lambda, float *q)
+{
+    size_t i;
+
+    for (i = 0; i < npix; i++) {
+        float sv = s_lut[keys[i]], p = precip[i];
+        float pe = p - lambda * sv;
+        float qv = pe > 0.0f ? pe * pe / (pe + sv) : 0.0f;
+
+        q[i] = (sv < 0.0f || !(p >= 0.0f)) ? GCN10_RUNOFF_NODATA : qv;
+    }
+}
+
+/* daily cn with the arc picked per pixel from antecedent rainfall;
+ * missing (nan) or negative p5 is nodata */
+void
+gcn10_select_arc(const uint8_t luts[GCN10_N_ARCS][256],
+                 const uint8_t *keys, const float *p5, size_t npix,
+                 float lo, float hi, uint8_t *out)
+{
+    size_t i;
+
+    for (i = 0; i < npix; i++) {
+        float p = p5[i];
+        int arc = (p >= lo) + (p > hi);
+
+        out[i] = p >= 0.0f ? luts[arc][keys[i]] : GCN10_NODATA;
+    }
+}
+
+/* aggregate cn (xsize x ysize) into out (oxsize x oysize cells); row_w
+ * weights each source row, e.g. by pixel area (null for equal weights).
+ * cells without a valid cn (0-100; 1-100 for runoff) are nodata */
+int
+gcn10_aggregate(const uint8_t *cn, int xsize, int ysize, const double *row_w,
+                int factor, int xphase, int yphase, int method, uint8_t *out,
+                int oxsize, int oysize)
+{
+    double *acc, *wsum, w, best, sbar;
+    int i, j, x, y, y0, y1, v, nbins, arg;
+    float s_of[256];
+
+    if (factor < 1 || xphase < 0 || yphase < 0 || xphase >= factor ||
+        yphase >= factor || method < GCN10_AGG_MAJORITY ||
+        method > GCN10_AGG_RUNOFF)
+        return GCN10_ERR_ARG;
+
+    /* majority keeps a weight per cn value and cell, the means
+     * a weighted sum per cell */
+    nbins = method == GCN10_AGG_MAJORITY ? 101 : 1;
+    acc = malloc((size_t)oxsize * nbins * sizeof(double));
+    wsum = malloc((size_t)oxsize * sizeof(double));
+    if (!acc || !wsum) {
+        free(acc);
+        free(wsum);
+        return GCN10_ERR_NOMEM;
+    }
+    for (v = 0; v < 256; v++) {
+        s_of[v] = v >= 1 && v <= 100 ? (float)(25400.0 / v - 254.0) : -1.0f;
+    }
+
+    for (j = 0; j < oysize; j++) {
+        memset(acc, 0, (size_t)oxsize * nbins * sizeof(double));
+        memset(wsum, 0, (size_t)oxsize * sizeof(double));
+        y0 = j * factor - yphase;
+        y1 = y0 + factor;
+        y0 = y0 < 0 ? 0 : y0;
+        y1 = y1 > ysize ? ysize : y1;
+
+        for (y = y0; y < y1; y++) {
+            const uint8_t *row = cn + (size_t)y * xsize;
+
+            w = row_w ? row_w[y] : 1.0;
+            for (x = 0; x < xsize; x++) {
+                v = row[x];
+                i = (x + xphase) / factor;
+                if (method == GCN10_AGG_MAJORITY) {
+                    if (v <= 100)
+                        acc[(size_t)i * 101 + v] += w;
+                }
+                else if (method == GCN10_AGG_MEAN) {
+                    if (v <= 100) {
+                        acc[i] += w * v;
+                        wsum[i] += w;
+                    }
+                }
+                else if (s_of[v] >= 0) {
+                    acc[i] += w * s_of[v];
+                    wsum[i] += w;
+                }
+            }
+        }
+
+        for (i = 0; i < oxsize; i++) {
+            uint8_t *o = out + (size_t)j * oxsize + i;
+
+            if (method == GCN10_AGG_MAJORITY) {
+                best = 0;
+                arg = GCN10_NODATA;
+                for (v = 0; v <= 100; v++) {
+                    if (acc[(size_t)i * 101 + v] > best) {
+                        best = acc[(size_t)i * 101 + v];
+                        arg = v;
+                    }
+                }
+                *o = (uint8_t) arg;
+            }
+            else if (wsum[i] <= 0) {
+                *o = GCN10_NODATA;
+            }
+            else if (method == GCN10_AGG_MEAN) {
+                *o = (uint8_t) lround(acc[i] / wsum[i]);
+            }
+            else {
+                sbar = acc[i] / wsum[i];
+                *o = (uint8_t) lround(25400.0 / (sbar + 254.0));
+            }
+        }
+    }
+
+    free(acc);
+    free(wsum);
+    return GCN10_OK;
+}
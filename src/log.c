@@ -19,29 +19,16 @@ static int prog_expected = 0;   /* number of worker completion messages expected
 static int prog_done = 0;       /* number of worker completion messages received so far */
 static MPI_Request prog_recv_req = MPI_REQUEST_NULL;
 static int prog_recv_buf = -1;
+static int prog_own = 0;        /* blocks rank 0 reported itself */
+static int prog_own_last = -1;  /* last block rank 0 reported */
 static const int PROG_TAG = 100;        /* tag used for progress messages */
 
 /* small helpers */
 static void prog_post_recv(void);
-static int count_rr_for_rank(int r, int size, int n);
 static void ensure_log_open(void);
 static void ensure_log_dir(void);
 static void now_iso8601(char *buf, size_t n);
 
-/* count how many blocks are assigned to a rank
- * under round robin assignment; formula counts
- * i in [0, n-1] such that i % size == r */
-static int count_rr_for_rank(int r, int size, int n)
-{
-    if (n <= 0)
-        return 0;
-    if (r >= n)
-        return 0;
-    int last = n - 1;
-
-    return 1 + (last - r) / size;
-}
-
 /* create log directory if it does not exist */
 static void ensure_log_dir(void)
 {
@@ -128,13 +115,18 @@ static void prog_post_recv(void)
 
 /* initialize nonblocking progress tracking before
  * processing starts; rank 0 does not self-send;
- * expected messages are from workers only */
+ * expected messages are from workers only. under
+ * the dynamic schedule rank 0's share is unknown
+ * until the end, see progress_expect() */
 void progress_init(int rank, int size, int n_blocks)
 {
-    int local0 = count_rr_for_rank(0, size, n_blocks);
+    int local0 = use_dynamic_schedule ? 0 :
+        sched_count_for_rank(0, size, n_blocks);
 
     prog_expected = n_blocks - local0;
     prog_done = 0;
+    prog_own = 0;
+    prog_own_last = -1;
     prog_recv_req = MPI_REQUEST_NULL;
     prog_recv_buf = -1;
 
@@ -216,6 +208,10 @@ void report_block_completion(int block_id, int total_blocks)
     MPI_Comm_rank(MPI_COMM_WORLD, &rank);
 
     if (rank == 0) {
+        if (block_id != prog_own_last) {
+            prog_own_last = block_id;
+            prog_own++;
+        }
         report_block_completion_local(block_id, total_blocks);
         return;
     }
@@ -226,6 +222,13 @@ void report_block_completion(int block_id, int total_blocks)
     MPI_Request_free(&sreq);
 }
 
+/* once the dynamic schedule is done, rank 0 waits
+ * for the blocks it did not report itself */
+void progress_expect(int n_blocks)
+{
+    prog_expected = n_blocks - prog_own;
+}
+
 /* after finishing local work, rank 0 drains
  * remaining worker messages by polling
  this avoids any blocking receives while
@@ -0,0 +1,199 @@
+/* lookup tables: csv parsing, class keys and compiled per-scenario luts */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include "compat.h"
+#include "gcn10.h"
+
+const char *const gcn10_conds[GCN10_N_CONDS] = { "drained", "undrained" };
+const char *const gcn10_hcs[GCN10_N_HCS] = { "p", "f", "g" };
+const char *const gcn10_arcs[GCN10_N_ARCS] = { "i", "ii", "iii" };
+
+/* scenario index for condition, hc and arc names; -1 if unknown */
+int gcn10_scenario_index(const char *cond, const char *hc, const char *arc)
+{
+    int c, h, a;
+
+    for (c = 0; c < GCN10_N_CONDS; c++) {
+        for (h = 0; h < GCN10_N_HCS; h++) {
+            for (a = 0; a < GCN10_N_ARCS; a++) {
+                if (!strcmp(cond, gcn10_conds[c]) &&
+                    !strcmp(hc, gcn10_hcs[h]) && !strcmp(arc, gcn10_arcs[a]))
+                    return GCN10_SCENARIO(c, h, a);
+            }
+        }
+    }
+    return -1;
+}
+
+/* format dir/default_lookup_{hc}_{arc}.csv into buf */
+int gcn10_lookup_path(const char *dir, const char *hc, const char *arc,
+                      char *buf, size_t n)
+{
+    int len;
+
+    len = snprintf(buf, n, "%s/default_lookup_%s_%s.csv", dir, hc, arc);
+    if (len < 0 || (size_t)len >= n)
+        return GCN10_ERR_ARG;
+    return GCN10_OK;
+}
+
+/* load lookup table from csv file; rows that cannot be parsed
+ * are skipped and counted in n_skipped (may be null) */
+int gcn10_load_lookup(const char *path, int table[256][5], int *n_skipped)
+{
+    FILE *f;
+    char line[128];
+    char *tok, *grid_code, *us;
+    int i, j, lc, sg, cnv, skipped;
+
+    f = fopen(path, "r");
+    if (!f)
+        return GCN10_ERR_OPEN;
+
+    /* initialize table with nodata value (255) */
+    for (i = 0; i < 256; i++) {
+        for (j = 0; j < 5; j++) {
+            table[i][j] = GCN10_NODATA;
+        }
+    }
+
+    /* skip header line */
+    if (!fgets(line, sizeof(line), f)) {
+        fclose(f);
+        return GCN10_ERR_LOOKUP;
+    }
+
+    /* parse csv rows */
+    skipped = 0;
+    while (fgets(line, sizeof(line), f)) {
+        tok = strtok(line, ",");
+        if (!tok) {
+            continue;
+        }
+        grid_code = tok;
+        us = strchr(grid_code, '_');
+        if (!us) {
+            skipped++;
+            continue;
+        }
+        *us = '\0';
+        lc = atoi(grid_code);
+        sg = (us[1] == 'A' ? 1 : us[1] == 'B' ? 2 : us[1] == 'C' ? 3 : 4);
+        tok = strtok(NULL, ",");
+        if (!tok) {
+            skipped++;
+            continue;
+        }
+        cnv = atoi(tok);
+        if (lc >= 0 && lc < 256 && sg >= 0 && sg < 5) {
+            table[lc][sg] = cnv;
+        }
+        else {
+            skipped++;
+        }
+    }
+    fclose(f);
+
+    if (n_skipped)
+        *n_skipped = skipped;
+    return GCN10_OK;
+}
+
+/* load the optional third column (cn standard deviation) of a lookup
+ * csv; cells without one are set to -1 */
+int gcn10_load_lookup_sigma(const char *path, float sigma[256][5])
+{
+    FILE *f;
+    char line[128];
+    char *tok, *us;
+    int i, j, lc, sg;
+
+    f = fopen(path, "r");
+    if (!f)
+        return GCN10_ERR_OPEN;
+    for (i = 0; i < 256; i++) {
+        for (j = 0; j < 5; j++) {
+            sigma[i][j] = -1.0f;
+        }
+    }
+    if (!fgets(line, sizeof(line), f)) {
+        fclose(f);
+        return GCN10_ERR_LOOKUP;
+    }
+
+    while (fgets(line, sizeof(line), f)) {
+        tok = strtok(line, ",");
+        if (!tok || !(us = strchr(tok, '_')))
+            continue;
+        *us = '\0';
+        lc = atoi(tok);
+        sg = (us[1] == 'A' ? 1 : us[1] == 'B' ? 2 : us[1] == 'C' ? 3 : 4);
+        if (!strtok(NULL, ",") || !(tok = strtok(NULL, ",\r\n")))
+            continue;
+        if (lc >= 0 && lc < 256)
+            sigma[lc][sg] = (float)atof(tok);
+    }
+    fclose(f);
+    return GCN10_OK;
+}
+
+/* derive the class key land cover list from a set of tables:
+ * every class with a cn for any soil group, in ascending order */
+int gcn10_build_keys(int tables[][256][5], int n_tables,
+                     struct gcn10_keys *keys)
+{
+    int t, lc, sg, present;
+
+    keys->n_lc = 0;
+    for (lc = 0; lc < 256; lc++) {
+        keys->index[lc] = -1;
+        present = 0;
+        for (t = 0; t < n_tables && !present; t++) {
+            for (sg = 1; sg < 5; sg++) {
+                if (tables[t][lc][sg] < GCN10_NODATA)
+                    present = 1;
+            }
+        }
+        if (!present)
+            continue;
+        if (keys->n_lc == GCN10_KEY_MAX_LC)
+            return GCN10_ERR_LOOKUP;
+        keys->index[lc] = keys->n_lc;
+        keys->lc[keys->n_lc++] = lc;
+    }
+    return GCN10_OK;
+}
+
+/* table cell (land cover, soil group) that class key maps to under
+ * a drainage condition: dual soil states map to group d when drained
+ * and to their own group when undrained; 0 if the key has no cell */
+int gcn10_key_cell(const struct gcn10_keys *keys, int key, bool drained,
+                   int *lc, int *sg)
+{
+    int state;
+
+    if (key < 0 || key / 8 >= keys->n_lc)
+        return 0;
+    *lc = keys->lc[key / 8];
+    state = key % 8 + 1;
+    *sg = state <= 4 ? state : (drained ? 4 : state - 4);
+    return 1;
+}
+
+/* compile one scenario into a key -> cn lut */
+void gcn10_compile_lut(const struct gcn10_keys *keys, int table[256][5],
+                       bool drained, uint8_t lut[256])
+{
+    int key, lc, sg, cnv;
+
+    for (key = 0; key < 256; key++) {
+        cnv = GCN10_NODATA;
+        if (gcn10_key_cell(keys, key, drained, &lc, &sg)) {
+            cnv = table[lc][sg] < GCN10_NODATA ? table[lc][sg] :
+                GCN10_NODATA;
+        }
+        lut[key] = (uint8_t) cnv;
+    }
+}
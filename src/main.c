@@ -5,6 +5,7 @@
 #include <string.h>
 #include <stdlib.h>
 #include "global.h"
+#include "gcn10.h"
 
 /* simple cli helpers for --help / --version
    keep usage terse; point to readme for full docs */
@@ -19,7 +20,12 @@ static void gcn10_print_usage(FILE *fp)
             "gcn10 - high-resolution mpi-parallelized curve number generator\n"
             "usage:\n"
             "  mpirun  -n <ranks>  gcn10 --config <config.txt> [--blocks <blocks.txt>] [--overwrite]\n"
+            "  mpirun  -n <ranks>  gcn10 --config <config.txt> --aoi <vector|minx,miny,maxx,maxy>\n"
             "  mpiexec -n <ranks>  gcn10 --config <config.txt> [--blocks <blocks.txt>] [--overwrite]\n"
+            "  gcn10 --config <config.txt> --serve <port|unix:path>\n"
+            "  mpirun  -n <ranks>  gcn10 --config <config.txt> --daemon <spool dir>\n"
+            "  mpirun  -n <ranks>  gcn10 --config <config.txt> [--blocks <blocks.txt>] --selftest\n"
+            "  mpirun  -n <ranks>  gcn10 --config <config.txt> [--blocks <blocks.txt>] --verify <dir>\n"
             "  gcn10 --help | --version\n"
             "  gcn10 --help | -h | --version | -v\n"
             "\n"
@@ -27,6 +33,12 @@ static void gcn10_print_usage(FILE *fp)
             "  --config, -c <file>	path to config file (required)\n"
             "  --blocks, -b <file>	optional list of block ids to process\n"
             "  --overwrite, -o	overwrite existing outputs if present (optional)\n"
+            "  --aoi <aoi>		process the polygons of a vector file or a bbox instead of blocks\n"
+            "  --serve <endpoint>	serve cn tiles over http on 127.0.0.1:<port> or unix:<path>\n"
+            "  --selftest		check the cn kernels against the reference path on synthetic grids and the listed blocks\n"
+            "  --daemon <dir>	keep running and process the job files put in <dir>\n"
+            "  --verify <dir>	check the cn rasters under <dir> against the reference path\n"
+            "  --phase <phase>	run only part of the pipeline: read, compute or nowrite\n"
             "  --help, -h		show this help and exit\n"
             "  --version, -v	print version and exit\n"
             "\n"
@@ -55,10 +67,145 @@ static int gcn10_handle_meta_flags(int argc, char **argv)
     return 0;
 }
 
+/* process blocks block_ids (reordered in place for hilbert order) on
+ * all ranks, as scheduled by the config; collective over
+ * MPI_COMM_WORLD. merges split tail blocks and zone sums at the end */
+void run_blocks(int *block_ids, int n_blocks, bool overwrite)
+{
+    int rank, size, node, n_nodes, n_local, n_items, n_body, i, k, k_next;
+    bool have, have_next;
+    double *bboxes = NULL;
+    struct work_item *items = NULL;
+    char msg[256];
+
+    MPI_Comm_rank(MPI_COMM_WORLD, &rank);
+    MPI_Comm_size(MPI_COMM_WORLD, &size);
+
+    /* sort blocks along a hilbert curve so each rank
+     * gets a spatially contiguous run; every rank
+     * computes the same order independently */
+    if (use_hilbert_order || use_dynamic_schedule) {
+        bboxes = use_aoi_mode ? aoi_tile_bboxes(block_ids, n_blocks) :
+            get_block_bboxes(block_ids, n_blocks);
+        if (!bboxes)
+            MPI_Abort(MPI_COMM_WORLD, 1);
+    }
+    if (use_hilbert_order)
+        order_blocks_hilbert(block_ids, bboxes, n_blocks);
+
+    /* under node_coop blocks go to nodes rather than ranks */
+    node_init(&node, &n_nodes);
+
+    /* dynamic schedule: the last blocks form a tail whose large
+     * blocks are split so idle ranks share them */
+    if (use_dynamic_schedule) {
+        items = sched_build_items(bboxes, n_blocks, n_nodes, &n_items,
+                                  &n_body);
+        if (!items)
+            MPI_Abort(MPI_COMM_WORLD, 1);
+    }
+    free(bboxes);
+
+    /* class keys are global; rank 0 writes their legend once */
+    if (output_mode == OUTPUT_CLASS && rank == 0)
+        write_class_legend();
+
+    /* init async progress so rank 0 can
+     * both work and poll without blocking */
+    progress_init(rank, n_nodes, n_blocks);
+
+    if (rank == 0) {
+        /* print total blocks and mode */
+        snprintf(msg, sizeof(msg), "processing %d blocks %s in %s order",
+                 n_blocks,
+                 use_aoi_mode ? "from aoi windows" :
+                 use_list_mode ? "from list file" : "from shapefile",
+                 use_hilbert_order ? "hilbert" : "list");
+        log_message("INFO", msg, true);
+    }
+
+    if (use_dynamic_schedule) {
+        /* ranks claim blocks from a shared counter as they
+         * finish, then the parts of the tail */
+        sched_dynamic_init(n_items, n_body, n_nodes);
+        have = node_next_item(&k);
+        while (have) {
+            /* a body item after this one is claimed now so that
+             * its inputs are prefetched; the tail is left to
+             * whichever rank is free first */
+            have_next = !node_coop && sched_next_body(&k_next);
+            if (have_next)
+                set_next_block(block_ids[items[k_next].block],
+                               items[k_next].part, items[k_next].n_parts);
+            else
+                set_next_block(-1, 0, 1);
+
+            i = items[k].block;
+            if (items[k].n_parts > 1)
+                snprintf(msg, sizeof(msg), "processing block %d part %d/%d",
+                         block_ids[i], items[k].part + 1, items[k].n_parts);
+            else
+                snprintf(msg, sizeof(msg), "processing block %d",
+                         block_ids[i]);
+            log_message("INFO", msg, true);
+
+            process_block(block_ids[i], items[k].part, items[k].n_parts,
+                          overwrite, n_blocks);
+            progress_poll(rank, n_blocks);
+
+            if (have_next)
+                k = k_next;
+            else
+                have = node_next_item(&k);
+        }
+        sched_dynamic_finalize();
+        if (rank == 0)
+            progress_expect(n_blocks);
+        free(items);
+    }
+    else {
+        /* distribute blocks round-robin, or in
+         * contiguous runs for hilbert order */
+        n_local = sched_count_for_rank(node, n_nodes, n_blocks);
+        for (k = 0; k < n_local; k++) {
+            i = sched_block_index(node, n_nodes, n_blocks, k);
+            snprintf(msg, sizeof(msg), "processing block %d", block_ids[i]);
+            log_message("INFO", msg, true);
+
+            /* the next block's inputs are read during this one */
+            set_next_block(k + 1 < n_local ? block_ids[sched_block_index(
+                               node, n_nodes, n_blocks, k + 1)] : -1, 0,
+                           1);
+            process_block(block_ids[i], 0, 1, overwrite, n_blocks);
+
+            /* rank 0 polls here to drain 
+             * progress without blocking */
+            progress_poll(rank, n_blocks);
+        }
+    }
+
+    /* wait for any read ahead that went unused */
+    inputs_release();
+    plans_release();
+
+    /* after finishing local work, rank 0 
+     * drains remaining worker signals */
+    progress_finalize(rank);
+
+    /* copy the rows of split tail blocks into their outputs */
+    if (use_dynamic_schedule)
+        merge_band_parts(rank, size);
+
+    /* merge per-zone sums from all ranks */
+    if (zones_path)
+        zones_finalize(rank, size);
+}
+
 int main(int argc, char *argv[])
 {
-    int rank, size, n_blocks, i;
-    char *conf_file;
+    int rank, size, n_blocks, i, k, provided;
+    char *conf_file, *serve_endpoint, *verify_root, *phase, *spool;
+    bool run_selftest;
     int *block_ids;
     bool overwrite;
     char msg[8192];
@@ -73,11 +220,17 @@ int main(int argc, char *argv[])
     size = 0;
     n_blocks = 0;
     conf_file = NULL;
+    serve_endpoint = NULL;
+    verify_root = NULL;
+    phase = NULL;
+    spool = NULL;
+    run_selftest = false;
     block_ids = NULL;
     overwrite = false;
 
-    /* initialize mpi */
-    MPI_Init(&argc, &argv);
+    /* initialize mpi; the input read threads may call it too */
+    MPI_Init_thread(&argc, &argv, MPI_THREAD_MULTIPLE, &provided);
+    threaded_reads = provided >= MPI_THREAD_MULTIPLE;
     MPI_Comm_rank(MPI_COMM_WORLD, &rank);
     MPI_Comm_size(MPI_COMM_WORLD, &size);
 
@@ -95,6 +248,25 @@ int main(int argc, char *argv[])
         else if (!strcmp(argv[i], "-o") || !strcmp(argv[i], "--overwrite")) {
             overwrite = true;
         }
+        else if (!strcmp(argv[i], "--aoi") && i + 1 < argc) {
+            use_aoi_mode = true;
+            aoi_spec = argv[++i];
+        }
+        else if (!strcmp(argv[i], "--serve") && i + 1 < argc) {
+            serve_endpoint = argv[++i];
+        }
+        else if (!strcmp(argv[i], "--selftest")) {
+            run_selftest = true;
+        }
+        else if (!strcmp(argv[i], "--verify") && i + 1 < argc) {
+            verify_root = argv[++i];
+        }
+        else if (!strcmp(argv[i], "--phase") && i + 1 < argc) {
+            phase = argv[++i];
+        }
+        else if (!strcmp(argv[i], "--daemon") && i + 1 < argc) {
+            spool = argv[++i];
+        }
     }
 
     /* validate config file */
@@ -108,6 +280,25 @@ int main(int argc, char *argv[])
         MPI_Abort(MPI_COMM_WORLD, 1);
     }
 
+    /* run only part of the pipeline, to tell i/o from compute */
+    if (phase) {
+        if (!strcmp(phase, "read"))
+            run_phase = RUN_READ;
+        else if (!strcmp(phase, "compute"))
+            run_phase = RUN_COMPUTE;
+        else if (!strcmp(phase, "nowrite"))
+            run_phase = RUN_NOWRITE;
+        else {
+            if (rank == 0) {
+                fprintf(stderr,
+                        "[rank %d] invalid --phase '%s'; use read, compute "
+                        "or nowrite.\n", rank, phase);
+                fflush(stderr);
+            }
+            MPI_Abort(MPI_COMM_WORLD, 1);
+        }
+    }
+
     /* read and print config */
     parse_config(conf_file);
     if (rank == 0) {
@@ -119,17 +310,158 @@ int main(int argc, char *argv[])
                  "  esa_data_path      = %s\n"
                  "  blocks_shp_path    = %s\n"
                  "  lookup_table_path  = %s\n"
-                 "  log_dir            = %s",
+                 "  log_dir            = %s\n"
+                 "  block_order        = %s\n"
+                 "  schedule           = %s\n"
+                 "  output_mode        = %s",
                  size, hysogs_data_path, esa_data_path,
-                 blocks_shp_path, lookup_table_path, log_dir);
+                 blocks_shp_path, lookup_table_path, log_dir,
+                 use_hilbert_order ? "hilbert" : "list",
+                 use_dynamic_schedule ? "dynamic" : "static",
+                 output_mode == OUTPUT_DELTA ? "delta" :
+                 output_mode == OUTPUT_CLASS ? "class" : "full");
         log_message("INFO", msg, true);
+        if (n_precip) {
+            snprintf(msg, sizeof(msg),
+                     "runoff: %d precipitation raster(s), lambda = %.3f, "
+                     "outputs = q%s%s, write_cn = %s", n_precip,
+                     runoff_lambda, runoff_outputs & RUNOFF_S ? ",s" : "",
+                     runoff_outputs & RUNOFF_IA ? ",ia" : "",
+                     write_cn ? "yes" : "no");
+            log_message("INFO", msg, true);
+        }
+        for (k = 0, i = 0; i < GCN10_N_SCENARIOS; i++)
+            k += use_default_scenario[i];
+        if (n_scenario_specs || k < GCN10_N_SCENARIOS) {
+            snprintf(msg, sizeof(msg),
+                     "scenarios: %d default, %d from manifest", k,
+                     n_scenario_specs);
+            log_message("INFO", msg, true);
+        }
+        if (mc_runs) {
+            snprintf(msg, sizeof(msg),
+                     "monte carlo: %d realizations from %s, seed %lu",
+                     mc_runs, n_mc_lookup_dirs ? "lookup directories" :
+                     "normal perturbation", mc_seed);
+            log_message("INFO", msg, true);
+        }
+        if (target_res > 0) {
+            snprintf(msg, sizeof(msg),
+                     "target resolution: %.0f m (%.6f deg), majority land "
+                     "cover", target_res * 111320.0, target_res);
+            log_message("INFO", msg, true);
+        }
+        if (max_memory_per_rank) {
+            snprintf(msg, sizeof(msg), "max memory per rank: %d mb",
+                     max_memory_per_rank);
+            log_message("INFO", msg, true);
+        }
+        if (run_phase != RUN_ALL) {
+            snprintf(msg, sizeof(msg), "phase %s: %s", phase,
+                     run_phase == RUN_READ ?
+                     "inputs are read and discarded, nothing is written" :
+                     run_phase == RUN_COMPUTE ?
+                     "later windows reuse the first one's inputs, nothing "
+                     "is written" : "outputs are encoded to /vsimem/ only");
+            log_message("INFO", msg, true);
+        }
+        if (node_coop) {
+            log_message("INFO", "node-cooperative processing: node rank 0 "
+                        "reads, all ranks of a node write", true);
+        }
+        if (vrt_direct && read_threads) {
+            snprintf(msg, sizeof(msg), "direct vrt reads on %d thread(s)",
+                     read_threads);
+            log_message("INFO", msg, true);
+        }
+        if (output_crs) {
+            snprintf(msg, sizeof(msg), "output crs: %s, cell %g%s",
+                     output_crs, output_res,
+                     output_res > 0 ? "" : " (native)");
+            log_message("INFO", msg, true);
+        }
+        if (n_agg_levels) {
+            int l, pos;
+
+            pos = snprintf(msg, sizeof(msg), "aggregate levels (%s):",
+                           agg_method == GCN10_AGG_MAJORITY ? "majority" :
+                           agg_method == GCN10_AGG_RUNOFF ? "runoff" :
+                           "mean");
+            for (l = 0; l < n_agg_levels; l++)
+                pos += snprintf(msg + pos, sizeof(msg) - pos, " %dm",
+                                agg_levels[l]);
+            log_message("INFO", msg, true);
+        }
+        if (zones_path) {
+            snprintf(msg, sizeof(msg), "zonal statistics: %s (field %s) -> %s",
+                     zones_path, zone_field, zones_csv_path);
+            log_message("INFO", msg, true);
+        }
+        if (n_antecedent) {
+            snprintf(msg, sizeof(msg),
+                     "daily cn: %d antecedent day(s), default season %s, "
+                     "dormant %.1f/%.1f mm, growing %.1f/%.1f mm",
+                     n_antecedent,
+                     arc_season == SEASON_DORMANT ? "dormant" : "growing",
+                     arc_thresholds[0][0], arc_thresholds[0][1],
+                     arc_thresholds[1][0], arc_thresholds[1][1]);
+            log_message("INFO", msg, true);
+        }
     }
 
     /* setup per-rank logging */
     init_logging(rank);
+    if (!threaded_reads && rank == 0)
+        log_message("INFO", "mpi does not provide MPI_THREAD_MULTIPLE; "
+                    "inputs are read on the main thread without prefetch",
+                    true);
 
-    /* load block ids */
-    if (use_list_mode) {
+    /* tile server mode: rank 0 serves until interrupted,
+     * other ranks have nothing to do */
+    if (serve_endpoint) {
+        int rc = 0;
+
+        if (rank == 0)
+            rc = serve(serve_endpoint);
+        MPI_Barrier(MPI_COMM_WORLD);
+        finalize_logging();
+        free_config();
+        MPI_Finalize();
+        exit(rc ? EXIT_FAILURE : EXIT_SUCCESS);
+    }
+
+    /* daemon mode: all ranks run the jobs put in the spool
+     * directory until told to stop */
+    if (spool) {
+        int rc = run_daemon(spool, overwrite);
+
+        phase_report(rank);
+        finalize_logging();
+        free_config();
+        arena_release();
+        vrt_direct_release();
+        node_release();
+        MPI_Finalize();
+        exit(rc ? EXIT_FAILURE : EXIT_SUCCESS);
+    }
+
+    /* the selftest needs no blocks unless some are listed */
+    if (run_selftest && !use_list_mode && !use_aoi_mode) {
+        int rc = selftest(NULL, 0);
+
+        finalize_logging();
+        free_config();
+        arena_release();
+        MPI_Finalize();
+        exit(rc ? EXIT_FAILURE : EXIT_SUCCESS);
+    }
+
+    /* load block ids, or cut the aoi into windows that stand in
+     * for blocks from here on */
+    if (use_aoi_mode) {
+        block_ids = aoi_tiles(aoi_spec, &n_blocks);
+    }
+    else if (use_list_mode) {
         block_ids = read_block_list(block_ids_file, &n_blocks);
         if (rank == 0 && (!block_ids || !n_blocks)) {
             snprintf(msg, sizeof(msg), "no ids found in %s", block_ids_file);
@@ -156,32 +488,29 @@ int main(int argc, char *argv[])
     if (!block_ids || !n_blocks)
         MPI_Abort(MPI_COMM_WORLD, 1);
 
-    /* init async progress so rank 0 can
-     * both work and poll without blocking */
-    progress_init(rank, size, n_blocks);
+    /* check kernels or an output tree instead of writing outputs */
+    if (run_selftest || verify_root) {
+        int rc = run_selftest ? selftest(block_ids, n_blocks) :
+            verify_outputs(verify_root, block_ids, n_blocks);
 
-    if (rank == 0) {
-        /* print total blocks and mode */
-        snprintf(msg, sizeof(msg), "processing %d blocks %s", n_blocks,
-                 use_list_mode ? "from list file" : "from shapefile");
-        log_message("INFO", msg, true);
+        finalize_logging();
+        free_config();
+        free(block_ids);
+        arena_release();
+        MPI_Finalize();
+        exit(rc ? EXIT_FAILURE : EXIT_SUCCESS);
     }
 
-    /* distribute blocks round-robin */
-    for (i = rank; i < n_blocks; i += size) {
-        snprintf(msg, sizeof(msg), "processing block %d", block_ids[i]);
-        log_message("INFO", msg, true);
+    run_blocks(block_ids, n_blocks, overwrite);
 
-        process_block(block_ids[i], overwrite, n_blocks);
+    /* report time and bytes of reads, compute and writes */
+    phase_report(rank);
 
-        /* rank 0 polls here to drain 
-         * progress without blocking */
-        progress_poll(rank, n_blocks);
-    }
+    /* report input tile reuse achieved by the block order */
+    locality_report(rank);
 
-    /* after finishing local work, rank 0 
-     * drains remaining worker signals */
-    progress_finalize(rank);
+    /* report buffer reuse, page faults and peak rss */
+    arena_report(rank);
 
     /* synchronize all ranks */
     MPI_Barrier(MPI_COMM_WORLD);
@@ -197,6 +526,9 @@ int main(int argc, char *argv[])
     finalize_logging();
     free_config();
     free(block_ids);
+    arena_release();
+    vrt_direct_release();
+    node_release();
     MPI_Finalize();
 
     exit(EXIT_SUCCESS);
@@ -0,0 +1,241 @@
+/* node-cooperative processing: the ranks of a node work on one block at
+ * a time. node rank 0 reads and classifies the block and places its
+ * class grids in a shared memory window; every rank of the node then
+ * writes the cn rasters of its share of the scenarios straight from
+ * that window. blocks are distributed over nodes instead of ranks */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include "global.h"
+
+static MPI_Comm node_comm = MPI_COMM_NULL;
+static int node_rank = 0, node_size = 1;
+static int node_index, n_node_index;
+
+/* the shared grids, allocated on node rank 0 and grown as needed */
+static MPI_Win grid_win = MPI_WIN_NULL;
+static uint8_t *grid_base = NULL;
+static size_t grid_cap = 0;
+
+/* srs of the current window on ranks other than the reader */
+static OGRSpatialReferenceH shared_srs = NULL;
+
+/* window header sent from the reader to the rest of the node */
+struct grid_header {
+    int ok;
+    int xsize, ysize;
+    int wkt_len;
+    double gt[6];
+};
+
+/* split the world into nodes; node and n_nodes take the place of rank
+ * and size in block distribution. without node_coop every rank is a
+ * node of its own. the split is made once, later calls return it */
+void node_init(int *node, int *n_nodes)
+{
+    MPI_Comm leaders;
+    int rank, size;
+
+    MPI_Comm_rank(MPI_COMM_WORLD, &rank);
+    MPI_Comm_size(MPI_COMM_WORLD, &size);
+    if (!node_coop) {
+        *node = rank;
+        *n_nodes = size;
+        return;
+    }
+    if (node_comm != MPI_COMM_NULL) {
+        *node = node_index;
+        *n_nodes = n_node_index;
+        return;
+    }
+
+    MPI_Comm_split_type(MPI_COMM_WORLD, MPI_COMM_TYPE_SHARED, rank,
+                        MPI_INFO_NULL, &node_comm);
+    MPI_Comm_rank(node_comm, &node_rank);
+    MPI_Comm_size(node_comm, &node_size);
+
+    /* node ranks 0 number the nodes among themselves */
+    MPI_Comm_split(MPI_COMM_WORLD, node_rank == 0 ? 0 : MPI_UNDEFINED, rank,
+                   &leaders);
+    if (node_rank == 0) {
+        MPI_Comm_rank(leaders, node);
+        MPI_Comm_size(leaders, n_nodes);
+        MPI_Comm_free(&leaders);
+    }
+    MPI_Bcast(node, 1, MPI_INT, 0, node_comm);
+    MPI_Bcast(n_nodes, 1, MPI_INT, 0, node_comm);
+    node_index = *node;
+    n_node_index = *n_nodes;
+}
+
+/* true on the rank that reads blocks: node rank 0, or every rank
+ * without node_coop */
+bool node_reader(void)
+{
+    return node_rank == 0;
+}
+
+/* true if this rank writes the scenarios of lookup table t. the
+ * drained and undrained scenarios of a table stay on one rank, so a
+ * delta vrt finds the name of its drained raster locally; node ranks
+ * past the number of tables therefore write no cn rasters */
+bool node_owns(int t)
+{
+    return t % node_size == node_rank;
+}
+
+/* warn once when a node has more ranks than the n_tables lookup
+ * tables its cn rasters are shared out by */
+void node_check_tables(int n_tables)
+{
+    static bool warned = false;
+    char msg[256];
+
+    if (!node_coop || warned || node_size <= n_tables)
+        return;
+    warned = true;
+    if (node_rank == 0 && node_index == 0) {
+        snprintf(msg, sizeof(msg),
+                 "node_coop: %d ranks per node but %d lookup tables, %d "
+                 "ranks per node write no cn rasters", node_size, n_tables,
+                 node_size - n_tables);
+        log_message("WARNING", msg, true);
+    }
+}
+
+/* next item of the dynamic schedule; under node_coop node rank 0
+ * claims it for the whole node */
+bool node_next_item(int *k)
+{
+    int item = -1;
+
+    if (!node_coop)
+        return sched_next(k);
+    if (node_rank == 0 && !sched_next(&item))
+        item = -1;
+    MPI_Bcast(&item, 1, MPI_INT, 0, node_comm);
+    *k = item;
+    return item >= 0;
+}
+
+/* make room for bytes in the shared window; collective over the node.
+ * otherwise waits until every rank is done with the previous grids */
+static void reserve_grids(size_t bytes)
+{
+    MPI_Aint sz;
+    int disp;
+    char msg[256];
+
+    if (bytes <= grid_cap) {
+        MPI_Barrier(node_comm);
+        return;
+    }
+    if (grid_win != MPI_WIN_NULL) {
+        MPI_Win_unlock_all(grid_win);
+        MPI_Win_free(&grid_win);
+    }
+
+    /* grow in steps, so slightly larger windows do not reallocate */
+    bytes += bytes / 4;
+    if (MPI_Win_allocate_shared(node_rank == 0 ? (MPI_Aint)bytes : 0, 1,
+                                MPI_INFO_NULL, node_comm, &grid_base,
+                                &grid_win) != MPI_SUCCESS) {
+        snprintf(msg, sizeof(msg),
+                 "shared window of %zu bytes could not be allocated", bytes);
+        log_message("ERROR", msg, true);
+        MPI_Abort(MPI_COMM_WORLD, 1);
+    }
+    MPI_Win_shared_query(grid_win, 0, &sz, &disp, &grid_base);
+    MPI_Win_lock_all(MPI_MODE_NOCHECK, grid_win);
+    grid_cap = bytes;
+}
+
+/* hand the grids of the current window from the reader to the node;
+ * collective over the node. on the reader ok tells whether g holds a
+ * window, on return g points into the shared window on every rank.
+ * false if the reader has no window, in which case there is nothing
+ * to write */
+bool node_share(bool ok, struct block_grids *g)
+{
+    struct grid_header h;
+    char *wkt = NULL;
+    size_t npix, bytes;
+    int n_grids;
+
+    if (!node_coop)
+        return ok;
+
+    memset(&h, 0, sizeof(h));
+    if (node_rank == 0 && ok) {
+        h.ok = 1;
+        h.xsize = g->xsize;
+        h.ysize = g->ysize;
+        memcpy(h.gt, g->gt, sizeof(h.gt));
+        if (g->srs && OSRExportToWkt(g->srs, &wkt) == OGRERR_NONE)
+            h.wkt_len = (int)strlen(wkt) + 1;
+    }
+    MPI_Bcast(&h, sizeof(h), MPI_BYTE, 0, node_comm);
+    if (!h.ok) {
+        CPLFree(wkt);
+        return false;
+    }
+
+    if (node_rank != 0) {
+        wkt = h.wkt_len ? CPLMalloc(h.wkt_len) : NULL;
+        g->xsize = h.xsize;
+        g->ysize = h.ysize;
+        memcpy(g->gt, h.gt, sizeof(g->gt));
+    }
+    if (h.wkt_len)
+        MPI_Bcast(wkt, h.wkt_len, MPI_CHAR, 0, node_comm);
+    if (node_rank != 0) {
+        if (shared_srs)
+            OSRDestroySpatialReference(shared_srs);
+        shared_srs = wkt ? OSRNewSpatialReference(wkt) : NULL;
+        g->srs = shared_srs;
+    }
+    CPLFree(wkt);
+
+    /* keys always; esa and soil only for delta rasters */
+    npix = (size_t)h.xsize * h.ysize;
+    n_grids = output_mode == OUTPUT_DELTA ? 3 : 1;
+    bytes = n_grids * npix;
+    reserve_grids(bytes);
+
+    if (node_rank == 0) {
+        memcpy(grid_base, g->keys, npix);
+        if (n_grids == 3) {
+            memcpy(grid_base + npix, g->esa, npix);
+            memcpy(grid_base + 2 * npix, g->soil, npix);
+        }
+        MPI_Win_sync(grid_win);
+    }
+    MPI_Barrier(node_comm);
+    if (node_rank != 0)
+        MPI_Win_sync(grid_win);
+
+    g->keys = grid_base;
+    g->esa = n_grids == 3 ? grid_base + npix : NULL;
+    g->soil = n_grids == 3 ? grid_base + 2 * npix : NULL;
+    return true;
+}
+
+/* free the shared window and the node communicator */
+void node_release(void)
+{
+    if (grid_win != MPI_WIN_NULL) {
+        MPI_Win_unlock_all(grid_win);
+        MPI_Win_free(&grid_win);
+    }
+    grid_base = NULL;
+    grid_cap = 0;
+    if (shared_srs) {
+        OSRDestroySpatialReference(shared_srs);
+        shared_srs = NULL;
+    }
+    if (node_comm != MPI_COMM_NULL)
+        MPI_Comm_free(&node_comm);
+    node_rank = 0;
+    node_size = 1;
+}
@@ -0,0 +1,71 @@
+/* per-phase run metrics: time and bytes spent reading inputs, waiting
+ * for them, writing outputs, and processing windows as a whole; the
+ * compute time of a window is what is left of it after the read wait
+ * and the writes. reported the same way in every run_phase mode, so
+ * runs that skip a phase can be set against a full one */
+
+#include <stdio.h>
+#include "global.h"
+
+static double ph_seconds[PH_COUNT];
+static double ph_bytes[PH_COUNT];
+static long long ph_count[PH_COUNT];
+
+/* add seconds and bytes (0 if none) to metric m */
+void phase_add(int m, double seconds, double bytes)
+{
+    ph_seconds[m] += seconds;
+    ph_bytes[m] += bytes;
+    ph_count[m]++;
+}
+
+/* reduce the metrics of all ranks and log them on rank 0: seconds
+ * summed over ranks and on the slowest rank, and throughput of the
+ * reads and writes. collective over MPI_COMM_WORLD */
+void phase_report(int rank)
+{
+    static const char *const names[PH_COUNT] = {
+        "read", "read wait", "write", "compute"
+    };
+    double local[3 * PH_COUNT], sum[3 * PH_COUNT], max[PH_COUNT];
+    char msg[1024];
+    int m, pos;
+
+    /* compute: window time not spent waiting for inputs or writing */
+    ph_seconds[PH_COMPUTE] = ph_seconds[PH_WINDOW] -
+        ph_seconds[PH_READ_WAIT] - ph_seconds[PH_WRITE];
+    if (ph_seconds[PH_COMPUTE] < 0)
+        ph_seconds[PH_COMPUTE] = 0;
+
+    for (m = 0; m < PH_COUNT; m++) {
+        local[m] = ph_seconds[m];
+        local[PH_COUNT + m] = ph_bytes[m];
+        local[2 * PH_COUNT + m] = (double)ph_count[m];
+    }
+    MPI_Reduce(local, sum, 3 * PH_COUNT, MPI_DOUBLE, MPI_SUM, 0,
+               MPI_COMM_WORLD);
+    MPI_Reduce(ph_seconds, max, PH_COUNT, MPI_DOUBLE, MPI_MAX, 0,
+               MPI_COMM_WORLD);
+    if (rank != 0)
+        return;
+
+    pos = snprintf(msg, sizeof(msg), "phases (%s run, %.0f windows):",
+                   run_phase == RUN_READ ? "read-only" :
+                   run_phase == RUN_COMPUTE ? "compute-only" :
+                   run_phase == RUN_NOWRITE ? "no-write" : "full",
+                   sum[2 * PH_COUNT + PH_WINDOW]);
+    for (m = 0; m < PH_COUNT; m++) {
+        if (m == PH_WINDOW)
+            continue;
+        pos += snprintf(msg + pos, sizeof(msg) - pos,
+                        "%s %s %.2f s (slowest rank %.2f s", m ? "," : "",
+                        names[m], sum[m], max[m]);
+        if ((m == PH_READ || m == PH_WRITE) && sum[m] > 0)
+            pos += snprintf(msg + pos, sizeof(msg) - pos,
+                            ", %.1f mb, %.1f mb/s per rank",
+                            sum[PH_COUNT + m] / 1048576.0,
+                            sum[PH_COUNT + m] / 1048576.0 / sum[m]);
+        pos += snprintf(msg + pos, sizeof(msg) - pos, ")");
+    }
+    log_message("INFO", msg, true);
+}
@@ -0,0 +1,259 @@
+/* block input reads off the compute path: the esa and hysogs windows
+ * of a block are read on two threads at once, and the windows of the
+ * next block (or band) are read into a second buffer set while the
+ * current one computes and writes. reads go through load_raster()
+ * into their own arena slots, so each thread owns its buffers.
+ * compute-only runs read the first window only and make every later
+ * one from its pixels */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+#include <cpl_multiproc.h>
+#include "global.h"
+
+/* one raster read, run on its own thread */
+struct input_read {
+    const char *path;
+    double res;
+    int slot;
+    uint8_t *buf;
+    int xsize, ysize;
+    double gt[6];
+    OGRSpatialReferenceH srs;
+    const double *bbox;
+    CPLJoinableThread *thread;
+    double seconds;
+};
+
+/* the two reads of one window; pending while its threads run */
+struct input_set {
+    double bbox[4];
+    bool pending;
+    struct input_read esa, soil;
+};
+
+static struct input_set sets[2];
+static int free_set = 0;        /* set the next read goes into */
+
+/* windows served from a prefetch, and read on demand */
+static long long n_hits = 0, n_misses = 0;
+
+/* the first window of a compute-only run */
+static struct block_inputs cached;
+
+/* one read; on a thread of its own only under threaded_reads, as
+ * load_raster() may log or abort through mpi */
+static void read_input(void *arg)
+{
+    struct input_read *r = arg;
+    double t0 = MPI_Wtime();
+
+    r->buf = load_raster(r->path, r->bbox, r->res, r->slot, &r->xsize,
+                         &r->ysize, r->gt, &r->srs);
+    r->seconds = MPI_Wtime() - t0;
+}
+
+/* start both reads of bbox into set s on their own threads; without
+ * threaded_reads, or when a thread cannot be created, a read runs here
+ * instead */
+static void start_reads(int s, const double *bbox)
+{
+    struct input_set *set = &sets[s];
+    struct input_read *r[2];
+    int i;
+
+    memcpy(set->bbox, bbox, sizeof(set->bbox));
+    set->esa.path = esa_data_path;
+    set->esa.res = target_res;
+    set->esa.slot = s ? ARENA_ESA_NEXT : ARENA_ESA;
+    set->soil.path = hysogs_data_path;
+    set->soil.res = 0;
+    set->soil.slot = s ? ARENA_SOIL_COARSE_NEXT : ARENA_SOIL_COARSE;
+    r[0] = &set->esa;
+    r[1] = &set->soil;
+
+    /* drivers are registered here, before any thread opens a file */
+    register_drivers();
+    for (i = 0; i < 2; i++) {
+        r[i]->bbox = set->bbox;
+        r[i]->buf = NULL;
+        r[i]->srs = NULL;
+        r[i]->thread = threaded_reads ?
+            CPLCreateJoinableThread(read_input, r[i]) : NULL;
+        if (!r[i]->thread)
+            read_input(r[i]);
+    }
+    set->pending = true;
+}
+
+/* wait for the reads of set s */
+static void finish_reads(int s)
+{
+    struct input_set *set = &sets[s];
+
+    if (!set->pending)
+        return;
+    if (set->esa.thread)
+        CPLJoinThread(set->esa.thread);
+    if (set->soil.thread)
+        CPLJoinThread(set->soil.thread);
+    set->esa.thread = set->soil.thread = NULL;
+    set->pending = false;
+    phase_add(PH_READ, set->esa.seconds + set->soil.seconds,
+              (set->esa.buf ? (double)set->esa.xsize * set->esa.ysize : 0) +
+              (set->soil.buf ? (double)set->soil.xsize * set->soil.ysize :
+               0));
+
+    /* the soil grid is resampled onto the esa one, whose srs is kept */
+    if (set->soil.srs) {
+        OSRDestroySpatialReference(set->soil.srs);
+        set->soil.srs = NULL;
+    }
+}
+
+/* start reading the inputs of bbox, the window processed after the
+ * current one; its buffers are kept apart from the current window's */
+void inputs_prefetch(const double *bbox)
+{
+    if (!prefetch_inputs || !threaded_reads || sets[free_set].pending ||
+        (run_phase == RUN_COMPUTE && cached.esa))
+        return;
+    start_reads(free_set, bbox);
+}
+
+/* fill n bytes of buf with the pixels of src (n_src bytes) over and
+ * over */
+static void tile_pixels(uint8_t *buf, size_t n, const uint8_t *src,
+                        size_t n_src)
+{
+    size_t i, k;
+
+    for (i = 0; i < n; i += k) {
+        k = n - i < n_src ? n - i : n_src;
+        memcpy(buf + i, src, k);
+    }
+}
+
+/* window bbox of a compute-only run, made without reading from the
+ * pixels of the first window on the esa and hysogs grids of bbox */
+static void synthetic_inputs(const double *bbox, struct block_inputs *in)
+{
+    const double *g = cached.gt, *sg = cached.soil_gt;
+
+    *in = cached;
+    in->xsize = (int)lround((bbox[2] - bbox[0]) / g[1]);
+    in->ysize = (int)lround((bbox[3] - bbox[1]) / -g[5]);
+    in->xsize = in->xsize < 1 ? 1 : in->xsize;
+    in->ysize = in->ysize < 1 ? 1 : in->ysize;
+    in->gt[0] = bbox[0];
+    in->gt[3] = bbox[3];
+    in->soil_xsize = (int)ceil((bbox[2] - bbox[0]) / sg[1]) + 1;
+    in->soil_ysize = (int)ceil((bbox[3] - bbox[1]) / -sg[5]) + 1;
+    in->soil_gt[0] = bbox[0];
+    in->soil_gt[3] = bbox[3];
+
+    in->esa = arena_get(free_set ? ARENA_ESA_NEXT : ARENA_ESA,
+                        (size_t)in->xsize * in->ysize);
+    tile_pixels(in->esa, (size_t)in->xsize * in->ysize, cached.esa,
+                (size_t)cached.xsize * cached.ysize);
+    in->soil = arena_get(free_set ? ARENA_SOIL_COARSE_NEXT :
+                         ARENA_SOIL_COARSE,
+                         (size_t)in->soil_xsize * in->soil_ysize);
+    tile_pixels(in->soil, (size_t)in->soil_xsize * in->soil_ysize,
+                cached.soil, (size_t)cached.soil_xsize * cached.soil_ysize);
+    in->srs = OSRClone(cached.srs);
+    free_set ^= 1;
+}
+
+/* keep a copy of the window in in for synthetic_inputs() */
+static void cache_inputs(const struct block_inputs *in)
+{
+    size_t n = (size_t)in->xsize * in->ysize;
+    size_t ns = (size_t)in->soil_xsize * in->soil_ysize;
+
+    cached = *in;
+    cached.esa = malloc(n);
+    cached.soil = malloc(ns);
+    if (!cached.esa || !cached.soil) {
+        log_message("ERROR", "malloc failed for cached inputs", true);
+        MPI_Abort(MPI_COMM_WORLD, 1);
+    }
+    memcpy(cached.esa, in->esa, n);
+    memcpy(cached.soil, in->soil, ns);
+    cached.srs = OSRClone(in->srs);
+}
+
+/* inputs of window bbox: taken from a matching prefetch, or else read
+ * now with esa and hysogs in parallel. buffers stay valid until the
+ * second inputs_load() after this one; esa or soil is NULL when its
+ * read failed */
+void inputs_load(const double *bbox, struct block_inputs *in)
+{
+    struct input_set *set = &sets[free_set];
+    double t0 = MPI_Wtime();
+
+    if (run_phase == RUN_COMPUTE && cached.esa) {
+        synthetic_inputs(bbox, in);
+        return;
+    }
+
+    if (set->pending && !memcmp(set->bbox, bbox, sizeof(set->bbox))) {
+        finish_reads(free_set);
+        n_hits++;
+    }
+    else {
+        /* a prefetch of another window is dropped */
+        finish_reads(free_set);
+        if (set->esa.srs)
+            OSRDestroySpatialReference(set->esa.srs);
+        start_reads(free_set, bbox);
+        finish_reads(free_set);
+        n_misses++;
+    }
+
+    in->esa = set->esa.buf;
+    in->xsize = set->esa.xsize;
+    in->ysize = set->esa.ysize;
+    memcpy(in->gt, set->esa.gt, sizeof(in->gt));
+    in->srs = set->esa.srs;
+    in->soil = set->soil.buf;
+    in->soil_xsize = set->soil.xsize;
+    in->soil_ysize = set->soil.ysize;
+    memcpy(in->soil_gt, set->soil.gt, sizeof(in->soil_gt));
+
+    /* the caller owns the srs; the next read uses the other set */
+    set->esa.srs = NULL;
+    free_set ^= 1;
+    phase_add(PH_READ_WAIT, MPI_Wtime() - t0, 0);
+
+    if (run_phase == RUN_COMPUTE && in->esa && in->soil)
+        cache_inputs(in);
+}
+
+/* wait for a prefetch nobody asked for and log how many windows were
+ * served from prefetches */
+void inputs_release(void)
+{
+    char msg[128];
+    int s;
+
+    for (s = 0; s < 2; s++) {
+        finish_reads(s);
+        if (sets[s].esa.srs)
+            OSRDestroySpatialReference(sets[s].esa.srs);
+        sets[s].esa.srs = NULL;
+    }
+    free(cached.esa);
+    free(cached.soil);
+    if (cached.srs)
+        OSRDestroySpatialReference(cached.srs);
+    memset(&cached, 0, sizeof(cached));
+    if (prefetch_inputs && n_hits + n_misses) {
+        snprintf(msg, sizeof(msg),
+                 "prefetch: %lld of %lld windows read ahead of use",
+                 n_hits, n_hits + n_misses);
+        log_message("INFO", msg, false);
+    }
+}
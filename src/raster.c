@@ -3,13 +3,20 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <math.h>
+#include <string.h>
 #include <limits.h>
 #include "global.h"
+#include "gcn10.h"
+
+/* wgs84 ellipsoid */
+#define WGS84_A 6378137.0
+#define WGS84_F (1.0 / 298.257223563)
+#define DEG2RAD (3.14159265358979323846 / 180.0)
 
 static bool drivers_registered = false;
 
-/* register gdal/ogr drivers */
-static void register_drivers(void)
+/* register gdal/ogr drivers; called first from the main thread */
+void register_drivers(void)
 {
     if (drivers_registered) {
         return;
@@ -94,7 +101,7 @@ int *get_all_blocks(int *n_blocks)
     OGR_L_ResetReading(layer);
     *n_blocks = 0;
     while ((feat = OGR_L_GetNextFeature(layer))) {
-        ids[*n_blocks++] =
+        ids[(*n_blocks)++] =
             OGR_F_GetFieldAsInteger(feat, OGR_F_GetFieldIndex(feat, "ID"));
         OGR_F_Destroy(feat);
     }
@@ -102,121 +109,477 @@ int *get_all_blocks(int *n_blocks)
     return ids;
 }
 
-/* load and clip raster window into byte buffer */
-uint8_t *load_raster(const char *path, const double *bbox, int *xsize,
-                     int *ysize, double *gt, OGRSpatialReferenceH *srs)
+/* compare two (id, index) pairs by id */
+static int cmp_id_pair(const void *a, const void *b)
 {
-    GDALDatasetH ds;
-    double t[6];
-    int xoff, yoff, xcount, ycount, rx, ry;
-    uint8_t *buf;
-    size_t pixel_count;
-    const char *wkt;
-    CPLErr err;
+    const int *pa = a, *pb = b;
+
+    return (pa[0] > pb[0]) - (pa[0] < pb[0]);
+}
+
+/* block envelopes kept by keep_block_bboxes(): (id, index) pairs
+ * sorted by id, and the envelopes they index */
+static int *kept_pairs = NULL;
+static double *kept_bboxes = NULL;
+static int n_kept = 0;
+
+/* keep the envelopes of blocks ids (n * 4 doubles) for later lookups,
+ * which then need no shapefile read; n 0 drops them */
+void keep_block_bboxes(const int *ids, const double *bboxes, int n)
+{
+    int i;
+
+    free(kept_pairs);
+    free(kept_bboxes);
+    kept_pairs = NULL;
+    kept_bboxes = NULL;
+    n_kept = 0;
+    if (!n)
+        return;
+
+    kept_pairs = malloc((size_t)n * 2 * sizeof(int));
+    kept_bboxes = malloc((size_t)n * 4 * sizeof(double));
+    if (!kept_pairs || !kept_bboxes) {
+        log_message("ERROR", "malloc failed for block envelopes", true);
+        MPI_Abort(MPI_COMM_WORLD, 1);
+    }
+    for (i = 0; i < n; i++) {
+        kept_pairs[2 * i] = ids[i];
+        kept_pairs[2 * i + 1] = i;
+    }
+    qsort(kept_pairs, n, 2 * sizeof(int), cmp_id_pair);
+    memcpy(kept_bboxes, bboxes, (size_t)n * 4 * sizeof(double));
+    n_kept = n;
+}
+
+/* envelope of block id from the kept ones; false if it is not kept */
+bool kept_block_bbox(int id, double *bbox)
+{
+    int key[2], *hit;
+
+    key[0] = id;
+    hit = n_kept ? bsearch(key, kept_pairs, n_kept, 2 * sizeof(int),
+                           cmp_id_pair) : NULL;
+    if (!hit || isnan(kept_bboxes[4 * hit[1]]))
+        return false;
+    memcpy(bbox, kept_bboxes + 4 * hit[1], 4 * sizeof(double));
+    return true;
+}
+
+/* read envelopes of the given block ids from the shapefile in one pass,
+ * or from the kept ones when they hold every id; returns n * 4 doubles
+ * (minx, miny, maxx, maxy), nan for missing ids */
+double *get_block_bboxes(const int *ids, int n)
+{
+    OGRDataSourceH ds;
+    OGRLayerH layer;
+    OGRFeatureH feat;
+    OGREnvelope env;
+    int *pairs, *hit, key[2], i;
+    double *bboxes;
     char msg[512];
 
+    if (n_kept) {
+        bboxes = malloc((size_t)(n ? n : 1) * 4 * sizeof(double));
+        if (!bboxes) {
+            log_message("ERROR", "malloc failed for block envelopes", true);
+            MPI_Abort(MPI_COMM_WORLD, 1);
+        }
+        for (i = 0; i < n && kept_block_bbox(ids[i], bboxes + 4 * i); i++)
+            ;
+        if (i == n)
+            return bboxes;
+        free(bboxes);
+    }
+
     register_drivers();
-    ds = GDALOpen(path, GA_ReadOnly);
+    ds = OGROpen(blocks_shp_path, FALSE, NULL);
     if (!ds) {
-        snprintf(msg, sizeof(msg), "gdal open failed: %s", path);
+        snprintf(msg, sizeof(msg), "ogr open failed: %s", blocks_shp_path);
         log_message("ERROR", msg, true);
         return NULL;
     }
 
-    GDALGetGeoTransform(ds, t);
-    xoff = (int)floor((bbox[0] - t[0]) / t[1]);
-    yoff = (int)floor((bbox[3] - t[3]) / t[5]);
-    xcount = (int)ceil((bbox[2] - bbox[0]) / t[1]);
-    ycount = (int)ceil((bbox[1] - bbox[3]) / t[5]);
+    bboxes = malloc((size_t)n * 4 * sizeof(double));
+    pairs = malloc((size_t)n * 2 * sizeof(int));
+    if (!bboxes || !pairs) {
+        snprintf(msg, sizeof(msg), "malloc failed for block envelopes");
+        log_message("ERROR", msg, true);
+        OGR_DS_Destroy(ds);
+        MPI_Abort(MPI_COMM_WORLD, 1);
+    }
+    for (i = 0; i < n; i++) {
+        pairs[2 * i] = ids[i];
+        pairs[2 * i + 1] = i;
+        bboxes[4 * i] = bboxes[4 * i + 1] = NAN;
+        bboxes[4 * i + 2] = bboxes[4 * i + 3] = NAN;
+    }
+    qsort(pairs, n, 2 * sizeof(int), cmp_id_pair);
 
-    rx = GDALGetRasterXSize(ds);
-    ry = GDALGetRasterYSize(ds);
-    if (xoff < 0) {
-        xcount += xoff;
-        xoff = 0;
+    layer = OGR_DS_GetLayer(ds, 0);
+    OGR_L_ResetReading(layer);
+    while ((feat = OGR_L_GetNextFeature(layer))) {
+        key[0] = OGR_F_GetFieldAsInteger(feat,
+                                         OGR_F_GetFieldIndex(feat, "ID"));
+        hit = bsearch(key, pairs, n, 2 * sizeof(int), cmp_id_pair);
+        if (hit && OGR_F_GetGeometryRef(feat)) {
+            OGR_G_GetEnvelope(OGR_F_GetGeometryRef(feat), &env);
+            /* duplicate ids in a list all share the envelope */
+            while (hit > pairs && hit[-2] == key[0])
+                hit -= 2;
+            for (; hit < pairs + 2 * n && hit[0] == key[0]; hit += 2) {
+                i = hit[1];
+                bboxes[4 * i] = env.MinX;
+                bboxes[4 * i + 1] = env.MinY;
+                bboxes[4 * i + 2] = env.MaxX;
+                bboxes[4 * i + 3] = env.MaxY;
+            }
+        }
+        OGR_F_Destroy(feat);
     }
-    if (yoff < 0) {
-        ycount += yoff;
-        yoff = 0;
+    OGR_DS_Destroy(ds);
+    free(pairs);
+    return bboxes;
+}
+
+/* log a failed window read of path; aborts when out of memory */
+static void report_read_error(int rc, const char *path)
+{
+    char msg[512];
+
+    if (rc == GCN10_ERR_NOMEM) {
+        snprintf(msg, sizeof(msg), "out of memory for raster %s", path);
+        log_message("ERROR", msg, true);
+        MPI_Abort(MPI_COMM_WORLD, 1);
     }
-    if (xoff >= rx || yoff >= ry || xcount <= 0 || ycount <= 0) {
+    if (rc == GCN10_ERR_BOUNDS) {
         snprintf(msg, sizeof(msg), "invalid raster bounds for %s", path);
         log_message("ERROR", msg, true);
-        GDALClose(ds);
+        return;
+    }
+    snprintf(msg, sizeof(msg), "read error on %s: %s", path,
+             gcn10_strerror(rc));
+    log_message("ERROR", msg, true);
+}
+
+/* load and clip raster window into the byte buffer of arena slot;
+ * res > 0 reads the window decimated to res degrees taking the majority
+ * class, which gdal serves from overviews when the file has them */
+uint8_t *load_raster(const char *path, const double *bbox, double res,
+                     int slot, int *xsize, int *ysize, double *gt,
+                     OGRSpatialReferenceH *srs)
+{
+    GDALDatasetH ds;
+    uint8_t *buf = NULL;
+    int win[6], rc;
+    char msg[512];
+
+    register_drivers();
+    ds = GDALOpen(path, GA_ReadOnly);
+    if (!ds) {
+        snprintf(msg, sizeof(msg), "gdal open failed: %s", path);
+        log_message("ERROR", msg, true);
         return NULL;
     }
-    if (xoff + xcount > rx) {
-        xcount = rx - xoff;
+
+    rc = gcn10_window(ds, bbox, res, win, gt);
+    if (rc == GCN10_OK) {
+        buf = arena_get(slot, (size_t)win[4] * win[5]);
+        if (!vrt_read_direct(path, win, buf))
+            rc = gcn10_read_window_into(ds, win, GRIORA_Mode, buf);
     }
-    if (yoff + ycount > ry) {
-        ycount = ry - yoff;
+    if (rc == GCN10_OK) {
+        *xsize = win[4];
+        *ysize = win[5];
+        *srs = OSRNewSpatialReference(GDALGetProjectionRef(ds));
     }
+    GDALClose(ds);
 
-    *xsize = xcount;
-    *ysize = ycount;
-    gt[0] = t[0] + xoff * t[1];
-    gt[1] = t[1];
-    gt[2] = t[2];
-    gt[3] = t[3] + yoff * t[5];
-    gt[4] = t[4];
-    gt[5] = t[5];
-
-    wkt = GDALGetProjectionRef(ds);
-    *srs = OSRNewSpatialReference(wkt);
+    if (rc != GCN10_OK) {
+        report_read_error(rc, path);
+        return NULL;
+    }
+    return buf;
+}
 
-    pixel_count = (size_t)xcount *ycount;
+/* load and clip raster window into float buffer, nodata as nan */
+float *load_raster_float(const char *path, const double *bbox, int *xsize,
+                         int *ysize, double *gt)
+{
+    GDALDatasetH ds;
+    float *buf;
+    int rc;
+    char msg[512];
 
-    buf = malloc(pixel_count);
-    if (!buf) {
-        snprintf(msg, sizeof(msg), "out of memory for raster %s", path);
+    register_drivers();
+    ds = GDALOpen(path, GA_ReadOnly);
+    if (!ds) {
+        snprintf(msg, sizeof(msg), "gdal open failed: %s", path);
         log_message("ERROR", msg, true);
-        GDALClose(ds);
-        MPI_Abort(MPI_COMM_WORLD, 1);
+        return NULL;
     }
 
-    err = GDALRasterIO(GDALGetRasterBand(ds, 1), GF_Read,
-                       xoff, yoff, xcount, ycount,
-                       buf, xcount, ycount, GDT_Byte, 0, 0);
+    rc = gcn10_read_window_float(ds, bbox, 0, &buf, xsize, ysize, gt);
     GDALClose(ds);
-    if (err != CE_None) {
-        snprintf(msg, sizeof(msg), "gdalrasterio error %d on %s", err, path);
-        log_message("ERROR", msg, true);
-        free(buf);
+
+    if (rc != GCN10_OK) {
+        report_read_error(rc, path);
         return NULL;
     }
-
     return buf;
 }
 
-/* save buffer as deflate-tiled geotiff */
-void
-save_raster(const uint8_t *data, int xsize, int ysize, const double *gt,
-            OGRSpatialReferenceH srs, const char *path)
+/* row band of the block being written; see set_output_band() */
+static int band_yoff = 0, band_full_ysize = 0;
+
+/* bands of one block processed by several ranks write their rows to
+ * part files instead, merged by merge_band_parts() at the end; records
+ * hold (path, part, yoff) per part and (requested, chosen, -1) for
+ * output names the first band chose differently from requested */
+static bool band_parts = false;
+struct part_record {
+    int yoff;
+    char *path, *part;
+};
+static struct part_record *part_recs = NULL;
+static int n_part_recs = 0;
+
+static void add_part_record(const char *path, const char *part, int yoff)
+{
+    struct part_record *r;
+
+    r = realloc(part_recs, (n_part_recs + 1) * sizeof(*r));
+    if (!r) {
+        log_message("ERROR", "malloc failed for part records", true);
+        MPI_Abort(MPI_COMM_WORLD, 1);
+    }
+    part_recs = r;
+    r += n_part_recs++;
+    r->yoff = yoff;
+    r->path = strdup(path);
+    r->part = strdup(part);
+    if (!r->path || !r->part) {
+        log_message("ERROR", "malloc failed for part records", true);
+        MPI_Abort(MPI_COMM_WORLD, 1);
+    }
+}
+
+/* rank that merges the parts of output path */
+static int part_owner(const char *path, int size)
+{
+    unsigned int h;
+
+    for (h = 2166136261u; *path; path++)
+        h = (h ^ (unsigned char)*path) * 16777619u;
+    return (int)(h % size);
+}
+
+/* bytes of record r packed as yoff, then path and part with their
+ * terminating nul */
+static size_t packed_size(const struct part_record *r)
+{
+    return sizeof(int) + strlen(r->path) + strlen(r->part) + 2;
+}
+
+/* send every part record to the rank that merges its output, keyed by
+ * the requested path so that a part and the name its first band chose
+ * meet there; returns the records received, which point into *buf */
+static struct part_record *exchange_part_records(int size, char **buf,
+                                                 int *n_recs)
+{
+    struct part_record *recs;
+    size_t *bytes, total;
+    int *counts, *displs, *rcounts, *rdispls, i, n;
+    char *out, *p, *end;
+
+    bytes = calloc(size, sizeof(size_t));
+    counts = malloc(4 * size * sizeof(int));
+    if (!bytes || !counts) {
+        log_message("ERROR", "malloc failed for part merge", true);
+        MPI_Abort(MPI_COMM_WORLD, 1);
+    }
+    displs = counts + size;
+    rcounts = displs + size;
+    rdispls = rcounts + size;
+
+    /* pack the records by owner */
+    for (i = 0; i < n_part_recs; i++)
+        bytes[part_owner(part_recs[i].path, size)] +=
+            packed_size(&part_recs[i]);
+    for (total = 0, i = 0; i < size; i++) {
+        if (total + bytes[i] > INT_MAX) {
+            log_message("ERROR", "too many part records to merge", true);
+            MPI_Abort(MPI_COMM_WORLD, 1);
+        }
+        displs[i] = (int)total;
+        counts[i] = 0;
+        total += bytes[i];
+    }
+    out = malloc(total ? total : 1);
+    if (!out) {
+        log_message("ERROR", "malloc failed for part merge", true);
+        MPI_Abort(MPI_COMM_WORLD, 1);
+    }
+    for (i = 0; i < n_part_recs; i++) {
+        n = part_owner(part_recs[i].path, size);
+        p = out + displs[n] + counts[n];
+        memcpy(p, &part_recs[i].yoff, sizeof(int));
+        p += sizeof(int);
+        strcpy(p, part_recs[i].path);
+        strcpy(p + strlen(part_recs[i].path) + 1, part_recs[i].part);
+        counts[n] += (int)packed_size(&part_recs[i]);
+    }
+
+    MPI_Alltoall(counts, 1, MPI_INT, rcounts, 1, MPI_INT, MPI_COMM_WORLD);
+    for (total = 0, i = 0; i < size; i++) {
+        if (total + rcounts[i] > INT_MAX) {
+            log_message("ERROR", "too many part records to merge", true);
+            MPI_Abort(MPI_COMM_WORLD, 1);
+        }
+        rdispls[i] = (int)total;
+        total += rcounts[i];
+    }
+    *buf = malloc(total ? total : 1);
+    if (!*buf) {
+        log_message("ERROR", "malloc failed for part merge", true);
+        MPI_Abort(MPI_COMM_WORLD, 1);
+    }
+    MPI_Alltoallv(out, counts, displs, MPI_BYTE, *buf, rcounts, rdispls,
+                  MPI_BYTE, MPI_COMM_WORLD);
+    free(out);
+    free(counts);
+    free(bytes);
+
+    /* unpack; the strings stay in buf */
+    recs = NULL;
+    n = 0;
+    for (p = *buf, end = *buf + total; p < end; n++) {
+        if (n % 64 == 0) {
+            struct part_record *r;
+
+            r = realloc(recs, (n + 64) * sizeof(*recs));
+            if (!r) {
+                log_message("ERROR", "malloc failed for part merge", true);
+                MPI_Abort(MPI_COMM_WORLD, 1);
+            }
+            recs = r;
+        }
+        memcpy(&recs[n].yoff, p, sizeof(int));
+        recs[n].path = p + sizeof(int);
+        recs[n].part = recs[n].path + strlen(recs[n].path) + 1;
+        p = recs[n].part + strlen(recs[n].part) + 1;
+    }
+    *n_recs = n;
+    return recs;
+}
+
+/* write later bands to part files (see band_parts) */
+void set_output_parts(bool on)
+{
+    band_parts = on;
+}
+
+/* note that the first band of a split block wrote requested as chosen */
+void note_output_path(const char *requested, const char *chosen)
+{
+    if (band_parts && strcmp(requested, chosen))
+        add_part_record(requested, chosen, -1);
+}
+
+/* while a block is processed in row bands, outputs are created at the
+ * full block height full_ysize by the band at yoff 0, and later bands
+ * write their rows into them at yoff; full_ysize 0 ends band mode */
+void set_output_band(int yoff, int full_ysize)
+{
+    band_yoff = yoff;
+    band_full_ysize = full_ysize;
+}
+
+/* row offset of the current band, 0 outside band mode; full_ysize
+ * receives the block height, 0 outside band mode */
+int output_band(int *full_ysize)
+{
+    *full_ysize = band_full_ysize;
+    return band_yoff;
+}
+
+/* write rows yoff.. of a single-band deflate-tiled geotiff of the given
+ * type and full_ysize rows (0 = ysize); the file is created when yoff
+ * is 0 and updated otherwise. nodata (may be null) is recorded on the
+ * band */
+static void
+write_geotiff_file(const void *data, GDALDataType type,
+                   const double *nodata, int xsize, int ysize,
+                   const double *gt, OGRSpatialReferenceH srs,
+                   const char *path, int yoff, int full_ysize)
 {
     GDALDriverH drv;
     GDALDatasetH ds;
     char **opts;
-    char *wkt;
+    char *wkt, part[PATH_MAX + 32];
     CPLErr err;
-    char msg[512];
+    char msg[PATH_MAX + 64];
 
     register_drivers();
+
+    /* bands from other ranks go to a part file of their own rows */
+    if (yoff > 0 && band_parts) {
+        snprintf(part, sizeof(part), "%s.%d.part", path, yoff);
+        add_part_record(path, part, yoff);
+        path = part;
+        yoff = 0;
+        full_ysize = 0;
+    }
+
+    /* later bands write into the file the first one created */
+    if (yoff > 0) {
+        ds = GDALOpen(path, GA_Update);
+        if (!ds) {
+            snprintf(msg, sizeof(msg), "cannot reopen %s", path);
+            log_message("ERROR", msg, true);
+            return;
+        }
+        err = GDALRasterIO(GDALGetRasterBand(ds, 1), GF_Write,
+                           0, yoff, xsize, ysize,
+                           (void *)data, xsize, ysize, type, 0, 0);
+        if (err != CE_None) {
+            snprintf(msg, sizeof(msg), "write error %d on %s", err, path);
+            log_message("ERROR", msg, true);
+        }
+        GDALClose(ds);
+        return;
+    }
+
     drv = GDALGetDriverByName("GTiff");
     opts = NULL;
     opts = CSLSetNameValue(opts, "COMPRESS", "DEFLATE");
     opts = CSLSetNameValue(opts, "TILED", "YES");
 
-    ds = GDALCreate(drv, path, xsize, ysize, 1, GDT_Byte, opts);
+    /* compressed size is unknown up front; large blocks may pass 4 gb */
+    opts = CSLSetNameValue(opts, "BIGTIFF", "IF_SAFER");
+    if (type == GDT_Float32)
+        opts = CSLSetNameValue(opts, "PREDICTOR", "3");
+
+    ds = GDALCreate(drv, path, xsize, full_ysize > ysize ? full_ysize : ysize,
+                    1, type, opts);
+    if (!ds) {
+        snprintf(msg, sizeof(msg), "cannot create %s", path);
+        log_message("ERROR", msg, true);
+        CSLDestroy(opts);
+        return;
+    }
     GDALSetGeoTransform(ds, (double *)gt);
 
     wkt = NULL;
     OSRExportToWkt(srs, &wkt);
     GDALSetProjection(ds, wkt);
     CPLFree(wkt);
+    if (nodata)
+        GDALSetRasterNoDataValue(GDALGetRasterBand(ds, 1), *nodata);
 
     err = GDALRasterIO(GDALGetRasterBand(ds, 1), GF_Write,
                        0, 0, xsize, ysize,
-                       (void *)data, xsize, ysize, GDT_Byte, 0, 0);
+                       (void *)data, xsize, ysize, type, 0, 0);
     if (err != CE_None) {
         snprintf(msg, sizeof(msg), "write error %d on %s", err, path);
         log_message("ERROR", msg, true);
@@ -225,3 +588,410 @@ save_raster(const uint8_t *data, int xsize, int ysize, const double *gt,
     GDALClose(ds);
     CSLDestroy(opts);
 }
+
+/* write_geotiff_file() as run_phase allows, timing the write:
+ * compute-only runs skip it, no-write runs encode the rows into a
+ * /vsimem/ file that is dropped at once */
+static void
+write_geotiff(const void *data, GDALDataType type, const double *nodata,
+              int xsize, int ysize, const double *gt,
+              OGRSpatialReferenceH srs, const char *path, int yoff,
+              int full_ysize)
+{
+    bool sink = run_phase != RUN_ALL && strncmp(path, "/vsimem/", 8);
+    double t0;
+
+    if (sink && run_phase != RUN_NOWRITE)
+        return;
+    t0 = MPI_Wtime();
+    if (sink) {
+        path = "/vsimem/gcn10_sink.tif";
+        yoff = 0;
+        full_ysize = 0;
+    }
+    write_geotiff_file(data, type, nodata, xsize, ysize, gt, srs, path,
+                       yoff, full_ysize);
+    if (sink)
+        VSIUnlink(path);
+    phase_add(PH_WRITE, MPI_Wtime() - t0,
+              (double)xsize * ysize * GDALGetDataTypeSizeBytes(type));
+}
+
+/* save buffer as deflate-tiled geotiff */
+void
+save_raster(const uint8_t *data, int xsize, int ysize, const double *gt,
+            OGRSpatialReferenceH srs, const char *path)
+{
+    write_geotiff(data, GDT_Byte, NULL, xsize, ysize, gt, srs, path,
+                  band_yoff, band_full_ysize);
+}
+
+/* copy every part file written by any rank into its block output and
+ * remove it; each output is merged by one rank, which alone receives
+ * its records. collective over MPI_COMM_WORLD, after all ranks
+ * finished writing */
+void merge_band_parts(int rank, int size)
+{
+    struct part_record *all;
+    int i, j, total, xs, ys;
+    const char *final;
+    GDALDatasetH src, dst;
+    GDALDataType type;
+    void *buf;
+    char *text, msg[2 * PATH_MAX + 64];
+
+    all = exchange_part_records(size, &text, &total);
+
+    register_drivers();
+    for (i = 0; i < total; i++) {
+        if (all[i].yoff < 0)
+            continue;
+
+        /* the output the first band actually wrote */
+        final = all[i].path;
+        for (j = 0; j < total; j++) {
+            if (all[j].yoff < 0 && !strcmp(all[j].path, final)) {
+                final = all[j].part;
+                break;
+            }
+        }
+
+        src = GDALOpen(all[i].part, GA_ReadOnly);
+        dst = GDALOpen(final, GA_Update);
+        if (!src || !dst) {
+            snprintf(msg, sizeof(msg), "cannot merge %s into %s",
+                     all[i].part, final);
+            log_message("ERROR", msg, true);
+            if (src)
+                GDALClose(src);
+            if (dst)
+                GDALClose(dst);
+            continue;
+        }
+        xs = GDALGetRasterXSize(src);
+        ys = GDALGetRasterYSize(src);
+        type = GDALGetRasterDataType(GDALGetRasterBand(src, 1));
+        buf = malloc((size_t)xs * ys * GDALGetDataTypeSizeBytes(type));
+        if (!buf) {
+            log_message("ERROR", "malloc failed for part merge", true);
+            MPI_Abort(MPI_COMM_WORLD, 1);
+        }
+        if (GDALRasterIO(GDALGetRasterBand(src, 1), GF_Read, 0, 0, xs, ys,
+                         buf, xs, ys, type, 0, 0) != CE_None ||
+            GDALRasterIO(GDALGetRasterBand(dst, 1), GF_Write, 0,
+                         all[i].yoff, xs, ys, buf, xs, ys, type, 0,
+                         0) != CE_None) {
+            snprintf(msg, sizeof(msg), "merge error on %s", final);
+            log_message("ERROR", msg, true);
+        }
+        free(buf);
+        GDALClose(src);
+        GDALClose(dst);
+        VSIUnlink(all[i].part);
+    }
+
+    free(all);
+    free(text);
+    for (i = 0; i < n_part_recs; i++) {
+        free(part_recs[i].path);
+        free(part_recs[i].part);
+    }
+    free(part_recs);
+    part_recs = NULL;
+    n_part_recs = 0;
+}
+
+/* save rows yoff.. of a byte geotiff of full_ysize rows, for outputs
+ * whose rows do not follow the block's (aggregated levels) */
+void
+save_raster_rows(const uint8_t *data, int xsize, int ysize, const double *gt,
+                 OGRSpatialReferenceH srs, const char *path, int yoff,
+                 int full_ysize)
+{
+    write_geotiff(data, GDT_Byte, NULL, xsize, ysize, gt, srs, path, yoff,
+                  full_ysize);
+}
+
+/* save float32 buffer as deflate-tiled geotiff with runoff nodata */
+void
+save_raster_float(const float *data, int xsize, int ysize, const double *gt,
+                  OGRSpatialReferenceH srs, const char *path)
+{
+    double nodata = GCN10_RUNOFF_NODATA;
+
+    write_geotiff(data, GDT_Float32, &nodata, xsize, ysize, gt, srs, path,
+                  band_yoff, band_full_ysize);
+}
+
+/* encode buffer as an in-memory deflate geotiff; returns a buffer
+ * owned by the caller (free with CPLFree) and its length in len */
+GByte *encode_geotiff(const uint8_t *data, int xsize, int ysize,
+                      const double *gt, OGRSpatialReferenceH srs,
+                      size_t *len)
+{
+    static int seq = 0;
+    char path[64];
+    vsi_l_offset n = 0;
+    GByte *buf;
+
+    snprintf(path, sizeof(path), "/vsimem/gcn10_encode_%d.tif", seq++);
+    save_raster(data, xsize, ysize, gt, srs, path);
+    buf = VSIGetMemFileBuffer(path, &n, TRUE);
+    VSIUnlink(path);
+    *len = (size_t)n;
+    return buf;
+}
+
+/* integral of the authalic latitude term: the area of a wgs84 cell
+ * between latitudes p0 and p1 that is dlon radians wide is
+ * b^2 * dlon * |q(p1) - q(p0)| */
+static double authalic_q(double lat, double e)
+{
+    double s = sin(lat * DEG2RAD);
+
+    return s / (2.0 * (1.0 - e * e * s * s)) +
+        log((1.0 + e * s) / (1.0 - e * s)) / (4.0 * e);
+}
+
+/* geodesic area (m^2) of a pixel of row y in a wgs84 grid gt */
+double geodesic_pixel_area(const double *gt, int y)
+{
+    double e, b, top, bottom;
+
+    e = sqrt(WGS84_F * (2.0 - WGS84_F));
+    b = WGS84_A * (1.0 - WGS84_F);
+    top = gt[3] + y * gt[5];
+    bottom = top + gt[5];
+    return b * b * fabs(gt[1]) * DEG2RAD *
+        fabs(authalic_q(top, e) - authalic_q(bottom, e));
+}
+
+/* points sampled along each block edge to find its output extent */
+#define WARP_EDGE_POINTS 21
+
+/* approximate transformer error in pixels, gdalwarp's default */
+#define WARP_MAX_ERROR 0.125
+
+/* resample n byte grids sharing one input grid (xsize x ysize, gt,
+ * srs) into arena slots[i] on an output_crs grid of output_res cells
+ * aligned to whole multiples of output_res, so blocks mosaic. every
+ * target pixel centre is mapped back to the nearest source pixel
+ * through gdal's approximate transformer, which interpolates the exact
+ * transform linearly along each row within WARP_MAX_ERROR; centres
+ * outside the input grid get nodata[i]. bufs, sizes, gt and srs are
+ * replaced in place */
+bool warp_to_output(uint8_t **bufs, const int *slots, const uint8_t *nodata,
+                    int n, int *xsize, int *ysize, double *gt,
+                    OGRSpatialReferenceH *srs)
+{
+    OGRSpatialReferenceH dst;
+    OGRCoordinateTransformationH ct;
+    char *src_wkt, *dst_wkt, msg[256];
+    double *px, *py, *pz, ext[4], ogt[6], res, f;
+    long long *idx, sx, sy;
+    int *ok, m, ox, oy, x, y, i, k;
+    void *gen, *approx;
+    uint8_t *out[ARENA_SLOTS];
+
+    dst = OSRNewSpatialReference(NULL);
+    OSRSetFromUserInput(dst, output_crs);
+    OSRSetAxisMappingStrategy(dst, OAMS_TRADITIONAL_GIS_ORDER);
+    OSRSetAxisMappingStrategy(*srs, OAMS_TRADITIONAL_GIS_ORDER);
+    ct = OCTNewCoordinateTransformation(*srs, dst);
+    if (!ct) {
+        snprintf(msg, sizeof(msg), "no transformation to %s", output_crs);
+        log_message("ERROR", msg, true);
+        OSRDestroySpatialReference(dst);
+        return false;
+    }
+
+    /* extent of the block outline in the output crs */
+    m = 4 * WARP_EDGE_POINTS;
+    px = malloc(m * sizeof(double));
+    py = malloc(m * sizeof(double));
+    if (!px || !py) {
+        log_message("ERROR", "malloc failed for block outline", true);
+        MPI_Abort(MPI_COMM_WORLD, 1);
+    }
+    for (k = 0; k < WARP_EDGE_POINTS; k++) {
+        f = (double)k / (WARP_EDGE_POINTS - 1);
+        px[4 * k] = px[4 * k + 1] = gt[0] + f * *xsize * gt[1];
+        py[4 * k] = gt[3];
+        py[4 * k + 1] = gt[3] + *ysize * gt[5];
+        px[4 * k + 2] = gt[0];
+        px[4 * k + 3] = gt[0] + *xsize * gt[1];
+        py[4 * k + 2] = py[4 * k + 3] = gt[3] + f * *ysize * gt[5];
+    }
+    k = OCTTransform(ct, m, px, py, NULL);
+    OCTDestroyCoordinateTransformation(ct);
+    if (!k) {
+        snprintf(msg, sizeof(msg), "block outline cannot be projected to %s",
+                 output_crs);
+        log_message("ERROR", msg, true);
+        free(px);
+        free(py);
+        OSRDestroySpatialReference(dst);
+        return false;
+    }
+    ext[0] = ext[2] = px[0];
+    ext[1] = ext[3] = py[0];
+    for (k = 1; k < m; k++) {
+        ext[0] = fmin(ext[0], px[k]);
+        ext[1] = fmin(ext[1], py[k]);
+        ext[2] = fmax(ext[2], px[k]);
+        ext[3] = fmax(ext[3], py[k]);
+    }
+    free(px);
+    free(py);
+
+    /* default cell: the native pixel height, in metres unless the
+     * output crs is geographic too */
+    res = output_res > 0 ? output_res :
+        OSRIsGeographic(dst) ? fabs(gt[5]) : fabs(gt[5]) * 111320.0;
+    ogt[0] = floor(ext[0] / res) * res;
+    ogt[1] = res;
+    ogt[2] = 0;
+    ogt[3] = ceil(ext[3] / res) * res;
+    ogt[4] = 0;
+    ogt[5] = -res;
+    if ((ceil(ext[2] / res) - floor(ext[0] / res)) *
+        (ceil(ext[3] / res) - floor(ext[1] / res)) > INT_MAX) {
+        snprintf(msg, sizeof(msg), "output grid in %s too large",
+                 output_crs);
+        log_message("ERROR", msg, true);
+        OSRDestroySpatialReference(dst);
+        return false;
+    }
+    ox = (int)(ceil(ext[2] / res) - floor(ext[0] / res));
+    oy = (int)(ceil(ext[3] / res) - floor(ext[1] / res));
+
+    OSRExportToWkt(*srs, &src_wkt);
+    OSRExportToWkt(dst, &dst_wkt);
+    gen = GDALCreateGenImgProjTransformer3(src_wkt, gt, dst_wkt, ogt);
+    CPLFree(src_wkt);
+    CPLFree(dst_wkt);
+    if (!gen) {
+        snprintf(msg, sizeof(msg), "cannot create transformer to %s",
+                 output_crs);
+        log_message("ERROR", msg, true);
+        OSRDestroySpatialReference(dst);
+        return false;
+    }
+    approx = GDALCreateApproxTransformer(GDALGenImgProjTransform, gen,
+                                         WARP_MAX_ERROR);
+
+    px = malloc(ox * sizeof(double));
+    py = malloc(ox * sizeof(double));
+    pz = malloc(ox * sizeof(double));
+    ok = malloc(ox * sizeof(int));
+    idx = malloc(ox * sizeof(long long));
+    if (!px || !py || !pz || !ok || !idx) {
+        log_message("ERROR", "malloc failed for output grid", true);
+        MPI_Abort(MPI_COMM_WORLD, 1);
+    }
+    for (i = 0; i < n; i++)
+        out[i] = arena_get(slots[i], (size_t)ox * oy);
+
+    /* source pixel of every target centre, shared by all grids */
+    for (y = 0; y < oy; y++) {
+        for (x = 0; x < ox; x++) {
+            px[x] = x + 0.5;
+            py[x] = y + 0.5;
+            pz[x] = 0;
+        }
+        if (!GDALApproxTransform(approx, TRUE, ox, px, py, pz, ok))
+            memset(ok, 0, ox * sizeof(int));
+        for (x = 0; x < ox; x++) {
+            sx = (long long)floor(px[x]);
+            sy = (long long)floor(py[x]);
+            idx[x] = ok[x] && sx >= 0 && sx < *xsize && sy >= 0 &&
+                sy < *ysize ? sy * *xsize + sx : -1;
+        }
+        for (i = 0; i < n; i++) {
+            uint8_t *row = out[i] + (size_t)y * ox;
+
+            for (x = 0; x < ox; x++)
+                row[x] = idx[x] < 0 ? nodata[i] : bufs[i][idx[x]];
+        }
+    }
+
+    GDALDestroyApproxTransformer(approx);
+    GDALDestroyGenImgProjTransformer(gen);
+    free(px);
+    free(py);
+    free(pz);
+    free(ok);
+    free(idx);
+
+    for (i = 0; i < n; i++)
+        bufs[i] = out[i];
+    *xsize = ox;
+    *ysize = oy;
+    memcpy(gt, ogt, sizeof(ogt));
+    OSRDestroySpatialReference(*srs);
+    *srs = dst;
+    return true;
+}
+
+/* write a byte virtual raster whose sources are composited in order;
+ * later sources overwrite earlier ones except where they hold their
+ * nodata value, and a lut remaps source values at read time */
+void
+write_vrt(const char *path, int xsize, int ysize, const double *gt,
+          OGRSpatialReferenceH srs, const struct vrt_source *srcs, int nsrc)
+{
+    FILE *f;
+    char *wkt, *esc;
+    char msg[512];
+    int i;
+
+    /* a split block's vrt is written once, at the full height; runs
+     * without writes skip vrts, which hold no pixels */
+    if (band_yoff > 0 || run_phase != RUN_ALL)
+        return;
+    if (band_full_ysize)
+        ysize = band_full_ysize;
+
+    f = fopen(path, "w");
+    if (!f) {
+        snprintf(msg, sizeof(msg), "cannot write vrt %s", path);
+        log_message("ERROR", msg, true);
+        return;
+    }
+
+    wkt = NULL;
+    OSRExportToWkt(srs, &wkt);
+    esc = CPLEscapeString(wkt ? wkt : "", -1, CPLES_XML);
+    CPLFree(wkt);
+
+    fprintf(f, "<VRTDataset rasterXSize=\"%d\" rasterYSize=\"%d\">\n",
+            xsize, ysize);
+    fprintf(f, "  <SRS>%s</SRS>\n", esc);
+    fprintf(f, "  <GeoTransform>%.17g, %.17g, %.17g, %.17g, %.17g, %.17g"
+            "</GeoTransform>\n", gt[0], gt[1], gt[2], gt[3], gt[4], gt[5]);
+    fprintf(f, "  <VRTRasterBand dataType=\"Byte\" band=\"1\">\n");
+    fprintf(f, "    <NoDataValue>255</NoDataValue>\n");
+    for (i = 0; i < nsrc; i++) {
+        fprintf(f, "    <ComplexSource>\n");
+        fprintf(f, "      <SourceFilename relativeToVRT=\"1\">%s"
+                "</SourceFilename>\n", srcs[i].path);
+        fprintf(f, "      <SourceBand>1</SourceBand>\n");
+        fprintf(f, "      <SrcRect xOff=\"0\" yOff=\"0\" xSize=\"%d\" "
+                "ySize=\"%d\"/>\n", xsize, ysize);
+        fprintf(f, "      <DstRect xOff=\"0\" yOff=\"0\" xSize=\"%d\" "
+                "ySize=\"%d\"/>\n", xsize, ysize);
+        if (srcs[i].nodata >= 0)
+            fprintf(f, "      <NODATA>%d</NODATA>\n", srcs[i].nodata);
+        if (srcs[i].lut)
+            fprintf(f, "      <LUT>%s</LUT>\n", srcs[i].lut);
+        fprintf(f, "    </ComplexSource>\n");
+    }
+    fprintf(f, "  </VRTRasterBand>\n");
+    fprintf(f, "</VRTDataset>\n");
+
+    CPLFree(esc);
+    if (fclose(f) != 0) {
+        snprintf(msg, sizeof(msg), "write error on vrt %s", path);
+        log_message("ERROR", msg, true);
+    }
+}
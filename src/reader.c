@@ -0,0 +1,309 @@
+/* raster window reads: clip a bbox to a dataset's pixel grid and
+ * read it as bytes, optionally at a coarser target resolution */
+
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include "compat.h"
+#include "gcn10.h"
+
+/* bbox edges this close to a pixel edge (in pixels) are taken to lie
+ * on it, so grid-aligned blocks map to exactly their own pixels */
+#define EDGE_EPS 1e-6
+
+static int floor_edge(double v)
+{
+    double r = floor(v + 0.5);
+
+    return fabs(v - r) < EDGE_EPS ? (int)r : (int)floor(v);
+}
+
+static int ceil_edge(double v)
+{
+    double r = floor(v + 0.5);
+
+    return fabs(v - r) < EDGE_EPS ? (int)r : (int)ceil(v);
+}
+
+/* clip bbox (minx, miny, maxx, maxy) to the pixel grid of ds;
+ * win receives xoff, yoff, xcount, ycount of the source window and
+ * the buffer size it is read into, which is smaller than the window
+ * when res > 0 is coarser than the native pixel size; gt receives
+ * the geotransform of the buffer. a coarser res snaps the buffer to
+ * whole res cells of a global grid anchored at (-180, 90), so every
+ * block shares one output grid of exactly res; cells that would
+ * reach past the raster edge are left out */
+int
+gcn10_window(GDALDatasetH ds, const double *bbox, double res, int *win,
+             double *gt)
+{
+    double t[6];
+    double x0, x1, y0, y1;
+    int xoff, yoff, xcount, ycount, rx, ry, c0, c1, r0, r1;
+
+    if (GDALGetGeoTransform(ds, t) != CE_None)
+        return GCN10_ERR_READ;
+    xoff = floor_edge((bbox[0] - t[0]) / t[1]);
+    yoff = floor_edge((bbox[3] - t[3]) / t[5]);
+    xcount = ceil_edge((bbox[2] - bbox[0]) / t[1]);
+    ycount = ceil_edge((bbox[1] - bbox[3]) / t[5]);
+
+    rx = GDALGetRasterXSize(ds);
+    ry = GDALGetRasterYSize(ds);
+    if (xoff < 0) {
+        xcount += xoff;
+        xoff = 0;
+    }
+    if (yoff < 0) {
+        ycount += yoff;
+        yoff = 0;
+    }
+    if (xoff >= rx || yoff >= ry || xcount <= 0 || ycount <= 0)
+        return GCN10_ERR_BOUNDS;
+    if (xoff + xcount > rx) {
+        xcount = rx - xoff;
+    }
+    if (yoff + ycount > ry) {
+        ycount = ry - yoff;
+    }
+
+    win[0] = xoff;
+    win[1] = yoff;
+    win[2] = xcount;
+    win[3] = ycount;
+    win[4] = xcount;
+    win[5] = ycount;
+    gt[0] = t[0] + xoff * t[1];
+    gt[1] = t[1];
+    gt[2] = t[2];
+    gt[3] = t[3] + yoff * t[5];
+    gt[4] = t[4];
+    gt[5] = t[5];
+
+    if (res > 0 && res > t[1]) {
+        /* grid cells covering the clipped window, pulled in to those
+         * wholly inside the raster */
+        x0 = gt[0];
+        x1 = gt[0] + xcount * t[1];
+        y0 = gt[3];
+        y1 = gt[3] + ycount * t[5];
+        c0 = floor_edge((x0 + 180.0) / res);
+        c1 = ceil_edge((x1 + 180.0) / res);
+        r0 = floor_edge((90.0 - y0) / res);
+        r1 = ceil_edge((90.0 - y1) / res);
+        if (floor_edge((-180.0 + c0 * res - t[0]) / t[1]) < 0)
+            c0++;
+        if (ceil_edge((-180.0 + c1 * res - t[0]) / t[1]) > rx)
+            c1--;
+        if (floor_edge((90.0 - r0 * res - t[3]) / t[5]) < 0)
+            r0++;
+        if (ceil_edge((90.0 - r1 * res - t[3]) / t[5]) > ry)
+            r1--;
+        if (c1 <= c0 || r1 <= r0)
+            return GCN10_ERR_BOUNDS;
+
+        /* the source window spans those cells, to the nearest pixel */
+        xoff = floor_edge((-180.0 + c0 * res - t[0]) / t[1]);
+        yoff = floor_edge((90.0 - r0 * res - t[3]) / t[5]);
+        win[0] = xoff;
+        win[1] = yoff;
+        win[2] = ceil_edge((-180.0 + c1 * res - t[0]) / t[1]) - xoff;
+        win[3] = ceil_edge((90.0 - r1 * res - t[3]) / t[5]) - yoff;
+        win[4] = c1 - c0;
+        win[5] = r1 - r0;
+        gt[0] = -180.0 + c0 * res;
+        gt[1] = res;
+        gt[3] = 90.0 - r0 * res;
+        gt[5] = -res;
+    }
+    return GCN10_OK;
+}
+
+/* read window win (from gcn10_window) of band 1 as type into buf */
+static int
+read_win(GDALDatasetH ds, const int *win, GDALRIOResampleAlg alg,
+         GDALDataType type, void *buf)
+{
+    GDALRasterIOExtraArg arg;
+
+    /* a decimated read lets gdal serve the window from the nearest
+     * finer overview instead of the full resolution data */
+    INIT_RASTERIO_EXTRA_ARG(arg);
+    arg.eResampleAlg = alg;
+    if (GDALRasterIOEx(GDALGetRasterBand(ds, 1), GF_Read,
+                       win[0], win[1], win[2], win[3],
+                       buf, win[4], win[5], type, 0, 0, &arg) != CE_None)
+        return GCN10_ERR_READ;
+    return GCN10_OK;
+}
+
+/* read the bbox window of band 1 as type into a newly allocated buffer
+ * of elsize-byte pixels, decimated to res with alg when res > 0 */
+static int
+read_window(GDALDatasetH ds, const double *bbox, double res,
+            GDALRIOResampleAlg alg, GDALDataType type, size_t elsize,
+            void **buf, int *xsize, int *ysize, double *gt)
+{
+    int win[6], rc;
+    void *b;
+
+    *buf = NULL;
+    rc = gcn10_window(ds, bbox, res, win, gt);
+    if (rc != GCN10_OK)
+        return rc;
+
+    b = malloc((size_t)win[4] * win[5] * elsize);
+    if (!b)
+        return GCN10_ERR_NOMEM;
+    rc = read_win(ds, win, alg, type, b);
+    if (rc != GCN10_OK) {
+        free(b);
+        return rc;
+    }
+
+    *buf = b;
+    *xsize = win[4];
+    *ysize = win[5];
+    return GCN10_OK;
+}
+
+/* read a window computed by gcn10_window into the caller's buffer of
+ * win[4] * win[5] bytes, for callers that reuse their buffers */
+int
+gcn10_read_window_into(GDALDatasetH ds, const int *win,
+                       GDALRIOResampleAlg alg, uint8_t *buf)
+{
+    return read_win(ds, win, alg, GDT_Byte, buf);
+}
+
+/* read the bbox window of band 1 into a newly allocated byte buffer;
+ * res > 0 reads it decimated to that pixel size (nearest neighbour),
+ * otherwise at native resolution */
+int
+gcn10_read_window(GDALDatasetH ds, const double *bbox, double res,
+                  uint8_t **buf, int *xsize, int *ysize, double *gt)
+{
+    void *b;
+    int rc;
+
+    rc = read_window(ds, bbox, res, GRIORA_NearestNeighbour, GDT_Byte, 1,
+                     &b, xsize, ysize, gt);
+    *buf = b;
+    return rc;
+}
+
+/* as gcn10_read_window, decimating with alg, e.g. GRIORA_Mode for a
+ * majority read of categorical data */
+int
+gcn10_read_window_alg(GDALDatasetH ds, const double *bbox, double res,
+                      GDALRIOResampleAlg alg, uint8_t **buf, int *xsize,
+                      int *ysize, double *gt)
+{
+    void *b;
+    int rc;
+
+    rc = read_window(ds, bbox, res, alg, GDT_Byte, 1, &b, xsize, ysize, gt);
+    *buf = b;
+    return rc;
+}
+
+/* as gcn10_read_window, as float32; the band nodata value is
+ * returned as nan */
+int
+gcn10_read_window_float(GDALDatasetH ds, const double *bbox, double res,
+                        float **buf, int *xsize, int *ysize, double *gt)
+{
+    void *b;
+    float *f, nd;
+    size_t i, n;
+    int rc, has_nd;
+    double ndv;
+
+    rc = read_window(ds, bbox, res, GRIORA_NearestNeighbour, GDT_Float32,
+                     sizeof(float), &b, xsize, ysize, gt);
+    *buf = b;
+    if (rc != GCN10_OK)
+        return rc;
+
+    ndv = GDALGetRasterNoDataValue(GDALGetRasterBand(ds, 1), &has_nd);
+    if (has_nd && !isnan(ndv)) {
+        f = b;
+        nd = (float)ndv;
+        n = (size_t)*xsize * *ysize;
+        for (i = 0; i < n; i++) {
+            if (f[i] == nd)
+                f[i] = NAN;
+        }
+    }
+    return GCN10_OK;
+}
+
+/* read band 1 sampled on an explicit north-up grid (gt, xsize x ysize)
+ * into buf using alg; pixels whose centres fall outside the raster
+ * are set to GCN10_NODATA */
+int
+gcn10_read_grid(GDALDatasetH ds, const double *gt, int xsize, int ysize,
+                GDALRIOResampleAlg alg, uint8_t *buf)
+{
+    GDALRasterIOExtraArg arg;
+    double t[6], fx0, fy0, sxp, syp, dx0, dy0, dxs, dys;
+    int rx, ry, bx0, by0, bx1, by1, nx0, ny0, nxs, nys;
+    CPLErr err;
+
+    if (xsize <= 0 || ysize <= 0)
+        return GCN10_ERR_ARG;
+    if (GDALGetGeoTransform(ds, t) != CE_None)
+        return GCN10_ERR_READ;
+    rx = GDALGetRasterXSize(ds);
+    ry = GDALGetRasterYSize(ds);
+    memset(buf, GCN10_NODATA, (size_t)xsize * ysize);
+
+    /* grid origin and pixel size in source pixel coordinates */
+    fx0 = (gt[0] - t[0]) / t[1];
+    fy0 = (gt[3] - t[3]) / t[5];
+    sxp = gt[1] / t[1];
+    syp = gt[5] / t[5];
+
+    /* buffer pixels whose centres lie inside the raster */
+    bx0 = (int)ceil((0 - fx0) / sxp - 0.5);
+    bx1 = (int)floor((rx - fx0) / sxp - 0.5);
+    by0 = (int)ceil((0 - fy0) / syp - 0.5);
+    by1 = (int)floor((ry - fy0) / syp - 0.5);
+    bx0 = bx0 < 0 ? 0 : bx0;
+    by0 = by0 < 0 ? 0 : by0;
+    bx1 = bx1 >= xsize ? xsize - 1 : bx1;
+    by1 = by1 >= ysize ? ysize - 1 : by1;
+    if (bx1 < bx0 || by1 < by0)
+        return GCN10_OK;
+
+    /* matching floating-point source window, clamped to the raster */
+    dx0 = fx0 + bx0 * sxp;
+    dy0 = fy0 + by0 * syp;
+    dxs = (bx1 - bx0 + 1) * sxp;
+    dys = (by1 - by0 + 1) * syp;
+    dx0 = dx0 < 0 ? 0 : dx0;
+    dy0 = dy0 < 0 ? 0 : dy0;
+    dxs = dx0 + dxs > rx ? rx - dx0 : dxs;
+    dys = dy0 + dys > ry ? ry - dy0 : dys;
+
+    nx0 = (int)floor(dx0);
+    ny0 = (int)floor(dy0);
+    nxs = (int)ceil(dx0 + dxs) - nx0;
+    nys = (int)ceil(dy0 + dys) - ny0;
+    nxs = nxs < 1 ? 1 : (nx0 + nxs > rx ? rx - nx0 : nxs);
+    nys = nys < 1 ? 1 : (ny0 + nys > ry ? ry - ny0 : nys);
+
+    INIT_RASTERIO_EXTRA_ARG(arg);
+    arg.eResampleAlg = alg;
+    arg.bFloatingPointWindowValidity = TRUE;
+    arg.dfXOff = dx0;
+    arg.dfYOff = dy0;
+    arg.dfXSize = dxs;
+    arg.dfYSize = dys;
+    err = GDALRasterIOEx(GDALGetRasterBand(ds, 1), GF_Read,
+                         nx0, ny0, nxs, nys,
+                         buf + (size_t)by0 * xsize + bx0,
+                         bx1 - bx0 + 1, by1 - by0 + 1, GDT_Byte,
+                         1, (GSpacing)xsize, &arg);
+    return err == CE_None ? GCN10_OK : GCN10_ERR_READ;
+}
@@ -0,0 +1,430 @@
+/* block scheduling: optional hilbert-curve ordering of block envelopes,
+ * assignment of blocks to ranks, and input-tile locality accounting */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+#include "global.h"
+
+/* hilbert grid resolution per axis (2^16 cells over the globe) */
+#define HILBERT_ORDER 16
+
+/* number of recently touched input tiles remembered per source;
+ * approximates what a rank keeps warm in the gdal block cache
+ * and the os page cache between consecutive blocks */
+#define LOC_LRU 32
+
+/* per-source locality state */
+static long long loc_keys[LOC_SOURCES][LOC_LRU];
+static int loc_used[LOC_SOURCES];
+static long long loc_hits[LOC_SOURCES];
+static long long loc_lookups[LOC_SOURCES];
+
+/* most row parts a tail block is split into */
+#define TAIL_MAX_PARTS 16
+
+/* least height of a part: a 256-row geotiff tile of the 1/12000
+ * degree esa grid */
+#define TAIL_MIN_PART_DEG (256.0 / 12000.0)
+
+/* sort item for ordering */
+struct hilbert_item {
+    unsigned long long key;
+    int pos;
+    int id;
+};
+
+/* map cell (x, y) on a 2^order grid to its distance along the curve */
+static unsigned long long hilbert_d(unsigned int x, unsigned int y,
+                                    int order)
+{
+    unsigned long long d = 0;
+    unsigned int n = 1u << order;
+    unsigned int s, rx, ry, t;
+
+    for (s = n / 2; s > 0; s /= 2) {
+        rx = (x & s) > 0;
+        ry = (y & s) > 0;
+        d += (unsigned long long)s * s * ((3 * rx) ^ ry);
+        /* rotate quadrant */
+        if (ry == 0) {
+            if (rx == 1) {
+                x = n - 1 - x;
+                y = n - 1 - y;
+            }
+            t = x;
+            x = y;
+            y = t;
+        }
+    }
+    return d;
+}
+
+/* compare by curve distance, then by original position */
+static int cmp_hilbert(const void *a, const void *b)
+{
+    const struct hilbert_item *ia = a, *ib = b;
+
+    if (ia->key != ib->key)
+        return ia->key < ib->key ? -1 : 1;
+    return ia->pos - ib->pos;
+}
+
+/* reorder block ids (and their bboxes) along a hilbert curve through
+ * the envelope centres; blocks without an envelope (nan bbox) keep
+ * their relative order at the end of the list */
+void order_blocks_hilbert(int *ids, double *bboxes, int n)
+{
+    struct hilbert_item *items;
+    double *tmp;
+    unsigned int cells = 1u << HILBERT_ORDER;
+    int i;
+
+    if (n < 2)
+        return;
+
+    items = malloc((size_t)n * sizeof(*items));
+    tmp = malloc((size_t)n * 4 * sizeof(double));
+    if (!items || !tmp) {
+        log_message("ERROR", "malloc failed for hilbert ordering", true);
+        MPI_Abort(MPI_COMM_WORLD, 1);
+    }
+
+    for (i = 0; i < n; i++) {
+        const double *b = bboxes + 4 * (size_t)i;
+        double cx = 0.5 * (b[0] + b[2]);
+        double cy = 0.5 * (b[1] + b[3]);
+
+        items[i].pos = i;
+        items[i].id = ids[i];
+        if (isnan(cx) || isnan(cy)) {
+            items[i].key = ~0ULL;
+            continue;
+        }
+        /* normalize lon/lat to the curve grid */
+        cx = (cx + 180.0) / 360.0 * cells;
+        cy = (cy + 90.0) / 180.0 * cells;
+        cx = cx < 0 ? 0 : (cx >= cells ? cells - 1 : cx);
+        cy = cy < 0 ? 0 : (cy >= cells ? cells - 1 : cy);
+        items[i].key = hilbert_d((unsigned int)cx, (unsigned int)cy,
+                                 HILBERT_ORDER);
+    }
+
+    qsort(items, n, sizeof(*items), cmp_hilbert);
+
+    memcpy(tmp, bboxes, (size_t)n * 4 * sizeof(double));
+    for (i = 0; i < n; i++) {
+        ids[i] = items[i].id;
+        memcpy(bboxes + 4 * (size_t)i, tmp + 4 * (size_t)items[i].pos,
+               4 * sizeof(double));
+    }
+
+    free(tmp);
+    free(items);
+}
+
+/* number of blocks rank r processes out of n;
+ * list order deals blocks round robin, hilbert order hands each rank
+ * one contiguous run so neighbouring blocks stay on the same rank
+ * (and, with the usual consecutive rank placement, the same node) */
+int sched_count_for_rank(int r, int size, int n)
+{
+    if (n <= 0)
+        return 0;
+    if (use_hilbert_order) {
+        long long lo = (long long)n * r / size;
+        long long hi = (long long)n * (r + 1) / size;
+
+        return (int)(hi - lo);
+    }
+    if (r >= n)
+        return 0;
+    return 1 + (n - 1 - r) / size;
+}
+
+/* index into the block list of the k-th block of rank r */
+int sched_block_index(int r, int size, int n, int k)
+{
+    if (use_hilbert_order)
+        return (int)((long long)n * r / size) + k;
+    return r + k * size;
+}
+
+/* approximate area of a block envelope, for ranking; 0 if unknown */
+static double bbox_area(const double *b)
+{
+    if (isnan(b[0]) || isnan(b[1]))
+        return 0;
+    return (b[2] - b[0]) * (b[3] - b[1]) *
+        cos(0.5 * (b[1] + b[3]) * (3.14159265358979323846 / 180.0));
+}
+
+static int cmp_double(const void *a, const void *b)
+{
+    double x = *(const double *)a, y = *(const double *)b;
+
+    return (x > y) - (x < y);
+}
+
+/* true if a tail block of area a is split, given the median tail
+ * area m; strict once some blocks are larger than the median, beyond
+ * the rounding of equal envelopes */
+static bool tail_large(double a, double m, bool strict)
+{
+    return a > 0 && (strict ? a > m * (1 + 1e-9) : a >= m * (1 - 1e-9));
+}
+
+/* tail item sort: larger blocks first, parts in order */
+static double *tail_area;
+
+static int cmp_tail(const void *a, const void *b)
+{
+    const struct work_item *ia = a, *ib = b;
+    double x = tail_area[ia->block], y = tail_area[ib->block];
+
+    if (x != y)
+        return x < y ? 1 : -1;
+    if (ia->block != ib->block)
+        return ia->block - ib->block;
+    return ia->part - ib->part;
+}
+
+/* build the dynamic work list over blocks ids (envelopes bboxes, in
+ * processing order). the last size blocks are the tail, where ranks
+ * would start to idle: its blocks larger than the median tail block
+ * (as large, when none is larger) are split into row parts that idle
+ * ranks process at once, and the tail is handed out largest first.
+ * items[].block indexes ids; n_body receives the number of whole
+ * blocks ahead of the tail */
+struct work_item *sched_build_items(const double *bboxes, int n, int size,
+                                    int *n_items, int *n_body)
+{
+    struct work_item *items;
+    double *areas, median, height;
+    int n_tail, n_large, parts, i, k, p, np;
+    bool strict;
+
+    areas = malloc((size_t)n * 2 * sizeof(double));
+    items = malloc(((size_t)n + (size_t)size * TAIL_MAX_PARTS) *
+                   sizeof(*items));
+    if (!areas || !items) {
+        log_message("ERROR", "malloc failed for work items", true);
+        MPI_Abort(MPI_COMM_WORLD, 1);
+    }
+    n_tail = n < size ? n : size;
+    *n_body = n - n_tail;
+    for (i = 0; i < n; i++)
+        areas[i] = bbox_area(bboxes + 4 * (size_t)i);
+    memcpy(areas + n, areas + *n_body, (size_t)n_tail * sizeof(double));
+    qsort(areas + n, n_tail, sizeof(double), cmp_double);
+    median = n_tail ? areas[n + n_tail / 2] : 0;
+    strict = true;
+    for (n_large = 0, i = *n_body; i < n; i++)
+        n_large += tail_large(areas[i], median, strict);
+    if (!n_large) {
+        strict = false;
+        for (i = *n_body; i < n; i++)
+            n_large += tail_large(areas[i], median, strict);
+    }
+
+    /* ranks finish the small tail blocks at about the time the large
+     * ones would start to hold them up, so all ranks share the large
+     * ones */
+    parts = n_large ? size / n_large : 1;
+    parts = parts < 1 ? 1 : parts > TAIL_MAX_PARTS ? TAIL_MAX_PARTS : parts;
+
+    for (k = 0; k < *n_body; k++) {
+        items[k].block = k;
+        items[k].part = 0;
+        items[k].n_parts = 1;
+    }
+    for (i = *n_body; i < n; i++) {
+        np = tail_large(areas[i], median, strict) ? parts : 1;
+
+        /* no part thinner than a tile of rows */
+        height = bboxes[4 * (size_t)i + 3] - bboxes[4 * (size_t)i + 1];
+        if (np > 1 && np > height / TAIL_MIN_PART_DEG)
+            np = height >= 2 * TAIL_MIN_PART_DEG ?
+                (int)(height / TAIL_MIN_PART_DEG) : 1;
+        for (p = 0; p < np; p++, k++) {
+            items[k].block = i;
+            items[k].part = p;
+            items[k].n_parts = np;
+        }
+    }
+    tail_area = areas;
+    qsort(items + *n_body, k - *n_body, sizeof(*items), cmp_tail);
+    tail_area = NULL;
+
+    free(areas);
+    *n_items = k;
+    return items;
+}
+
+/* dynamic schedule: two counters on rank 0, the next body item and
+ * the next tail item; body items are claimed in chunks so a rank keeps
+ * runs of neighbouring blocks, tail items one at a time */
+static MPI_Win sched_win = MPI_WIN_NULL;
+static int *sched_counters = NULL;
+static int sched_n_items, sched_n_body, sched_chunk;
+static int sched_pos, sched_end;
+static bool sched_body_done;
+
+/* set up the counters; collective over MPI_COMM_WORLD */
+void sched_dynamic_init(int n_items, int n_body, int size)
+{
+    int rank;
+
+    MPI_Comm_rank(MPI_COMM_WORLD, &rank);
+    MPI_Win_allocate(rank == 0 ? 2 * sizeof(int) : 0, sizeof(int),
+                     MPI_INFO_NULL, MPI_COMM_WORLD, &sched_counters,
+                     &sched_win);
+    if (rank == 0) {
+        MPI_Win_lock(MPI_LOCK_EXCLUSIVE, 0, 0, sched_win);
+        sched_counters[0] = sched_counters[1] = 0;
+        MPI_Win_unlock(0, sched_win);
+    }
+    MPI_Barrier(MPI_COMM_WORLD);
+    MPI_Win_lock_all(0, sched_win);
+
+    sched_n_items = n_items;
+    sched_n_body = n_body;
+    sched_chunk = n_body / (4 * size);
+    sched_chunk = sched_chunk < 1 ? 1 : sched_chunk;
+    sched_pos = sched_end = 0;
+    sched_body_done = n_body == 0;
+}
+
+/* claim the next body item; false once the body is used up, leaving
+ * the tail alone */
+bool sched_next_body(int *item)
+{
+    int inc, start;
+
+    if (sched_pos < sched_end) {
+        *item = sched_pos++;
+        return true;
+    }
+    if (!sched_body_done) {
+        inc = sched_chunk;
+        MPI_Fetch_and_op(&inc, &start, MPI_INT, 0, 0, MPI_SUM, sched_win);
+        MPI_Win_flush(0, sched_win);
+        if (start < sched_n_body) {
+            sched_pos = start;
+            sched_end = start + sched_chunk < sched_n_body ?
+                start + sched_chunk : sched_n_body;
+            *item = sched_pos++;
+            return true;
+        }
+        sched_body_done = true;
+    }
+    return false;
+}
+
+/* claim the next work item, body first; false when none are left */
+bool sched_next(int *item)
+{
+    int inc, start;
+
+    if (sched_next_body(item))
+        return true;
+    inc = 1;
+    MPI_Fetch_and_op(&inc, &start, MPI_INT, 0, 1, MPI_SUM, sched_win);
+    MPI_Win_flush(0, sched_win);
+    if (sched_n_body + start < sched_n_items) {
+        *item = sched_n_body + start;
+        return true;
+    }
+    return false;
+}
+
+/* release the counters; collective */
+void sched_dynamic_finalize(void)
+{
+    MPI_Win_unlock_all(sched_win);
+    MPI_Win_free(&sched_win);
+    sched_counters = NULL;
+}
+
+/* record that a block touched the input tiles of a source covering bbox;
+ * tiles are tile_deg x tile_deg cells counted from the source's top
+ * left corner (ox, oy), and count as hits when this rank touched them
+ * within its last LOC_LRU distinct tiles. this simulates a small tile
+ * cache; it does not observe gdal's block cache or the page cache */
+void locality_note(int src, const double *bbox, double tile_deg, double ox,
+                   double oy)
+{
+    int tx0, tx1, ty0, ty1, tx, ty, j;
+
+    if (src < 0 || src >= LOC_SOURCES || tile_deg <= 0)
+        return;
+
+    tx0 = (int)floor((bbox[0] - ox) / tile_deg);
+    tx1 = (int)floor((bbox[2] - ox) / tile_deg - 1e-9);
+    ty0 = (int)floor((oy - bbox[3]) / tile_deg);
+    ty1 = (int)floor((oy - bbox[1]) / tile_deg - 1e-9);
+
+    for (ty = ty0; ty <= ty1; ty++) {
+        for (tx = tx0; tx <= tx1; tx++) {
+            long long key = (long long)ty * 1000000LL + tx;
+
+            loc_lookups[src]++;
+            for (j = 0; j < loc_used[src]; j++) {
+                if (loc_keys[src][j] == key)
+                    break;
+            }
+            if (j < loc_used[src]) {
+                loc_hits[src]++;
+            }
+            else {
+                if (loc_used[src] < LOC_LRU)
+                    loc_used[src]++;
+                j = loc_used[src] - 1;
+            }
+            /* move to front */
+            memmove(&loc_keys[src][1], &loc_keys[src][0],
+                    (size_t)j * sizeof(long long));
+            loc_keys[src][0] = key;
+        }
+    }
+}
+
+/* log per-rank and job-wide hit rates of the simulated tile cache;
+ * collective over MPI_COMM_WORLD */
+void locality_report(int rank)
+{
+    static const char *names[LOC_SOURCES] = { "esa", "hysogs" };
+    long long local[2 * LOC_SOURCES], total[2 * LOC_SOURCES];
+    char msg[512];
+    int s;
+
+    for (s = 0; s < LOC_SOURCES; s++) {
+        local[2 * s] = loc_hits[s];
+        local[2 * s + 1] = loc_lookups[s];
+        snprintf(msg, sizeof(msg),
+                 "locality: %s tile hits %lld / %lld (%.1f%%) in a "
+                 "simulated %d-tile lru", names[s], loc_hits[s],
+                 loc_lookups[s],
+                 loc_lookups[s] ? 100.0 * loc_hits[s] / loc_lookups[s] : 0.0,
+                 LOC_LRU);
+        log_message("INFO", msg, false);
+    }
+
+    MPI_Reduce(local, total, 2 * LOC_SOURCES, MPI_LONG_LONG, MPI_SUM, 0,
+               MPI_COMM_WORLD);
+
+    if (rank == 0) {
+        for (s = 0; s < LOC_SOURCES; s++) {
+            snprintf(msg, sizeof(msg),
+                     "locality (%s order): %s tile hit rate %.1f%% "
+                     "(%lld / %lld) in a simulated %d-tile lru per rank, "
+                     "not measured gdal or page cache hits",
+                     use_hilbert_order ? "hilbert" : "list", names[s],
+                     total[2 * s + 1] ?
+                     100.0 * total[2 * s] / total[2 * s + 1] : 0.0,
+                     total[2 * s], total[2 * s + 1], LOC_LRU);
+            log_message("INFO", msg, true);
+        }
+    }
+}
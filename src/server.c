@@ -0,0 +1,546 @@
+/* on-demand cn tile server: answers local http requests for
+ * worldcrs84quad tiles or bbox windows of any scenario, computed with
+ * libgcn10 and kept in an in-memory lru cache of encoded geotiffs */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <signal.h>
+#include <errno.h>
+#include "global.h"
+#include "gcn10.h"
+
+#ifndef _WIN32
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <poll.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+/* tile size in pixels for worldcrs84quad tiles */
+#define TILE_PX 256
+
+/* latency samples kept for percentiles */
+#define LAT_SAMPLES 8192
+
+/* hash buckets of the tile cache */
+#define CACHE_BUCKETS 4096
+
+/* seconds a client gets to send its request head, and per send of the
+ * response, before the connection is dropped */
+#define REQUEST_TIMEOUT 5.0
+
+/* cached encoded response */
+struct tile_entry {
+    char *key;
+    unsigned long long hash;
+    GByte *data;
+    size_t len;
+    struct tile_entry *prev, *next;     /* lru list, most recent first */
+    struct tile_entry *chain;           /* bucket chain */
+};
+
+static struct tile_entry *buckets[CACHE_BUCKETS];
+static struct tile_entry *lru_head = NULL, *lru_tail = NULL;
+static size_t cache_bytes = 0;
+static long long n_requests = 0, n_hits = 0, n_errors = 0;
+static double lat_ms[LAT_SAMPLES];
+static int lat_count = 0;
+static volatile sig_atomic_t stop_serving = 0;
+
+/* fnv-1a hash of a cache key */
+static unsigned long long key_hash(const char *s)
+{
+    unsigned long long h = 1469598103934665603ULL;
+
+    while (*s) {
+        h ^= (unsigned char)*s++;
+        h *= 1099511628211ULL;
+    }
+    return h;
+}
+
+/* unlink an entry from the lru list */
+static void lru_unlink(struct tile_entry *e)
+{
+    if (e->prev)
+        e->prev->next = e->next;
+    else
+        lru_head = e->next;
+    if (e->next)
+        e->next->prev = e->prev;
+    else
+        lru_tail = e->prev;
+    e->prev = e->next = NULL;
+}
+
+/* insert an entry at the front of the lru list */
+static void lru_push(struct tile_entry *e)
+{
+    e->prev = NULL;
+    e->next = lru_head;
+    if (lru_head)
+        lru_head->prev = e;
+    lru_head = e;
+    if (!lru_tail)
+        lru_tail = e;
+}
+
+/* find a cached response and mark it most recently used */
+static struct tile_entry *cache_get(const char *key)
+{
+    unsigned long long h = key_hash(key);
+    struct tile_entry *e;
+
+    for (e = buckets[h % CACHE_BUCKETS]; e; e = e->chain) {
+        if (e->hash == h && !strcmp(e->key, key)) {
+            lru_unlink(e);
+            lru_push(e);
+            return e;
+        }
+    }
+    return NULL;
+}
+
+/* drop the least recently used entry */
+static void cache_evict(void)
+{
+    struct tile_entry *e = lru_tail, **pp;
+
+    if (!e)
+        return;
+    lru_unlink(e);
+    for (pp = &buckets[e->hash % CACHE_BUCKETS]; *pp; pp = &(*pp)->chain) {
+        if (*pp == e) {
+            *pp = e->chain;
+            break;
+        }
+    }
+    cache_bytes -= e->len;
+    CPLFree(e->data);
+    free(e->key);
+    free(e);
+}
+
+/* add a response to the cache (taking ownership of data),
+ * evicting old entries to stay within serve_cache_mb */
+static struct tile_entry *cache_put(const char *key, GByte *data,
+                                    size_t len)
+{
+    size_t cap = (size_t)serve_cache_mb << 20;
+    struct tile_entry *e;
+
+    e = calloc(1, sizeof(*e));
+    if (e)
+        e->key = strdup(key);
+    if (!e || !e->key) {
+        free(e);
+        CPLFree(data);
+        return NULL;
+    }
+    e->hash = key_hash(e->key);
+    e->data = data;
+    e->len = len;
+
+    while (lru_tail && cache_bytes + len > cap)
+        cache_evict();
+
+    e->chain = buckets[e->hash % CACHE_BUCKETS];
+    buckets[e->hash % CACHE_BUCKETS] = e;
+    lru_push(e);
+    cache_bytes += len;
+    return e;
+}
+
+/* compare doubles for qsort */
+static int cmp_double(const void *a, const void *b)
+{
+    double x = *(const double *)a, y = *(const double *)b;
+
+    return (x > y) - (x < y);
+}
+
+/* p50 and p99 of the recorded latencies */
+static void latency_percentiles(double *p50, double *p99)
+{
+    double *tmp;
+    int n = lat_count < LAT_SAMPLES ? lat_count : LAT_SAMPLES;
+
+    *p50 = *p99 = 0;
+    if (n == 0)
+        return;
+    tmp = malloc((size_t)n * sizeof(double));
+    if (!tmp)
+        return;
+    memcpy(tmp, lat_ms, (size_t)n * sizeof(double));
+    qsort(tmp, n, sizeof(double), cmp_double);
+    *p50 = tmp[(n - 1) / 2];
+    *p99 = tmp[(int)((n - 1) * 0.99)];
+    free(tmp);
+}
+
+/* render one scenario on a grid and encode it as geotiff */
+static int
+render(gcn10_ctx *ctx, OGRSpatialReferenceH srs, int scen, const double *gt,
+       int xsize, int ysize, GByte **data, size_t *len)
+{
+    uint8_t *bufs[GCN10_N_SCENARIOS] = { 0 };
+    int rc;
+
+    bufs[scen] = malloc((size_t)xsize * ysize);
+    if (!bufs[scen])
+        return GCN10_ERR_NOMEM;
+    rc = gcn10_compute_grid(ctx, gt, xsize, ysize, bufs);
+    if (rc == GCN10_OK) {
+        *data = encode_geotiff(bufs[scen], xsize, ysize, gt, srs, len);
+        if (!*data)
+            rc = GCN10_ERR_NOMEM;
+    }
+    free(bufs[scen]);
+    return rc;
+}
+
+/* parse "/{cond}/{hc}/{arc}" prefix of a route; returns scenario or -1 */
+static int parse_scenario(const char *p, const char **rest)
+{
+    char cond[16], hc[8], arc[8];
+    int n = 0;
+
+    if (sscanf(p, "/%15[a-z]/%7[a-z]/%7[a-z]%n", cond, hc, arc, &n) != 3)
+        return -1;
+    *rest = p + n;
+    return gcn10_scenario_index(cond, hc, arc);
+}
+
+static void on_signal(int sig)
+{
+    (void)sig;
+    stop_serving = 1;
+}
+
+/* write all bytes to a socket */
+static void send_all(int fd, const void *buf, size_t len)
+{
+    const char *p = buf;
+    ssize_t n;
+
+    while (len > 0) {
+        n = send(fd, p, len, 0);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return;
+        p += n;
+        len -= (size_t)n;
+    }
+}
+
+/* send an http response */
+static void
+respond(int fd, int status, const char *type, const void *body, size_t len,
+        const char *cache)
+{
+    char hdr[256];
+    int n;
+
+    n = snprintf(hdr, sizeof(hdr),
+                 "HTTP/1.0 %d %s\r\nContent-Type: %s\r\n"
+                 "Content-Length: %zu\r\n%s%s%sConnection: close\r\n\r\n",
+                 status, status == 200 ? "OK" : status == 404 ?
+                 "Not Found" : status == 400 ? "Bad Request" :
+                 status == 408 ? "Request Timeout" :
+                 "Internal Server Error", type, len,
+                 cache ? "X-Cache: " : "", cache ? cache : "",
+                 cache ? "\r\n" : "");
+    send_all(fd, hdr, (size_t)n);
+    send_all(fd, body, len);
+}
+
+/* handle one request line; returns the http status sent */
+static int
+handle_request(int fd, const char *path, gcn10_ctx *ctx,
+               OGRSpatialReferenceH srs)
+{
+    const char *rest;
+    char text[1024];
+    double gt[6], src_gt[6], bbox[4], span, res, p50, p99;
+    int scen, z, x, y, xs, ys, src_xs, src_ys, rc, n;
+    struct tile_entry *e;
+    GByte *data;
+    size_t len;
+
+    if (!strcmp(path, "/stats")) {
+        latency_percentiles(&p50, &p99);
+        n = snprintf(text, sizeof(text),
+                     "{\"requests\": %lld, \"errors\": %lld, "
+                     "\"cache_hits\": %lld, \"cache_entries_bytes\": %zu, "
+                     "\"latency_p50_ms\": %.3f, \"latency_p99_ms\": %.3f}\n",
+                     n_requests, n_errors, n_hits, cache_bytes, p50, p99);
+        respond(fd, 200, "application/json", text, (size_t)n, NULL);
+        return 200;
+    }
+
+    /* cached response */
+    e = cache_get(path);
+    if (e) {
+        n_hits++;
+        respond(fd, 200, "image/tiff", e->data, e->len, "HIT");
+        return 200;
+    }
+
+    if (!strncmp(path, "/tile", 5)) {
+        /* /tile/{cond}/{hc}/{arc}/{z}/{x}/{y}.tif */
+        scen = parse_scenario(path + 5, &rest);
+        if (scen < 0 || sscanf(rest, "/%d/%d/%d", &z, &x, &y) != 3 ||
+            z < 0 || z > 24 || x < 0 || y < 0 ||
+            x >= (2 << z) || y >= (1 << z)) {
+            respond(fd, 400, "text/plain", "bad tile request\n", 17, NULL);
+            return 400;
+        }
+        span = 180.0 / (1 << z);
+        xs = ys = TILE_PX;
+        gt[0] = -180.0 + x * span;
+        gt[1] = span / TILE_PX;
+        gt[2] = 0;
+        gt[3] = 90.0 - y * span;
+        gt[4] = 0;
+        gt[5] = -span / TILE_PX;
+
+        /* low zooms would read the native inputs of a whole
+         * continent for 256x256 pixels */
+        bbox[0] = gt[0];
+        bbox[1] = 90.0 - (y + 1) * span;
+        bbox[2] = gt[0] + span;
+        bbox[3] = gt[3];
+        rc = gcn10_window_size(ctx, bbox, 0, &src_xs, &src_ys, src_gt);
+        if (rc != GCN10_OK ||
+            (double)src_xs * src_ys > serve_max_pixels) {
+            n = snprintf(text, sizeof(text), "tile rejected: %s\n",
+                         rc != GCN10_OK ? gcn10_strerror(rc) :
+                         "source window exceeds serve_max_pixels, "
+                         "use a higher zoom");
+            respond(fd, 400, "text/plain", text, (size_t)n, NULL);
+            return 400;
+        }
+    }
+    else if (!strncmp(path, "/bbox", 5)) {
+        /* /bbox/{cond}/{hc}/{arc}?bbox=minx,miny,maxx,maxy[&res=deg] */
+        scen = parse_scenario(path + 5, &rest);
+        res = 0;
+        if (scen < 0 || sscanf(rest, "?bbox=%lf,%lf,%lf,%lf", &bbox[0],
+                               &bbox[1], &bbox[2], &bbox[3]) != 4 ||
+            bbox[2] <= bbox[0] || bbox[3] <= bbox[1]) {
+            respond(fd, 400, "text/plain", "bad bbox request\n", 17, NULL);
+            return 400;
+        }
+        if (strstr(rest, "res="))
+            res = atof(strstr(rest, "res=") + 4);
+        rc = gcn10_window_size(ctx, bbox, res, &xs, &ys, gt);
+        if (rc != GCN10_OK || (double)xs * ys > serve_max_pixels) {
+            n = snprintf(text, sizeof(text), "window rejected: %s\n",
+                         rc != GCN10_OK ? gcn10_strerror(rc) :
+                         "exceeds serve_max_pixels");
+            respond(fd, 400, "text/plain", text, (size_t)n, NULL);
+            return 400;
+        }
+    }
+    else {
+        respond(fd, 404, "text/plain", "not found\n", 10, NULL);
+        return 404;
+    }
+
+    rc = render(ctx, srs, scen, gt, xs, ys, &data, &len);
+    if (rc != GCN10_OK) {
+        n = snprintf(text, sizeof(text), "%s\n", gcn10_strerror(rc));
+        respond(fd, 500, "text/plain", text, (size_t)n, NULL);
+        return 500;
+    }
+    e = cache_put(path, data, len);
+    if (!e) {
+        respond(fd, 500, "text/plain", "out of memory\n", 14, NULL);
+        return 500;
+    }
+    respond(fd, 200, "image/tiff", e->data, e->len, "MISS");
+    return 200;
+}
+
+/* open a listening socket on 127.0.0.1:port or unix:path */
+static int open_listener(const char *endpoint)
+{
+    int fd, one = 1;
+
+    if (!strncmp(endpoint, "unix:", 5)) {
+        struct sockaddr_un sa;
+
+        fd = socket(AF_UNIX, SOCK_STREAM, 0);
+        if (fd < 0)
+            return -1;
+        memset(&sa, 0, sizeof(sa));
+        sa.sun_family = AF_UNIX;
+        snprintf(sa.sun_path, sizeof(sa.sun_path), "%s", endpoint + 5);
+        unlink(sa.sun_path);
+        if (bind(fd, (struct sockaddr *)&sa, sizeof(sa)) != 0) {
+            close(fd);
+            return -1;
+        }
+    }
+    else {
+        struct sockaddr_in sa;
+
+        fd = socket(AF_INET, SOCK_STREAM, 0);
+        if (fd < 0)
+            return -1;
+        setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+        memset(&sa, 0, sizeof(sa));
+        sa.sin_family = AF_INET;
+        sa.sin_port = htons((unsigned short)atoi(endpoint));
+        sa.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        if (bind(fd, (struct sockaddr *)&sa, sizeof(sa)) != 0) {
+            close(fd);
+            return -1;
+        }
+    }
+    if (listen(fd, 64) != 0) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+/* serve requests until interrupted; returns 0 on clean shutdown */
+int serve(const char *endpoint)
+{
+    gcn10_ctx *ctx;
+    OGRSpatialReferenceH srs;
+    struct sigaction sa;
+    char req[4096], method[8], path[2048], msg[512];
+    struct timeval tv;
+    struct pollfd pfd;
+    double t0, left, p50, p99;
+    int lfd, fd, rc, status;
+    ssize_t n, got;
+
+    rc = gcn10_open(esa_data_path, hysogs_data_path, lookup_table_path,
+                    &ctx);
+    if (rc != GCN10_OK) {
+        snprintf(msg, sizeof(msg), "serve: cannot open inputs: %s",
+                 gcn10_strerror(rc));
+        log_message("ERROR", msg, true);
+        return 1;
+    }
+    srs = OSRNewSpatialReference(gcn10_srs_wkt(ctx));
+
+    lfd = open_listener(endpoint);
+    if (lfd < 0) {
+        snprintf(msg, sizeof(msg), "serve: cannot listen on %s: %s",
+                 endpoint, strerror(errno));
+        log_message("ERROR", msg, true);
+        OSRDestroySpatialReference(srs);
+        gcn10_close(ctx);
+        return 1;
+    }
+
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = on_signal;
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+    signal(SIGPIPE, SIG_IGN);
+
+    snprintf(msg, sizeof(msg),
+             "serving on %s (cache %d MB); try: curl -o t.tif "
+             "http://127.0.0.1:<port>/tile/drained/f/ii/8/100/50.tif",
+             endpoint, serve_cache_mb);
+    log_message("INFO", msg, true);
+
+    while (!stop_serving) {
+        fd = accept(lfd, NULL, NULL);
+        if (fd < 0) {
+            if (errno == EINTR)
+                continue;
+            break;
+        }
+        t0 = MPI_Wtime();
+
+        /* a client that stops reading cannot hold the loop either */
+        tv.tv_sec = (time_t)REQUEST_TIMEOUT;
+        tv.tv_usec = 0;
+        setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+
+        /* read the request head, within REQUEST_TIMEOUT in all; one
+         * slow client would otherwise stall every other */
+        got = 0;
+        left = REQUEST_TIMEOUT;
+        while (got < (ssize_t)sizeof(req) - 1) {
+            left = REQUEST_TIMEOUT - (MPI_Wtime() - t0);
+            pfd.fd = fd;
+            pfd.events = POLLIN;
+            if (left <= 0 || poll(&pfd, 1, (int)(left * 1e3) + 1) <= 0) {
+                left = 0;
+                break;
+            }
+            n = recv(fd, req + got, sizeof(req) - 1 - got, 0);
+            if (n <= 0)
+                break;
+            got += n;
+            req[got] = '\0';
+            if (strstr(req, "\r\n\r\n") || strstr(req, "\n\n"))
+                break;
+        }
+        req[got > 0 ? got : 0] = '\0';
+
+        if (left <= 0) {
+            respond(fd, 408, "text/plain", "request timeout\n", 16, NULL);
+            status = 408;
+        }
+        else if (sscanf(req, "%7s %2047s", method, path) != 2 ||
+                 strcmp(method, "GET") != 0) {
+            respond(fd, 400, "text/plain", "GET only\n", 9, NULL);
+            status = 400;
+        }
+        else {
+            status = handle_request(fd, path, ctx, srs);
+        }
+        close(fd);
+
+        n_requests++;
+        if (status != 200)
+            n_errors++;
+        lat_ms[lat_count++ % LAT_SAMPLES] = (MPI_Wtime() - t0) * 1e3;
+        if (n_requests % 100 == 0) {
+            latency_percentiles(&p50, &p99);
+            snprintf(msg, sizeof(msg),
+                     "serve: %lld requests, %lld cache hits, "
+                     "p50 %.2f ms, p99 %.2f ms", n_requests, n_hits, p50,
+                     p99);
+            log_message("INFO", msg, false);
+        }
+    }
+
+    latency_percentiles(&p50, &p99);
+    snprintf(msg, sizeof(msg),
+             "serve: stopped after %lld requests (%lld cache hits), "
+             "p50 %.2f ms, p99 %.2f ms", n_requests, n_hits, p50, p99);
+    log_message("INFO", msg, true);
+
+    close(lfd);
+    if (!strncmp(endpoint, "unix:", 5))
+        unlink(endpoint + 5);
+    while (lru_tail)
+        cache_evict();
+    OSRDestroySpatialReference(srs);
+    gcn10_close(ctx);
+    return 0;
+}
+
+#else
+
+int serve(const char *endpoint)
+{
+    (void)endpoint;
+    log_message("ERROR", "serve mode is not supported on windows", true);
+    return 1;
+}
+
+#endif
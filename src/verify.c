@@ -0,0 +1,418 @@
+/* golden-output checks for the cn kernels. every scenario is computed
+ * by the reference scalar path (hysogs adjusted for the drainage
+ * condition, then one table lookup per pixel) and compared with the
+ * production path (class keys through compiled luts, and delta
+ * rasters) by 64-bit fnv-1a hashes; on a mismatch the first differing
+ * pixel is reported as its (class, soil, scenario). --selftest runs
+ * this on synthetic grids and the listed blocks, and checks that the
+ * dynamic schedule splits large tail blocks; --verify compares an
+ * existing output tree with the reference */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <inttypes.h>
+#include <limits.h>
+#include "global.h"
+#include "gcn10.h"
+
+/* synthetic grid: every (class, soil) pair, then random pixels */
+#define SYNTH_PAIRS 65536
+#define SYNTH_RANDOM (1 << 20)
+
+/* work buffers of one grid */
+struct check_bufs {
+    uint8_t *soil, *ref, *got, *keys, *base;
+};
+
+static uint64_t fnv1a(const uint8_t *p, size_t n)
+{
+    uint64_t h = 14695981039346656037ULL;
+    size_t i;
+
+    for (i = 0; i < n; i++) {
+        h ^= p[i];
+        h *= 1099511628211ULL;
+    }
+    return h;
+}
+
+static void alloc_bufs(struct check_bufs *b, size_t npix)
+{
+    b->soil = malloc(npix);
+    b->ref = malloc(npix);
+    b->got = malloc(npix);
+    b->keys = malloc(npix);
+    b->base = malloc(npix);
+    if (!b->soil || !b->ref || !b->got || !b->keys || !b->base) {
+        log_message("ERROR", "malloc failed for check buffers", true);
+        MPI_Abort(MPI_COMM_WORLD, 1);
+    }
+}
+
+static void free_bufs(struct check_bufs *b)
+{
+    free(b->soil);
+    free(b->ref);
+    free(b->got);
+    free(b->keys);
+    free(b->base);
+}
+
+/* reference cn of scenario sc: the pre-lut scalar path */
+static void reference_cn(int sc, const uint8_t *esa, const uint8_t *hsg,
+                         size_t npix, uint8_t *soil, uint8_t *out)
+{
+    static int table[256][5];
+    int cond;
+
+    scenario_table(sc, table);
+    scenario_name(sc, &cond);
+    memcpy(soil, hsg, npix);
+    gcn10_adjust_hysogs(soil, npix, cond == 0);
+    memset(out, GCN10_NODATA, npix);
+    gcn10_calculate_cn(esa, soil, npix, table, out);
+}
+
+/* compare got with ref for scenario sc; logs the first differing
+ * pixel and returns 1 on a mismatch */
+static int compare(const char *where, const char *path, int sc,
+                   const uint8_t *esa, const uint8_t *hsg,
+                   const uint8_t *ref, const uint8_t *got, size_t npix)
+{
+    uint64_t hr, hg;
+    size_t i;
+    int cond;
+    const char *name;
+    char msg[1024];
+
+    hr = fnv1a(ref, npix);
+    hg = fnv1a(got, npix);
+    if (hr == hg && !memcmp(ref, got, npix))
+        return 0;
+
+    for (i = 0; i < npix && ref[i] == got[i]; i++)
+        ;
+    name = scenario_name(sc, &cond);
+    snprintf(msg, sizeof(msg),
+             "%s: %s differs for scenario %s_%s at pixel %zu: class %d, "
+             "soil %d, reference cn %d, got %d (hash %016" PRIx64
+             " vs %016" PRIx64 ")", where, path, gcn10_conds[cond], name, i,
+             esa[i], hsg[i], ref[i], got[i], hr, hg);
+    log_message("ERROR", msg, true);
+    return 1;
+}
+
+/* production luts over keys in runs of uneven lengths, the way a
+ * streamed or vectorized kernel sees its tails */
+static void apply_lut_chunked(const uint8_t *lut, const uint8_t *keys,
+                              size_t npix, uint8_t *out)
+{
+    static const size_t runs[] = { 1, 3, 17, 64, 255, 4099 };
+    size_t i = 0, n;
+    int r = 0;
+
+    while (i < npix) {
+        n = runs[r++ % 6];
+        if (n > npix - i)
+            n = npix - i;
+        gcn10_apply_lut(lut, keys + i, n, out + i);
+        i += n;
+    }
+}
+
+/* check every scenario of the production path on one grid of raw
+ * esa and hysogs values; returns the number of mismatches */
+static int check_grid(const char *where, const uint8_t *esa,
+                      const uint8_t *hsg, size_t npix, struct check_bufs *b)
+{
+    struct gcn10_keys keys;
+    uint8_t lut[256];
+    static int table[256][5];
+    int n_sc, sc, d, cond, dcond, t, bad = 0;
+    size_t i;
+
+    get_class_keys(&keys);
+    gcn10_classify(&keys, esa, hsg, npix, b->keys);
+
+    n_sc = scenario_count();
+    for (sc = 0; sc < n_sc; sc++) {
+        reference_cn(sc, esa, hsg, npix, b->soil, b->ref);
+        get_scenario_lut(sc, lut);
+
+        gcn10_apply_lut(lut, b->keys, npix, b->got);
+        bad += compare(where, "lut", sc, esa, hsg, b->ref, b->got, npix);
+        apply_lut_chunked(lut, b->keys, npix, b->got);
+        bad += compare(where, "chunked lut", sc, esa, hsg, b->ref, b->got,
+                       npix);
+
+        /* an undrained scenario as a delta over its drained one */
+        scenario_name(sc, &cond);
+        t = scenario_table(sc, table);
+        for (d = 0; d < sc; d++) {
+            scenario_name(d, &dcond);
+            if (dcond == 0 && scenario_table(d, NULL) == t)
+                break;
+        }
+        if (cond != 1 || d == sc)
+            continue;
+        reference_cn(d, esa, hsg, npix, b->soil, b->base);
+        gcn10_calculate_delta(esa, hsg, npix, table, b->got);
+        for (i = 0; i < npix; i++) {
+            if (b->got[i])
+                b->base[i] = b->got[i];
+        }
+        bad += compare(where, "delta over drained", sc, esa, hsg, b->ref,
+                       b->base, npix);
+    }
+    return bad;
+}
+
+/* schedule of 4 body blocks and a tail of 6 small and 2 large blocks
+ * on 8 ranks: each large block must be split in 4 parts, handed out
+ * ahead of the small ones */
+static int check_schedule(void)
+{
+    struct work_item *items;
+    double bboxes[12 * 4];
+    char msg[256];
+    int i, n_items, n_body, bad = 0;
+
+    for (i = 0; i < 12; i++) {
+        double size = i >= 10 ? 1.0 : 0.1;
+
+        bboxes[4 * i] = i;
+        bboxes[4 * i + 1] = 40.0;
+        bboxes[4 * i + 2] = i + size;
+        bboxes[4 * i + 3] = 40.0 + size;
+    }
+    items = sched_build_items(bboxes, 12, 8, &n_items, &n_body);
+    if (n_body != 4 || n_items != 4 + 2 * 4 + 6)
+        bad++;
+    for (i = n_body; !bad && i < n_items; i++) {
+        if (i < n_body + 8 ? items[i].block < 10 || items[i].n_parts != 4 :
+            items[i].n_parts != 1)
+            bad++;
+    }
+    free(items);
+    if (bad) {
+        snprintf(msg, sizeof(msg), "selftest: dynamic schedule of 8 tail "
+                 "blocks on 8 ranks gives %d items, large tail blocks "
+                 "not split in 4", n_items);
+        log_message("ERROR", msg, true);
+    }
+    return bad;
+}
+
+/* synthetic grid: all 65536 (class, soil) pairs, then random pixels
+ * drawn mostly from the classes of the tables and from valid soil
+ * codes, so every lut entry and every kernel branch is hit */
+static int check_synthetic(void)
+{
+    static const uint8_t soils[] = { 0, 1, 2, 3, 4, 11, 12, 13, 14, 255 };
+    struct gcn10_keys keys;
+    struct check_bufs b;
+    uint8_t *esa, *hsg;
+    uint32_t x = 2463534242u;
+    size_t npix = SYNTH_PAIRS + SYNTH_RANDOM, i;
+    int bad;
+
+    esa = malloc(npix);
+    hsg = malloc(npix);
+    if (!esa || !hsg) {
+        log_message("ERROR", "malloc failed for synthetic grid", true);
+        MPI_Abort(MPI_COMM_WORLD, 1);
+    }
+    alloc_bufs(&b, npix);
+    get_class_keys(&keys);
+
+    for (i = 0; i < SYNTH_PAIRS; i++) {
+        esa[i] = (uint8_t)(i >> 8);
+        hsg[i] = (uint8_t)i;
+    }
+    for (; i < npix; i++) {
+        x ^= x << 13;
+        x ^= x >> 17;
+        x ^= x << 5;
+        esa[i] = (x & 3) && keys.n_lc ? (uint8_t)keys.lc[(x >> 8) %
+                                                         keys.n_lc] :
+            (uint8_t)(x >> 8);
+        hsg[i] = (x >> 2 & 3) ? soils[(x >> 16) % 10] : (uint8_t)(x >> 24);
+    }
+
+    bad = check_grid("selftest synthetic", esa, hsg, npix, &b);
+    free_bufs(&b);
+    free(esa);
+    free(hsg);
+    return bad;
+}
+
+/* read block id (envelope bbox) as the production path sees it: esa
+ * at target_res, hysogs resampled onto its grid and masked to the
+ * aoi; false if a read fails */
+static bool load_block(int id, const double *bbox, uint8_t **esa,
+                       uint8_t **soil, int *xsize, int *ysize)
+{
+    OGRSpatialReferenceH srs, soil_srs;
+    uint8_t *coarse;
+    double gt[6], soil_gt[6];
+    int hsx, hsy;
+    char msg[256];
+
+    *esa = load_raster(esa_data_path, bbox, target_res, ARENA_ESA, xsize,
+                       ysize, gt, &srs);
+    if (!*esa) {
+        snprintf(msg, sizeof(msg), "esa load failed for block %d", id);
+        log_message("ERROR", msg, true);
+        return false;
+    }
+    OSRDestroySpatialReference(srs);
+    coarse = load_raster(hysogs_data_path, bbox, 0, ARENA_SOIL_COARSE, &hsx,
+                         &hsy, soil_gt, &soil_srs);
+    if (!coarse) {
+        snprintf(msg, sizeof(msg), "hysogs load failed for block %d", id);
+        log_message("ERROR", msg, true);
+        return false;
+    }
+    OSRDestroySpatialReference(soil_srs);
+
+    *soil = arena_get(ARENA_SOIL, (size_t)*xsize * *ysize);
+    gcn10_resample_nearest(coarse, hsx, hsy, soil_gt, *soil, *xsize,
+                           *ysize, gt);
+    if (use_aoi_mode)
+        aoi_mask(id, gt, *xsize, *ysize, *soil);
+    return true;
+}
+
+/* envelopes of the blocks (aoi windows) ids */
+static double *block_bboxes(const int *ids, int n)
+{
+    double *bboxes = use_aoi_mode ? aoi_tile_bboxes(ids, n) :
+        get_block_bboxes(ids, n);
+
+    if (!bboxes)
+        MPI_Abort(MPI_COMM_WORLD, 1);
+    return bboxes;
+}
+
+/* run the kernel checks on synthetic grids (rank 0) and on this rank's
+ * share of blocks ids; collective, returns the number of mismatches
+ * over all ranks */
+int selftest(const int *ids, int n)
+{
+    struct check_bufs b;
+    double *bboxes = NULL;
+    uint8_t *esa, *soil;
+    char where[64], msg[256];
+    int rank, size, k, i, xs, ys, bad = 0, total;
+
+    MPI_Comm_rank(MPI_COMM_WORLD, &rank);
+    MPI_Comm_size(MPI_COMM_WORLD, &size);
+
+    if (rank == 0)
+        bad += check_synthetic() + check_schedule();
+
+    if (n)
+        bboxes = block_bboxes(ids, n);
+    for (k = 0; k < sched_count_for_rank(rank, size, n); k++) {
+        i = sched_block_index(rank, size, n, k);
+        if (!load_block(ids[i], bboxes + 4 * i, &esa, &soil, &xs, &ys)) {
+            bad++;
+            continue;
+        }
+        alloc_bufs(&b, (size_t)xs * ys);
+        snprintf(where, sizeof(where), "selftest block %d", ids[i]);
+        bad += check_grid(where, esa, soil, (size_t)xs * ys, &b);
+        free_bufs(&b);
+    }
+    free(bboxes);
+
+    MPI_Allreduce(&bad, &total, 1, MPI_INT, MPI_SUM, MPI_COMM_WORLD);
+    if (rank == 0) {
+        snprintf(msg, sizeof(msg),
+                 "selftest: %d scenario(s) on synthetic grids and %d "
+                 "block(s): %d mismatch(es)", scenario_count(), n, total);
+        log_message(total ? "ERROR" : "INFO", msg, true);
+    }
+    return total;
+}
+
+/* compare the cn rasters of this rank's share of blocks ids under
+ * output tree root with the reference path; collective, returns the
+ * number of missing or differing rasters over all ranks */
+int verify_outputs(const char *root, const int *ids, int n)
+{
+    static const char *const exts[] = { ".tif", ".vrt" };
+    struct check_bufs b;
+    GDALDatasetH ds;
+    double *bboxes;
+    uint8_t *esa, *soil;
+    char path[PATH_MAX], where[64], msg[PATH_MAX + 128];
+    const char *name;
+    int rank, size, k, i, sc, e, cond, xs, ys, bad = 0, total;
+
+    MPI_Comm_rank(MPI_COMM_WORLD, &rank);
+    MPI_Comm_size(MPI_COMM_WORLD, &size);
+    if (output_crs) {
+        if (rank == 0)
+            log_message("ERROR", "verify: outputs warped to output_crs "
+                        "cannot be compared pixel by pixel", true);
+        return 1;
+    }
+
+    register_drivers();
+    bboxes = block_bboxes(ids, n);
+    for (k = 0; k < sched_count_for_rank(rank, size, n); k++) {
+        i = sched_block_index(rank, size, n, k);
+        if (!load_block(ids[i], bboxes + 4 * i, &esa, &soil, &xs, &ys)) {
+            bad++;
+            continue;
+        }
+        alloc_bufs(&b, (size_t)xs * ys);
+        snprintf(where, sizeof(where), "verify block %d", ids[i]);
+
+        for (sc = 0; sc < scenario_count(); sc++) {
+            name = scenario_name(sc, &cond);
+            for (e = 0, ds = NULL; e < 2 && !ds; e++) {
+                snprintf(path, sizeof(path), "%s/cn_rasters_%s/cn_%s_%d%s",
+                         root, gcn10_conds[cond], name, ids[i], exts[e]);
+                ds = GDALOpen(path, GA_ReadOnly);
+            }
+            if (!ds) {
+                snprintf(msg, sizeof(msg), "%s: no output for scenario "
+                         "%s_%s", where, gcn10_conds[cond], name);
+                log_message("ERROR", msg, true);
+                bad++;
+                continue;
+            }
+            if (GDALGetRasterXSize(ds) != xs ||
+                GDALGetRasterYSize(ds) != ys ||
+                GDALRasterIO(GDALGetRasterBand(ds, 1), GF_Read, 0, 0, xs,
+                             ys, b.got, xs, ys, GDT_Byte, 0,
+                             0) != CE_None) {
+                snprintf(msg, sizeof(msg), "%s: %s is not a %dx%d raster "
+                         "of the block", where, path, xs, ys);
+                log_message("ERROR", msg, true);
+                GDALClose(ds);
+                bad++;
+                continue;
+            }
+            GDALClose(ds);
+
+            reference_cn(sc, esa, soil, (size_t)xs * ys, b.soil, b.ref);
+            bad += compare(where, CPLGetFilename(path), sc, esa, soil,
+                           b.ref, b.got, (size_t)xs * ys);
+        }
+        free_bufs(&b);
+    }
+    free(bboxes);
+
+    MPI_Allreduce(&bad, &total, 1, MPI_INT, MPI_SUM, MPI_COMM_WORLD);
+    if (rank == 0) {
+        snprintf(msg, sizeof(msg),
+                 "verify %s: %d block(s) x %d scenario(s): %d missing or "
+                 "differing raster(s)", root, n, scenario_count(), total);
+        log_message(total ? "ERROR" : "INFO", msg, true);
+    }
+    return total;
+}
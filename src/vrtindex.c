@@ -0,0 +1,292 @@
+/* direct reads through a mosaic vrt: the vrt xml is parsed once into an
+ * index of its source files and their pixel rectangles, and a window is
+ * read by one RasterIO per covered source straight into the caller's
+ * buffer, so the vrt layer (source resolution and its open/close pool)
+ * is bypassed. the source driver reads only the internal tiles under
+ * the window and decodes them on read_threads threads (by default as
+ * many as GDAL_NUM_THREADS allows). vrts with anything but plain 1:1
+ * sources are left to gdal */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <cpl_minixml.h>
+#include <cpl_multiproc.h>
+#include "global.h"
+
+/* source datasets kept open between windows */
+#define VRT_OPEN_MAX 16
+
+struct mosaic_source {
+    char *path;
+    int src[2];                 /* source xoff, yoff */
+    int dst[4];                 /* mosaic xoff, yoff, xsize, ysize */
+};
+
+/* one vrt and its open sources, most recently used first; a vrt is
+ * only read by one thread at a time */
+struct vrt_index {
+    char *vrt;
+    bool usable;
+    int n;
+    struct mosaic_source *src;
+    uint8_t nodata;
+    struct {
+        const char *path;
+        GDALDatasetH ds;
+    } open[VRT_OPEN_MAX];
+    int n_open;
+};
+
+/* esa and hysogs are read on separate threads; the mutex guards the
+ * list of indexes, not the reads */
+static struct vrt_index indexes[2];
+static int n_indexes = 0;
+static CPLMutex *index_mutex = NULL;
+
+/* integer attribute name of element path of node, or -1 */
+static int xml_int(const CPLXMLNode *node, const char *path)
+{
+    const char *v = CPLGetXMLValue(node, path, NULL);
+    char *end;
+    double d;
+
+    if (!v)
+        return -1;
+    d = strtod(v, &end);
+    if (end == v || *end || d < 0 || d != (int)d)
+        return -1;
+    return (int)d;
+}
+
+/* add the source element s of vrt to idx; false if it needs anything
+ * the vrt layer would do for us (resampling, scaling, lookup tables,
+ * another band, or nodata and mask compositing, as sources are pasted
+ * opaquely in list order) */
+static bool add_source(struct vrt_index *idx, const char *vrt,
+                       const CPLXMLNode *s)
+{
+    const CPLXMLNode *c;
+    struct mosaic_source *v;
+    const char *name;
+    char *dir;
+    int sr[4], i;
+
+    if (strcmp(s->pszValue, "SimpleSource") &&
+        strcmp(s->pszValue, "ComplexSource"))
+        return false;
+    for (c = s->psChild; c; c = c->psNext) {
+        if (c->eType == CXT_Attribute && !strcmp(c->pszValue, "resampling"))
+            return false;
+        if (c->eType == CXT_Element &&
+            strcmp(c->pszValue, "SourceFilename") &&
+            strcmp(c->pszValue, "SourceBand") &&
+            strcmp(c->pszValue, "SourceProperties") &&
+            strcmp(c->pszValue, "SrcRect") &&
+            strcmp(c->pszValue, "DstRect") &&
+            strcmp(c->pszValue, "UseMaskBand"))
+            return false;
+    }
+    if (CPLTestBool(CPLGetXMLValue(s, "UseMaskBand", "false")))
+        return false;
+    if (strcmp(CPLGetXMLValue(s, "SourceBand", "1"), "1"))
+        return false;
+
+    v = realloc(idx->src, (idx->n + 1) * sizeof(*v));
+    if (!v) {
+        log_message("ERROR", "malloc failed for vrt index", true);
+        MPI_Abort(MPI_COMM_WORLD, 1);
+    }
+    idx->src = v;
+    v += idx->n;
+
+    sr[0] = xml_int(s, "SrcRect.xOff");
+    sr[1] = xml_int(s, "SrcRect.yOff");
+    sr[2] = xml_int(s, "SrcRect.xSize");
+    sr[3] = xml_int(s, "SrcRect.ySize");
+    v->dst[0] = xml_int(s, "DstRect.xOff");
+    v->dst[1] = xml_int(s, "DstRect.yOff");
+    v->dst[2] = xml_int(s, "DstRect.xSize");
+    v->dst[3] = xml_int(s, "DstRect.ySize");
+    for (i = 0; i < 4; i++) {
+        if (sr[i] < 0 || v->dst[i] < 0)
+            return false;
+    }
+    if (sr[2] != v->dst[2] || sr[3] != v->dst[3])
+        return false;
+    v->src[0] = sr[0];
+    v->src[1] = sr[1];
+
+    name = CPLGetXMLValue(s, "SourceFilename", "");
+    if (!*name)
+        return false;
+    if (!strcmp(CPLGetXMLValue(s, "SourceFilename.relativeToVRT", "0"),
+                "1")) {
+        dir = strdup(CPLGetPath(vrt));
+        if (!dir) {
+            log_message("ERROR", "malloc failed for vrt index", true);
+            MPI_Abort(MPI_COMM_WORLD, 1);
+        }
+        v->path = strdup(CPLProjectRelativeFilename(dir, name));
+        free(dir);
+    }
+    else {
+        v->path = strdup(name);
+    }
+    if (!v->path) {
+        log_message("ERROR", "malloc failed for vrt index", true);
+        MPI_Abort(MPI_COMM_WORLD, 1);
+    }
+    idx->n++;
+    return true;
+}
+
+/* parse vrt into idx; idx->usable stays false for vrts we cannot
+ * read directly, which then go through gdal as before */
+static void build_index(struct vrt_index *idx, const char *vrt)
+{
+    CPLXMLNode *root, *band, *c;
+    const char *nd;
+    char msg[512];
+    size_t len;
+
+    idx->vrt = strdup(vrt);
+    if (!idx->vrt) {
+        log_message("ERROR", "malloc failed for vrt index", true);
+        MPI_Abort(MPI_COMM_WORLD, 1);
+    }
+    len = strlen(vrt);
+    if (len < 4 || (strcmp(vrt + len - 4, ".vrt") &&
+                    strcmp(vrt + len - 4, ".VRT")))
+        return;
+
+    root = CPLParseXMLFile(vrt);
+    if (!root)
+        return;
+    band = CPLGetXMLNode(root, "=VRTDataset.VRTRasterBand");
+    if (band && !strcmp(CPLGetXMLValue(band, "dataType", "Byte"), "Byte") &&
+        !strcmp(CPLGetXMLValue(band, "subClass", ""), "")) {
+        idx->usable = true;
+        for (c = band->psChild; c && idx->usable; c = c->psNext) {
+            if (c->eType == CXT_Element && strstr(c->pszValue, "Source"))
+                idx->usable = add_source(idx, vrt, c);
+        }
+        nd = CPLGetXMLValue(band, "NoDataValue", "0");
+        idx->nodata = (uint8_t)atoi(nd);
+    }
+    CPLDestroyXMLNode(root);
+
+    snprintf(msg, sizeof(msg), idx->usable ?
+             "vrt %s: indexed %d sources for direct reads" :
+             "vrt %s: not a plain mosaic, read through gdal", vrt, idx->n);
+    log_message("INFO", msg, false);
+}
+
+/* open source path of idx, reusing a dataset from earlier windows */
+static GDALDatasetH open_source(struct vrt_index *idx, const char *path)
+{
+    GDALDatasetH ds;
+    char threads[32], *opts[2] = {NULL, NULL};
+    int i;
+
+    for (i = 0; i < idx->n_open; i++) {
+        if (idx->open[i].path == path)
+            break;
+    }
+    if (i < idx->n_open) {
+        ds = idx->open[i].ds;
+    }
+    else {
+        if (read_threads > 0) {
+            snprintf(threads, sizeof(threads), "NUM_THREADS=%d",
+                     read_threads);
+            opts[0] = threads;
+        }
+        ds = GDALOpenEx(path, GDAL_OF_RASTER | GDAL_OF_READONLY, NULL,
+                        (const char *const *)opts, NULL);
+        if (!ds)
+            return NULL;
+        if (idx->n_open == VRT_OPEN_MAX)
+            GDALClose(idx->open[--idx->n_open].ds);
+        i = idx->n_open++;
+    }
+
+    /* move to the front */
+    for (; i > 0; i--)
+        idx->open[i] = idx->open[i - 1];
+    idx->open[0].path = path;
+    idx->open[0].ds = ds;
+    return ds;
+}
+
+/* read native-resolution window win (from gcn10_window on the vrt at
+ * path) into buf of win[2] * win[3] bytes from the vrt sources; false
+ * if path is not a vrt that can be read this way or a source fails,
+ * in which case the caller reads through gdal */
+bool vrt_read_direct(const char *path, const int *win, uint8_t *buf)
+{
+    struct vrt_index *idx = NULL;
+    struct mosaic_source *s;
+    int i, x0, y0, x1, y1;
+    GDALDatasetH ds;
+
+    if (!vrt_direct || win[2] != win[4] || win[3] != win[5])
+        return false;
+    CPLCreateOrAcquireMutex(&index_mutex, 1000.0);
+    for (i = 0; i < n_indexes; i++) {
+        if (!strcmp(indexes[i].vrt, path))
+            idx = &indexes[i];
+    }
+    if (!idx && n_indexes < 2) {
+        idx = &indexes[n_indexes++];
+        build_index(idx, path);
+    }
+    CPLReleaseMutex(index_mutex);
+    if (!idx || !idx->usable)
+        return false;
+
+    memset(buf, idx->nodata, (size_t)win[2] * win[3]);
+    for (i = 0; i < idx->n; i++) {
+        s = &idx->src[i];
+        x0 = win[0] > s->dst[0] ? win[0] : s->dst[0];
+        y0 = win[1] > s->dst[1] ? win[1] : s->dst[1];
+        x1 = win[0] + win[2] < s->dst[0] + s->dst[2] ?
+            win[0] + win[2] : s->dst[0] + s->dst[2];
+        y1 = win[1] + win[3] < s->dst[1] + s->dst[3] ?
+            win[1] + win[3] : s->dst[1] + s->dst[3];
+        if (x0 >= x1 || y0 >= y1)
+            continue;
+
+        ds = open_source(idx, s->path);
+        if (!ds ||
+            GDALRasterIO(GDALGetRasterBand(ds, 1), GF_Read,
+                         s->src[0] + x0 - s->dst[0],
+                         s->src[1] + y0 - s->dst[1], x1 - x0, y1 - y0,
+                         buf + (size_t)(y0 - win[1]) * win[2] +
+                         (x0 - win[0]), x1 - x0, y1 - y0, GDT_Byte, 1,
+                         win[2]) != CE_None)
+            return false;
+    }
+    return true;
+}
+
+/* close open sources and free the indexes */
+void vrt_direct_release(void)
+{
+    int i, j;
+
+    for (i = 0; i < n_indexes; i++) {
+        for (j = 0; j < indexes[i].n_open; j++)
+            GDALClose(indexes[i].open[j].ds);
+        indexes[i].n_open = 0;
+        for (j = 0; j < indexes[i].n; j++)
+            free(indexes[i].src[j].path);
+        free(indexes[i].src);
+        free(indexes[i].vrt);
+    }
+    n_indexes = 0;
+    if (index_mutex) {
+        CPLDestroyMutex(index_mutex);
+        index_mutex = NULL;
+    }
+}
@@ -0,0 +1,475 @@
+/* in-pass zonal statistics: a polygon layer is rasterized onto each
+ * block grid and geodesic pixel areas are accumulated per zone and
+ * class key; cn histograms of every scenario follow from the key areas
+ * through the scenario luts, so they are exact without touching the
+ * cn rasters. partial sums are gathered to rank 0 and written as csv */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+#include "global.h"
+#include "gcn10.h"
+
+/* block rows rasterized at a time */
+#define ZONE_BAND_ROWS 512
+
+/* zones sent per rank and gather round */
+#define ZONE_CHUNK 1024
+
+/* points per block edge that locate a block in a zone layer of
+ * another crs */
+#define ZONE_EDGE_POINTS 8
+
+/* per-zone area (m^2) of every class key */
+struct zone_acc {
+    long long id;
+    double area[256];
+};
+
+/* zones touched on this rank, indexed by an open-addressing table
+ * of zone index + 1 (0 = empty) */
+static struct zone_acc *zones = NULL;
+static int n_zones = 0, cap_zones = 0;
+static int *slots = NULL;
+static int n_slots = 0;
+
+/* zone layer, opened on first use */
+static OGRDataSourceH zone_ds = NULL;
+static OGRLayerH zone_layer = NULL;
+static int zone_fld = -1;
+static bool zone_failed = false;
+
+/* zone layer crs to esa crs and back, when they differ */
+static OGRCoordinateTransformationH zone_ct = NULL, zone_back = NULL;
+
+static unsigned int hash_id(long long id, int mask)
+{
+    unsigned long long h = (unsigned long long)id * 0x9e3779b97f4a7c15ULL;
+
+    return (unsigned int)(h >> 32) & mask;
+}
+
+/* rebuild the slot table at twice the size */
+static void grow_slots(void)
+{
+    int i, n, *s;
+    unsigned int j;
+    char msg[128];
+
+    n = n_slots ? n_slots * 2 : 1024;
+    s = calloc(n, sizeof(int));
+    if (!s) {
+        snprintf(msg, sizeof(msg), "malloc failed for %d zone slots", n);
+        log_message("ERROR", msg, true);
+        MPI_Abort(MPI_COMM_WORLD, 1);
+    }
+    for (i = 0; i < n_zones; i++) {
+        j = hash_id(zones[i].id, n - 1);
+        while (s[j])
+            j = (j + 1) & (n - 1);
+        s[j] = i + 1;
+    }
+    free(slots);
+    slots = s;
+    n_slots = n;
+}
+
+/* index of zone id, inserting an empty accumulator if new */
+static int zone_index(long long id)
+{
+    struct zone_acc *z;
+    unsigned int j;
+    char msg[128];
+
+    if (2 * (n_zones + 1) > n_slots)
+        grow_slots();
+    j = hash_id(id, n_slots - 1);
+    while (slots[j]) {
+        if (zones[slots[j] - 1].id == id)
+            return slots[j] - 1;
+        j = (j + 1) & (n_slots - 1);
+    }
+
+    if (n_zones == cap_zones) {
+        cap_zones = cap_zones ? cap_zones * 2 : 64;
+        z = realloc(zones, cap_zones * sizeof(*z));
+        if (!z) {
+            snprintf(msg, sizeof(msg), "malloc failed for %d zones",
+                     cap_zones);
+            log_message("ERROR", msg, true);
+            MPI_Abort(MPI_COMM_WORLD, 1);
+        }
+        zones = z;
+    }
+    memset(&zones[n_zones], 0, sizeof(zones[0]));
+    zones[n_zones].id = id;
+    slots[j] = n_zones + 1;
+    return n_zones++;
+}
+
+/* open the zone layer and resolve the id field; zones are reprojected
+ * to srs, the esa crs, when the layer declares a different one */
+static bool zones_open(OGRSpatialReferenceH srs)
+{
+    OGRSpatialReferenceH lsrs, esrs;
+    char msg[PATH_MAX + 64];
+
+    if (zone_layer || zone_failed)
+        return zone_layer != NULL;
+
+    zone_failed = true;
+    zone_ds = OGROpen(zones_path, FALSE, NULL);
+    if (!zone_ds) {
+        snprintf(msg, sizeof(msg), "ogr open failed: %s", zones_path);
+        log_message("ERROR", msg, true);
+        return false;
+    }
+    zone_layer = OGR_DS_GetLayer(zone_ds, 0);
+    zone_fld = OGR_FD_GetFieldIndex(OGR_L_GetLayerDefn(zone_layer),
+                                    zone_field);
+    if (zone_fld < 0) {
+        snprintf(msg, sizeof(msg), "zone field %s not found in %s",
+                 zone_field, zones_path);
+        log_message("ERROR", msg, true);
+        OGR_DS_Destroy(zone_ds);
+        zone_ds = NULL;
+        zone_layer = NULL;
+        return false;
+    }
+
+    lsrs = OGR_L_GetSpatialRef(zone_layer);
+    if (lsrs && srs && !OSRIsSame(lsrs, srs)) {
+        esrs = OSRClone(srs);
+        OSRSetAxisMappingStrategy(esrs, OAMS_TRADITIONAL_GIS_ORDER);
+        zone_ct = OCTNewCoordinateTransformation(lsrs, esrs);
+        zone_back = OCTNewCoordinateTransformation(esrs, lsrs);
+        OSRDestroySpatialReference(esrs);
+        if (!zone_ct || !zone_back) {
+            snprintf(msg, sizeof(msg), "cannot reproject %s to the esa crs",
+                     zones_path);
+            log_message("ERROR", msg, true);
+            if (zone_ct)
+                OCTDestroyCoordinateTransformation(zone_ct);
+            if (zone_back)
+                OCTDestroyCoordinateTransformation(zone_back);
+            zone_ct = zone_back = NULL;
+            OGR_DS_Destroy(zone_ds);
+            zone_ds = NULL;
+            zone_layer = NULL;
+            return false;
+        }
+    }
+    zone_failed = false;
+    return true;
+}
+
+/* envelope in the zone layer crs of bbox, from points along its edges;
+ * false if none of them can be transformed */
+static bool layer_bbox(const double *bbox, double *env)
+{
+    double x[4 * ZONE_EDGE_POINTS], y[4 * ZONE_EDGE_POINTS], f, w, h;
+    int ok[4 * ZONE_EDGE_POINTS], i, e = ZONE_EDGE_POINTS;
+    bool any = false;
+
+    w = bbox[2] - bbox[0];
+    h = bbox[3] - bbox[1];
+    for (i = 0; i < e; i++) {
+        f = (double)i / e;
+        x[i] = bbox[0] + f * w;
+        y[i] = bbox[1];
+        x[e + i] = bbox[2];
+        y[e + i] = bbox[1] + f * h;
+        x[2 * e + i] = bbox[2] - f * w;
+        y[2 * e + i] = bbox[3];
+        x[3 * e + i] = bbox[0];
+        y[3 * e + i] = bbox[3] - f * h;
+    }
+    OCTTransformEx(zone_back, 4 * e, x, y, NULL, ok);
+
+    env[0] = env[1] = HUGE_VAL;
+    env[2] = env[3] = -HUGE_VAL;
+    for (i = 0; i < 4 * e; i++) {
+        if (!ok[i])
+            continue;
+        env[0] = fmin(env[0], x[i]);
+        env[1] = fmin(env[1], y[i]);
+        env[2] = fmax(env[2], x[i]);
+        env[3] = fmax(env[3], y[i]);
+        any = true;
+    }
+    return any;
+}
+
+/* rasterize zones over the block grid (xsize x ysize, gt, srs) and add
+ * the pixel areas of every valid class key to its zone */
+void zones_accumulate(const double *bbox, const uint8_t *keys, int xsize,
+                      int ysize, const double *gt, OGRSpatialReferenceH srs)
+{
+    OGRFeatureH feat;
+    OGRGeometryH *geoms, g;
+    GDALDriverH drv;
+    GDALDatasetH mem;
+    double *burn, bgt[6], area, env[4];
+    int *zbuf, n, cap, i, x, y0, rows, r, band = 1;
+    char msg[256];
+
+    if (!zones_open(srs))
+        return;
+
+    /* zones overlapping the block */
+    memcpy(env, bbox, sizeof(env));
+    if (zone_back && !layer_bbox(bbox, env))
+        return;
+    OGR_L_SetSpatialFilterRect(zone_layer, env[0], env[1], env[2], env[3]);
+    OGR_L_ResetReading(zone_layer);
+    geoms = NULL;
+    burn = NULL;
+    n = cap = 0;
+    while ((feat = OGR_L_GetNextFeature(zone_layer))) {
+        g = OGR_F_GetGeometryRef(feat);
+        if (g) {
+            g = OGR_G_Clone(g);
+            if (zone_ct && OGR_G_Transform(g, zone_ct) != OGRERR_NONE) {
+                OGR_G_DestroyGeometry(g);
+                OGR_F_Destroy(feat);
+                continue;
+            }
+            if (n == cap) {
+                cap = cap ? cap * 2 : 16;
+                geoms = realloc(geoms, cap * sizeof(*geoms));
+                burn = realloc(burn, cap * sizeof(*burn));
+                if (!geoms || !burn) {
+                    log_message("ERROR", "malloc failed for zone list",
+                                true);
+                    MPI_Abort(MPI_COMM_WORLD, 1);
+                }
+            }
+            geoms[n] = g;
+            burn[n] = zone_index(OGR_F_GetFieldAsInteger64(feat, zone_fld))
+                + 1;
+            n++;
+        }
+        OGR_F_Destroy(feat);
+    }
+    OGR_L_SetSpatialFilter(zone_layer, NULL);
+    if (!n)
+        return;
+
+    /* rasterize in row bands to bound the zone buffer */
+    drv = GDALGetDriverByName("MEM");
+    rows = ysize < ZONE_BAND_ROWS ? ysize : ZONE_BAND_ROWS;
+    zbuf = malloc((size_t)xsize * rows * sizeof(int));
+    if (!zbuf) {
+        log_message("ERROR", "malloc failed for zone raster", true);
+        MPI_Abort(MPI_COMM_WORLD, 1);
+    }
+    memcpy(bgt, gt, sizeof(bgt));
+    for (y0 = 0; y0 < ysize; y0 += rows) {
+        rows = ysize - y0 < ZONE_BAND_ROWS ? ysize - y0 : ZONE_BAND_ROWS;
+        bgt[3] = gt[3] + y0 * gt[5];
+        mem = GDALCreate(drv, "", xsize, rows, 1, GDT_Int32, NULL);
+        if (!mem) {
+            log_message("ERROR", "cannot create zone raster", true);
+            break;
+        }
+        GDALSetGeoTransform(mem, bgt);
+        if (GDALRasterizeGeometries(mem, 1, &band, n, geoms, NULL, NULL,
+                                    burn, NULL, NULL, NULL) != CE_None ||
+            GDALRasterIO(GDALGetRasterBand(mem, 1), GF_Read, 0, 0, xsize,
+                         rows, zbuf, xsize, rows, GDT_Int32, 0,
+                         0) != CE_None) {
+            snprintf(msg, sizeof(msg), "zone rasterization failed, rows %d+",
+                     y0);
+            log_message("ERROR", msg, true);
+            GDALClose(mem);
+            break;
+        }
+        GDALClose(mem);
+
+        for (r = 0; r < rows; r++) {
+            const uint8_t *krow = keys + (size_t)(y0 + r) * xsize;
+            const int *zrow = zbuf + (size_t)r * xsize;
+
+            area = geodesic_pixel_area(gt, y0 + r);
+            for (x = 0; x < xsize; x++) {
+                if (zrow[x] && krow[x] != GCN10_NODATA)
+                    zones[zrow[x] - 1].area[krow[x]] += area;
+            }
+        }
+    }
+
+    free(zbuf);
+    for (i = 0; i < n; i++)
+        OGR_G_DestroyGeometry(geoms[i]);
+    free(geoms);
+    free(burn);
+}
+
+static int cmp_zone(const void *a, const void *b)
+{
+    const struct zone_acc *za = a, *zb = b;
+
+    return (za->id > zb->id) - (za->id < zb->id);
+}
+
+/* write one row per zone and scenario: area with a cn, area-weighted
+ * mean cn and the area of every cn value 0-100; runs without writes
+ * only compute the sums */
+static void write_zone_table(const char *path)
+{
+    FILE *f;
+    uint8_t (*lut)[256];
+    double hist[101], total, sum;
+    int i, sc, n_sc, k, v, cond;
+    const char *name;
+    char msg[PATH_MAX + 64];
+
+    if (run_phase != RUN_ALL)
+        return;
+
+    n_sc = scenario_count();
+    lut = malloc((n_sc ? n_sc : 1) * sizeof(*lut));
+    if (!lut) {
+        log_message("ERROR", "malloc failed for zone table luts", true);
+        return;
+    }
+    for (sc = 0; sc < n_sc; sc++)
+        get_scenario_lut(sc, lut[sc]);
+
+    f = fopen(path, "w");
+    if (!f) {
+        snprintf(msg, sizeof(msg), "cannot write zonal statistics %s", path);
+        log_message("ERROR", msg, true);
+        free(lut);
+        return;
+    }
+    fprintf(f, "zone_id,cond,scenario,area_m2,mean_cn");
+    for (v = 0; v <= 100; v++)
+        fprintf(f, ",cn_%d", v);
+    fprintf(f, "\n");
+
+    qsort(zones, n_zones, sizeof(zones[0]), cmp_zone);
+    for (i = 0; i < n_zones; i++) {
+        for (sc = 0; sc < n_sc; sc++) {
+            memset(hist, 0, sizeof(hist));
+            for (k = 0; k < 256; k++) {
+                if (lut[sc][k] <= 100)
+                    hist[lut[sc][k]] += zones[i].area[k];
+            }
+            total = sum = 0;
+            for (v = 0; v <= 100; v++) {
+                total += hist[v];
+                sum += hist[v] * v;
+            }
+            name = scenario_name(sc, &cond);
+            fprintf(f, "%lld,%s,%s,%.1f,%.3f", zones[i].id,
+                    gcn10_conds[cond], name, total,
+                    total > 0 ? sum / total : 0.0);
+            for (v = 0; v <= 100; v++)
+                fprintf(f, ",%.1f", hist[v]);
+            fprintf(f, "\n");
+        }
+    }
+    fclose(f);
+    free(lut);
+
+    snprintf(msg, sizeof(msg), "zonal statistics for %d zones written to %s",
+             n_zones, path);
+    log_message("INFO", msg, true);
+}
+
+/* gather every rank's zone sums to rank 0 in rounds of ZONE_CHUNK
+ * zones per rank, merge them and write the zone table; collective */
+void zones_finalize(int rank, int size)
+{
+    long long *ids, *all_ids;
+    double *areas, *all_areas;
+    int rounds, local_rounds, round, i, j, n, total, idx;
+    int *counts, *displs, *acounts, *adispls;
+
+    local_rounds = (n_zones + ZONE_CHUNK - 1) / ZONE_CHUNK;
+    MPI_Allreduce(&local_rounds, &rounds, 1, MPI_INT, MPI_MAX,
+                  MPI_COMM_WORLD);
+
+    ids = malloc(ZONE_CHUNK * sizeof(long long));
+    areas = malloc(ZONE_CHUNK * 256 * sizeof(double));
+    counts = malloc(4 * size * sizeof(int));
+    all_ids = NULL;
+    all_areas = NULL;
+    if (!ids || !areas || !counts) {
+        log_message("ERROR", "malloc failed for zone reduction", true);
+        MPI_Abort(MPI_COMM_WORLD, 1);
+    }
+    displs = counts + size;
+    acounts = counts + 2 * size;
+    adispls = counts + 3 * size;
+
+    /* rank 0 keeps its own sums in place and merges the others */
+    for (round = 0; round < rounds; round++) {
+        n = 0;
+        if (rank != 0) {
+            for (i = round * ZONE_CHUNK;
+                 i < n_zones && n < ZONE_CHUNK; i++, n++) {
+                ids[n] = zones[i].id;
+                memcpy(areas + (size_t)n * 256, zones[i].area,
+                       sizeof(zones[i].area));
+            }
+        }
+        MPI_Gather(&n, 1, MPI_INT, counts, 1, MPI_INT, 0, MPI_COMM_WORLD);
+
+        total = 0;
+        if (rank == 0) {
+            for (j = 0; j < size; j++) {
+                displs[j] = total;
+                acounts[j] = counts[j] * 256;
+                adispls[j] = total * 256;
+                total += counts[j];
+            }
+            all_ids = realloc(all_ids, (total ? total : 1) *
+                              sizeof(long long));
+            all_areas = realloc(all_areas, (total ? total : 1) * 256 *
+                                sizeof(double));
+            if (!all_ids || !all_areas) {
+                log_message("ERROR", "malloc failed for zone reduction",
+                            true);
+                MPI_Abort(MPI_COMM_WORLD, 1);
+            }
+        }
+        MPI_Gatherv(ids, n, MPI_LONG_LONG, all_ids, counts, displs,
+                    MPI_LONG_LONG, 0, MPI_COMM_WORLD);
+        MPI_Gatherv(areas, n * 256, MPI_DOUBLE, all_areas, acounts, adispls,
+                    MPI_DOUBLE, 0, MPI_COMM_WORLD);
+
+        if (rank == 0) {
+            for (i = 0; i < total; i++) {
+                idx = zone_index(all_ids[i]);
+                for (j = 0; j < 256; j++)
+                    zones[idx].area[j] += all_areas[(size_t)i * 256 + j];
+            }
+        }
+    }
+
+    if (rank == 0)
+        write_zone_table(zones_csv_path);
+
+    free(all_ids);
+    free(all_areas);
+    free(ids);
+    free(areas);
+    free(counts);
+    free(zones);
+    free(slots);
+    zones = NULL;
+    slots = NULL;
+    n_zones = cap_zones = n_slots = 0;
+    if (zone_ds)
+        OGR_DS_Destroy(zone_ds);
+    zone_ds = NULL;
+    zone_layer = NULL;
+    if (zone_ct)
+        OCTDestroyCoordinateTransformation(zone_ct);
+    if (zone_back)
+        OCTDestroyCoordinateTransformation(zone_back);
+    zone_ct = zone_back = NULL;
+}